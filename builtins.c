@@ -7,25 +7,25 @@
 //
 
 static lvm_atom_p lvm_add(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 2 || argv[0]->type != LVM_T_NUM || argv[1]->type != LVM_T_NUM)
+	if (argc != 2 || lvm_atom_type(argv[0]) != LVM_T_NUM || lvm_atom_type(argv[1]) != LVM_T_NUM)
 		return lvm_error_atom(lvm, "lvm_add(): supports only two number arguments");
 	return lvm_num_atom(lvm, argv[0]->num + argv[1]->num);
 }
 
 static lvm_atom_p lvm_sub(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 2 || argv[0]->type != LVM_T_NUM || argv[1]->type != LVM_T_NUM)
+	if (argc != 2 || lvm_atom_type(argv[0]) != LVM_T_NUM || lvm_atom_type(argv[1]) != LVM_T_NUM)
 		return lvm_error_atom(lvm, "lvm_sub(): supports only two number arguments");
 	return lvm_num_atom(lvm, argv[0]->num - argv[1]->num);
 }
 
 static lvm_atom_p lvm_mul(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 2 || argv[0]->type != LVM_T_NUM || argv[1]->type != LVM_T_NUM)
+	if (argc != 2 || lvm_atom_type(argv[0]) != LVM_T_NUM || lvm_atom_type(argv[1]) != LVM_T_NUM)
 		return lvm_error_atom(lvm, "lvm_mul(): supports only two number arguments");
 	return lvm_num_atom(lvm, argv[0]->num * argv[1]->num);
 }
 
 static lvm_atom_p lvm_div(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 2 || argv[0]->type != LVM_T_NUM || argv[1]->type != LVM_T_NUM)
+	if (argc != 2 || lvm_atom_type(argv[0]) != LVM_T_NUM || lvm_atom_type(argv[1]) != LVM_T_NUM)
 		return lvm_error_atom(lvm, "lvm_div(): supports only two number arguments");
 	return lvm_num_atom(lvm, argv[0]->num / argv[1]->num);
 }
@@ -38,15 +38,15 @@ static lvm_atom_p lvm_cons(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p
 }
 
 static lvm_atom_p lvm_first(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 1 || argv[0]->type != LVM_T_PAIR)
+	if (argc != 1 || lvm_atom_type(argv[0]) != LVM_T_PAIR)
 		return lvm_error_atom(lvm, "lvm_first(): supports only one pair argument");
-	return argv[0]->first;
+	return lvm_pair_first(argv[0]);
 }
 
 static lvm_atom_p lvm_rest(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 1 || argv[0]->type != LVM_T_PAIR)
+	if (argc != 1 || lvm_atom_type(argv[0]) != LVM_T_PAIR)
 		return lvm_error_atom(lvm, "lvm_rest(): supports only one pair argument");
-	return argv[0]->rest;
+	return lvm_pair_rest(argv[0]);
 }
 
 
@@ -56,19 +56,19 @@ static lvm_atom_p lvm_eq(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p en
 	lvm_atom_p a = argv[0], b = argv[1];
 	if (a == b) {
 		return lvm_true_atom(lvm);
-	} else if (a->type == LVM_T_NUM && b->type == LVM_T_NUM) {
+	} else if (lvm_atom_type(a) == LVM_T_NUM && lvm_atom_type(b) == LVM_T_NUM) {
 		return (a->num == b->num) ? lvm_true_atom(lvm) : lvm_false_atom(lvm);
-	} else if (a->type == LVM_T_STR && b->type == LVM_T_STR) {
+	} else if (lvm_atom_type(a) == LVM_T_STR && lvm_atom_type(b) == LVM_T_STR) {
 		return strcmp(a->str, b->str) == 0 ? lvm_true_atom(lvm) : lvm_false_atom(lvm);
-	} else if (a->type == LVM_T_PAIR && b->type == LVM_T_PAIR) {
-		lvm_arg_stack_push(lvm, a->first);
-		lvm_arg_stack_push(lvm, b->first);
-		bool first_equal = lvm_eq(lvm, 2, lvm->arg_stack_ptr + lvm->arg_stack_length - 2, env)->type == LVM_T_TRUE;
+	} else if (lvm_atom_type(a) == LVM_T_PAIR && lvm_atom_type(b) == LVM_T_PAIR) {
+		lvm_arg_stack_push(lvm, lvm_pair_first(a));
+		lvm_arg_stack_push(lvm, lvm_pair_first(b));
+		bool first_equal = lvm_atom_type(lvm_eq(lvm, 2, lvm->arg_stack_ptr + lvm->arg_stack_length - 2, env)) == LVM_T_TRUE;
 		lvm_arg_stack_drop(lvm, 2);
 		
-		lvm_arg_stack_push(lvm, a->rest);
-		lvm_arg_stack_push(lvm, b->rest);
-		bool rest_equal = lvm_eq(lvm, 2, lvm->arg_stack_ptr + lvm->arg_stack_length - 2, env)->type == LVM_T_TRUE;
+		lvm_arg_stack_push(lvm, lvm_pair_rest(a));
+		lvm_arg_stack_push(lvm, lvm_pair_rest(b));
+		bool rest_equal = lvm_atom_type(lvm_eq(lvm, 2, lvm->arg_stack_ptr + lvm->arg_stack_length - 2, env)) == LVM_T_TRUE;
 		lvm_arg_stack_drop(lvm, 2);
 		
 		return (first_equal && rest_equal) ? lvm_true_atom(lvm) : lvm_false_atom(lvm);
@@ -77,18 +77,101 @@ static lvm_atom_p lvm_eq(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p en
 }
 
 static lvm_atom_p lvm_lt(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 2 || argv[0]->type != LVM_T_NUM || argv[1]->type != LVM_T_NUM)
+	if (argc != 2 || lvm_atom_type(argv[0]) != LVM_T_NUM || lvm_atom_type(argv[1]) != LVM_T_NUM)
 		return lvm_error_atom(lvm, "lvm_lt(): supports only two numbers");
 	return (argv[0]->num < argv[1]->num) ? lvm_true_atom(lvm) : lvm_false_atom(lvm);
 }
 
 static lvm_atom_p lvm_gt(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
-	if (argc != 2 || argv[0]->type != LVM_T_NUM || argv[1]->type != LVM_T_NUM)
+	if (argc != 2 || lvm_atom_type(argv[0]) != LVM_T_NUM || lvm_atom_type(argv[1]) != LVM_T_NUM)
 		return lvm_error_atom(lvm, "lvm_gt(): supports only two numbers");
 	return (argv[0]->num > argv[1]->num) ? lvm_true_atom(lvm) : lvm_false_atom(lvm);
 }
 
 
+static lvm_atom_p lvm_weak(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
+	if (argc != 1)
+		return lvm_error_atom(lvm, "lvm_weak(): supports only one argument");
+	return lvm_weak_atom(lvm, argv[0]);
+}
+
+static lvm_atom_p lvm_weak_get(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
+	if (argc != 1 || lvm_atom_type(argv[0]) != LVM_T_WEAK)
+		return lvm_error_atom(lvm, "lvm_weak_get(): supports only one weak reference argument");
+	return argv[0]->target;
+}
+
+static lvm_atom_p lvm_weak_table(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
+	if (argc != 0)
+		return lvm_error_atom(lvm, "lvm_weak_table(): takes no arguments");
+	return lvm_weak_table_atom(lvm);
+}
+
+static lvm_atom_p lvm_weak_table_get_builtin(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
+	if (argc != 2 || lvm_atom_type(argv[0]) != LVM_T_WEAK_TABLE)
+		return lvm_error_atom(lvm, "lvm_weak_table_get_builtin(): supports only a weak table and a key");
+	lvm_atom_p value = lvm_weak_table_get(lvm, argv[0], argv[1]);
+	return (value != NULL) ? value : lvm_nil_atom(lvm);
+}
+
+static lvm_atom_p lvm_weak_table_put_builtin(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
+	if (argc != 3 || lvm_atom_type(argv[0]) != LVM_T_WEAK_TABLE)
+		return lvm_error_atom(lvm, "lvm_weak_table_put_builtin(): supports only a weak table, a key and a value");
+	lvm_weak_table_put(lvm, argv[0], argv[1], argv[2]);
+	return argv[2];
+}
+
+
+#ifdef GC_REGION_BAKER
+static lvm_atom_p lvm_gc_stats_pair(lvm_p lvm, char* name, int64_t value, lvm_atom_p rest) {
+	return lvm_pair_atom(lvm, lvm_pair_atom(lvm, lvm_sym_atom(lvm, name), lvm_num_atom(lvm, value)), rest);
+}
+
+/**
+ * Returns the GC statistics as an association list, e.g.
+ * ((collections . 3) (total-pause-us . 1200) ... (pause-histogram 2 1 0 ...)).
+ * Times are in microseconds and survival rates in percent since we only have
+ * integer numbers.
+ */
+static lvm_atom_p lvm_gc_stats_builtin(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
+	if (argc != 0)
+		return lvm_error_atom(lvm, "lvm_gc_stats_builtin(): takes no arguments");
+	
+	lvm_gc_stats_t stats;
+	lvm_gc_stats(lvm, &stats);
+	
+	lvm_atom_p histogram = lvm_nil_atom(lvm);
+	for(size_t i = LVM_GC_PAUSE_HISTOGRAM_BUCKETS; i > 0; i--)
+		histogram = lvm_pair_atom(lvm, lvm_num_atom(lvm, stats.pause_histogram[i-1]), histogram);
+	
+	lvm_atom_p list = lvm_pair_atom(lvm, lvm_pair_atom(lvm, lvm_sym_atom(lvm, "pause-histogram"), histogram), lvm_nil_atom(lvm));
+	list = lvm_gc_stats_pair(lvm, "memory-pressure",       stats.memory_pressure,     list);
+	list = lvm_gc_stats_pair(lvm, "memory-limit",          stats.memory_limit,        list);
+	list = lvm_gc_stats_pair(lvm, "allocation-budget",     stats.allocation_budget,   list);
+	list = lvm_gc_stats_pair(lvm, "pretenured-sites",      stats.pretenured_sites,    list);
+	list = lvm_gc_stats_pair(lvm, "regions-to-sweep",      stats.regions_to_sweep,    list);
+	list = lvm_gc_stats_pair(lvm, "swept-regions",         stats.swept_regions,       list);
+	list = lvm_gc_stats_pair(lvm, "string-dedup-bytes",    stats.string_dedup_bytes,  list);
+	list = lvm_gc_stats_pair(lvm, "finalized-atoms",       stats.finalized_atoms,     list);
+	list = lvm_gc_stats_pair(lvm, "weak-refs-cleared",     stats.weak_refs_cleared,   list);
+	list = lvm_gc_stats_pair(lvm, "pinned-regions",        stats.pinned_regions,      list);
+	list = lvm_gc_stats_pair(lvm, "tenured-regions",       stats.tenured_regions,     list);
+	list = lvm_gc_stats_pair(lvm, "pooled-regions",        stats.pooled_regions,      list);
+	list = lvm_gc_stats_pair(lvm, "large-space-regions",   stats.large_space_regions, list);
+	list = lvm_gc_stats_pair(lvm, "new-space-regions",     stats.new_space_regions,   list);
+	list = lvm_gc_stats_pair(lvm, "uncollected-regions",   stats.uncollected_regions, list);
+	list = lvm_gc_stats_pair(lvm, "average-survival-rate", stats.average_survival_rate * 100, list);
+	list = lvm_gc_stats_pair(lvm, "last-survival-rate",    stats.last_survival_rate * 100,    list);
+	list = lvm_gc_stats_pair(lvm, "bytes-copied",          stats.bytes_copied,        list);
+	list = lvm_gc_stats_pair(lvm, "bytes-allocated",       stats.bytes_allocated,     list);
+	list = lvm_gc_stats_pair(lvm, "max-pause-us",          stats.max_pause_ms * 1000,   list);
+	list = lvm_gc_stats_pair(lvm, "total-pause-us",        stats.total_pause_ms * 1000, list);
+	list = lvm_gc_stats_pair(lvm, "collections",           stats.collections,         list);
+	return list;
+}
+#endif
+
+
 //
 // Syntax builtins
 //
@@ -96,22 +179,22 @@ static lvm_atom_p lvm_gt(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p en
 static bool lvm_verify_syn_arg_count(lvm_atom_p args, uint32_t count, bool can_take_more_args) {
 	lvm_atom_p arg = args;
 	for(uint32_t i = 0; i < count; i++) {
-		if (arg->type != LVM_T_PAIR)
+		if (lvm_atom_type(arg) != LVM_T_PAIR)
 			return false;
-		arg = arg->rest;
+		arg = lvm_pair_rest(arg);
 	}
 	
-	if ( !can_take_more_args && arg->type != LVM_T_NIL )
+	if ( !can_take_more_args && lvm_atom_type(arg) != LVM_T_NIL )
 		return false;
 	return true;
 }
 
 static lvm_atom_p lvm_define(lvm_p lvm, lvm_atom_p args, lvm_env_p env) {
-	if ( !( lvm_verify_syn_arg_count(args, 2, false) && args->first->type == LVM_T_SYM ) )
+	if ( !( lvm_verify_syn_arg_count(args, 2, false) && lvm_atom_type(lvm_pair_first(args)) == LVM_T_SYM ) )
 		return lvm_error_atom(lvm, "lvm_define(): first arg needs to be a symbol followed by an expr");
-	lvm_atom_p name = args->first;
-	lvm_atom_p value = lvm_eval(lvm, args->rest->first, env);
-	if (value->type != LVM_T_ERROR)
+	lvm_atom_p name = lvm_pair_first(args);
+	lvm_atom_p value = lvm_eval(lvm, lvm_pair_first(lvm_pair_rest(args)), env);
+	if (lvm_atom_type(value) != LVM_T_ERROR)
 		lvm_env_put(lvm, env, name->str, value);
 	return value;
 }
@@ -119,29 +202,29 @@ static lvm_atom_p lvm_define(lvm_p lvm, lvm_atom_p args, lvm_env_p env) {
 static lvm_atom_p lvm_if(lvm_p lvm, lvm_atom_p args, lvm_env_p env) {
 	if ( !( lvm_verify_syn_arg_count(args, 2, false) || lvm_verify_syn_arg_count(args, 3, false) ) )
 		return lvm_error_atom(lvm, "lvm_if(): if needs 2 or 3 args");
-	lvm_atom_p evaled_condition = lvm_eval(lvm, args->first, env);
-	if (evaled_condition->type == LVM_T_ERROR)
+	lvm_atom_p evaled_condition = lvm_eval(lvm, lvm_pair_first(args), env);
+	if (lvm_atom_type(evaled_condition) == LVM_T_ERROR)
 		return evaled_condition;
 	
 	lvm_atom_p result = lvm_nil_atom(lvm);
-	if (evaled_condition->type == LVM_T_TRUE) {
-		result = lvm_eval(lvm, args->rest->first, env);
-	} else if (args->rest->rest->type == LVM_T_PAIR) {
-		result = lvm_eval(lvm, args->rest->rest->first, env);
+	if (lvm_atom_type(evaled_condition) == LVM_T_TRUE) {
+		result = lvm_eval(lvm, lvm_pair_first(lvm_pair_rest(args)), env);
+	} else if (lvm_atom_type(lvm_pair_rest(lvm_pair_rest(args))) == LVM_T_PAIR) {
+		result = lvm_eval(lvm, lvm_pair_first(lvm_pair_rest(lvm_pair_rest(args))), env);
 	}
 	return result;
 }
 
 static lvm_atom_p lvm_lambda(lvm_p lvm, lvm_atom_p args, lvm_env_p env) {
-	if ( !( lvm_verify_syn_arg_count(args, 2, true) && args->first->type == LVM_T_PAIR ) )
+	if ( !( lvm_verify_syn_arg_count(args, 2, true) && lvm_atom_type(lvm_pair_first(args)) == LVM_T_PAIR ) )
 		return lvm_error_atom(lvm, "lvm_lambda(): first arg has to be a list followed by one or more expressions");
-	return lvm_lambda_atom(lvm, args->first, args->rest, env);
+	return lvm_lambda_atom(lvm, lvm_pair_first(args), lvm_pair_rest(args), env);
 }
 
 static lvm_atom_p lvm_quote(lvm_p lvm, lvm_atom_p args, lvm_env_p env) {
 	if ( !lvm_verify_syn_arg_count(args, 1, false) )
 		return lvm_error_atom(lvm, "lvm_quote(): supports only one arg");
-	return args->first;
+	return lvm_pair_first(args);
 }
 
 
@@ -161,6 +244,16 @@ lvm_env_p lvm_new_base_env(lvm_p lvm) {
 	lvm_env_put(lvm, env, "<", lvm_builtin_atom(lvm, lvm_lt));
 	lvm_env_put(lvm, env, ">", lvm_builtin_atom(lvm, lvm_gt));
 	
+	lvm_env_put(lvm, env, "weak",           lvm_builtin_atom(lvm, lvm_weak));
+	lvm_env_put(lvm, env, "weak-get",       lvm_builtin_atom(lvm, lvm_weak_get));
+	lvm_env_put(lvm, env, "weak-table",     lvm_builtin_atom(lvm, lvm_weak_table));
+	lvm_env_put(lvm, env, "weak-table-get", lvm_builtin_atom(lvm, lvm_weak_table_get_builtin));
+	lvm_env_put(lvm, env, "weak-table-put", lvm_builtin_atom(lvm, lvm_weak_table_put_builtin));
+	
+#	ifdef GC_REGION_BAKER
+	lvm_env_put(lvm, env, "gc-stats", lvm_builtin_atom(lvm, lvm_gc_stats_builtin));
+#	endif
+	
 	lvm_env_put(lvm, env, "define", lvm_syntax_atom(lvm, lvm_define));
 	lvm_env_put(lvm, env, "if",     lvm_syntax_atom(lvm, lvm_if));
 	lvm_env_put(lvm, env, "lambda", lvm_syntax_atom(lvm, lvm_lambda));
@@ -34,6 +34,7 @@ TODO:
 
 static int lvm_next_char_after_whitespaces(FILE* input);
 static lvm_atom_p lvm_c_read_expr(lvm_p lvm, FILE* input);
+static lvm_atom_p lvm_c_read_quoted_list(lvm_p lvm, FILE* input);
 
 lvm_atom_p lvm_c_read(lvm_p lvm, FILE* input) {
 	lvm_atom_p expr = lvm_c_read_expr(lvm, input);
@@ -54,8 +55,8 @@ lvm_atom_p lvm_c_read(lvm_p lvm, FILE* input) {
 					else
 						ungetc(c, input);
 					
-					current_arg->rest = lvm_pair_atom(lvm, lvm_c_read(lvm, input), current_arg->rest);
-					current_arg = current_arg->rest;
+					lvm_pair_set_rest(current_arg, lvm_pair_atom(lvm, lvm_c_read(lvm, input), lvm_pair_rest(current_arg)));
+					current_arg = lvm_pair_rest(current_arg);
 					
 					c = lvm_next_char_after_whitespaces(input);
 					if (c == ',') {  // Next arg
@@ -148,8 +149,8 @@ static lvm_atom_p lvm_c_read_expr(lvm_p lvm, FILE* input) {
 				lvm_atom_p current_pair = ast;
 				while ( (c = lvm_next_char_after_whitespaces(input)) != '}' ) {
 					ungetc(c, input);
-					current_pair->rest = lvm_pair_atom(lvm, lvm_c_read(lvm, input), current_pair->rest);
-					current_pair = current_pair->rest;
+					lvm_pair_set_rest(current_pair, lvm_pair_atom(lvm, lvm_c_read(lvm, input), lvm_pair_rest(current_pair)));
+					current_pair = lvm_pair_rest(current_pair);
 				}
 				return ast;
 			}
@@ -164,42 +165,16 @@ static lvm_atom_p lvm_c_read_expr(lvm_p lvm, FILE* input) {
 			}
 		case '[':
 			{
-				lvm_atom_p args = lvm_pair_atom(lvm,
-					lvm_nil_atom(lvm),
-					lvm_nil_atom(lvm)
-				);
-				lvm_atom_p current_arg = args;
-				while (true) {
-					c = lvm_next_char_after_whitespaces(input);
-					if (c == ']')  // End of arg list
-						break;
-					else
-						ungetc(c, input);
-					
-					current_arg->rest = lvm_pair_atom(lvm, lvm_c_read(lvm, input), current_arg->rest);
-					current_arg = current_arg->rest;
-					
-					c = lvm_next_char_after_whitespaces(input);
-					if (c == ',') {  // Next arg
-						// Continue with next iteration
-					} else if (c == ']') {
-						break;
-					} else {
-						fprintf(stderr, "']' or ',' expected after list element\n");
-						return NULL;
-					}
-				}
-				// Strip the first unnecessary nil, we just put it there so the loop doesn't
-				// need a special case to append the first arg.
-				args = args->rest;
-				
-				return lvm_pair_atom(lvm,
-					lvm_sym_atom(lvm, "quote"),
-					lvm_pair_atom(lvm,
-						args,
-						lvm_nil_atom(lvm)
-					)
-				);
+				// Quoted literals are constants, put them into the immortal space
+				// so the collector never has to look at them again
+#				ifdef GC_REGION_BAKER
+				uint16_t prev_site = lvm_gc_enter_immortal_site(lvm);
+#				endif
+				lvm_atom_p quote = lvm_c_read_quoted_list(lvm, input);
+#				ifdef GC_REGION_BAKER
+				lvm_gc_leave_alloc_site(lvm, prev_site);
+#				endif
+				return quote;
 			}
 		default:
 			ungetc(c, input);
@@ -287,8 +262,8 @@ static lvm_atom_p lvm_c_read_expr(lvm_p lvm, FILE* input) {
 		 	else
 		 		ungetc(c, input);
 		 	
-			current_arg->rest = lvm_pair_atom(lvm, lvm_c_read(lvm, input), current_arg->rest);
-			current_arg = current_arg->rest;
+			lvm_pair_set_rest(current_arg, lvm_pair_atom(lvm, lvm_c_read(lvm, input), lvm_pair_rest(current_arg)));
+			current_arg = lvm_pair_rest(current_arg);
 			
 			c = lvm_next_char_after_whitespaces(input);
 		 	if (c == ',') {  // Next arg
@@ -302,7 +277,7 @@ static lvm_atom_p lvm_c_read_expr(lvm_p lvm, FILE* input) {
 		}
 		// Strip the first unnecessary nil, we just put it there so the loop doesn't
 		// need a special case to append the first arg.
-		args = args->rest;
+		args = lvm_pair_rest(args);
 		
 		lvm_atom_p body = lvm_c_read(lvm, input);
 		return lvm_pair_atom(lvm,
@@ -322,6 +297,50 @@ static lvm_atom_p lvm_c_read_expr(lvm_p lvm, FILE* input) {
 	return symbol;
 }
 
+/**
+ * Reads the elements of a [a, b, c] list after the '[' and returns them quoted,
+ * e.g. (quote (a b c)). Returns NULL on syntax errors.
+ */
+static lvm_atom_p lvm_c_read_quoted_list(lvm_p lvm, FILE* input) {
+	lvm_atom_p args = lvm_pair_atom(lvm,
+		lvm_nil_atom(lvm),
+		lvm_nil_atom(lvm)
+	);
+	lvm_atom_p current_arg = args;
+	int c;
+	while (true) {
+		c = lvm_next_char_after_whitespaces(input);
+		if (c == ']')  // End of arg list
+			break;
+		else
+			ungetc(c, input);
+		
+		lvm_pair_set_rest(current_arg, lvm_pair_atom(lvm, lvm_c_read(lvm, input), lvm_pair_rest(current_arg)));
+		current_arg = lvm_pair_rest(current_arg);
+		
+		c = lvm_next_char_after_whitespaces(input);
+		if (c == ',') {  // Next arg
+			// Continue with next iteration
+		} else if (c == ']') {
+			break;
+		} else {
+			fprintf(stderr, "']' or ',' expected after list element\n");
+			return NULL;
+		}
+	}
+	// Strip the first unnecessary nil, we just put it there so the loop doesn't
+	// need a special case to append the first arg.
+	args = lvm_pair_rest(args);
+	
+	return lvm_pair_atom(lvm,
+		lvm_sym_atom(lvm, "quote"),
+		lvm_pair_atom(lvm,
+			args,
+			lvm_nil_atom(lvm)
+		)
+	);
+}
+
 static int lvm_next_char_after_whitespaces(FILE* input) {
 	int c;
 	
@@ -334,7 +353,7 @@ static int lvm_next_char_after_whitespaces(FILE* input) {
 
 /*
 void lvm_c_print(lvm_p lvm, FILE* output, lvm_atom_p atom) {
-	switch(atom->type) {
+	switch(lvm_atom_type(atom)) {
 		case LVM_T_NIL:
 			fprintf(output, "nil");
 			break;
@@ -355,15 +374,15 @@ void lvm_c_print(lvm_p lvm, FILE* output, lvm_atom_p atom) {
 			break;
 		case LVM_T_PAIR:
 			fprintf(output, "(");
-			while(atom->type == LVM_T_PAIR) {
-				lvm_print(lvm, output, atom->first);
-				if (atom->rest->type != LVM_T_NIL && atom->rest->type != LVM_T_PAIR) {
+			while(lvm_atom_type(atom) == LVM_T_PAIR) {
+				lvm_print(lvm, output, lvm_pair_first(atom));
+				if (lvm_atom_type(lvm_pair_rest(atom)) != LVM_T_NIL && lvm_atom_type(lvm_pair_rest(atom)) != LVM_T_PAIR) {
 					fprintf(output, " . ");
-					lvm_print(lvm, output, atom->rest);
-				} else if (atom->rest->type == LVM_T_PAIR) {
+					lvm_print(lvm, output, lvm_pair_rest(atom));
+				} else if (lvm_atom_type(lvm_pair_rest(atom)) == LVM_T_PAIR) {
 					fprintf(output, " ");
 				}
-				atom = atom->rest;
+				atom = lvm_pair_rest(atom);
 			}
 			fprintf(output, ")");
 			break;
@@ -377,9 +396,9 @@ void lvm_c_print(lvm_p lvm, FILE* output, lvm_atom_p atom) {
 			fprintf(output, "(lambda ");
 			lvm_print(lvm, output, atom->args);
 			fprintf(output, " ");
-			for(lvm_atom_p expr = atom->body; expr->type == LVM_T_PAIR; expr = expr->rest) {
-				lvm_print(lvm, output, expr->first);
-				if (expr->rest->type == LVM_T_PAIR)
+			for(lvm_atom_p expr = atom->body; lvm_atom_type(expr) == LVM_T_PAIR; expr = lvm_pair_rest(expr)) {
+				lvm_print(lvm, output, lvm_pair_first(expr));
+				if (lvm_atom_type(lvm_pair_rest(expr)) == LVM_T_PAIR)
 					fprintf(output, " ");
 			}
 			fprintf(output, ")");
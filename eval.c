@@ -5,7 +5,7 @@ static lvm_atom_p lvm_eval_lambda(lvm_p lvm, lvm_atom_p lambda, lvm_atom_p args,
 
 
 lvm_atom_p lvm_eval(lvm_p lvm, lvm_atom_p atom, lvm_env_p env) {
-	switch(atom->type) {
+	switch(lvm_atom_type(atom)) {
 		case LVM_T_NIL:
 		case LVM_T_TRUE:
 		case LVM_T_FALSE:
@@ -19,15 +19,23 @@ lvm_atom_p lvm_eval(lvm_p lvm, lvm_atom_p atom, lvm_env_p env) {
 		}
 		case LVM_T_PAIR: {
 			// Eval first element of the list
-			lvm_atom_p func = lvm_eval(lvm, atom->first, env);
+			lvm_atom_p func = lvm_eval(lvm, lvm_pair_first(atom), env);
 			
-			switch(func->type) {
+			switch(lvm_atom_type(func)) {
 				case LVM_T_BUILTIN:
-					return lvm_eval_builtin(lvm, func, atom->rest, env);
-				case LVM_T_SYNTAX:
-					return func->syntax(lvm, atom->rest, env);
+					return lvm_eval_builtin(lvm, func, lvm_pair_rest(atom), env);
+				case LVM_T_SYNTAX: {
+#					ifdef GC_REGION_BAKER
+					uint16_t prev_site = lvm_gc_enter_alloc_site(lvm, func);
+					lvm_atom_p result = func->syntax(lvm, lvm_pair_rest(atom), env);
+					lvm_gc_leave_alloc_site(lvm, prev_site);
+					return result;
+#					else
+					return func->syntax(lvm, lvm_pair_rest(atom), env);
+#					endif
+				}
 				case LVM_T_LAMBDA:
-					return lvm_eval_lambda(lvm, func, atom->rest, env);
+					return lvm_eval_lambda(lvm, func, lvm_pair_rest(atom), env);
 				default:
 					return lvm_error_atom(lvm, "lvm_eval_pair(): got wrong atom in function slot!");
 			}
@@ -49,9 +57,9 @@ lvm_atom_p lvm_eval(lvm_p lvm, lvm_atom_p atom, lvm_env_p env) {
 static lvm_atom_p lvm_eval_builtin(lvm_p lvm, lvm_atom_p builtin, lvm_atom_p args, lvm_env_p env) {
 	// Eval all arguments and push them on the arg stack
 	size_t prev_length = lvm->arg_stack_length;
-	for(lvm_atom_p arg = args; arg->type == LVM_T_PAIR; arg = arg->rest) {
-		lvm_atom_p evaled_arg = lvm_eval(lvm, arg->first, env);
-		if (evaled_arg->type == LVM_T_ERROR) {
+	for(lvm_atom_p arg = args; lvm_atom_type(arg) == LVM_T_PAIR; arg = lvm_pair_rest(arg)) {
+		lvm_atom_p evaled_arg = lvm_eval(lvm, lvm_pair_first(arg), env);
+		if (lvm_atom_type(evaled_arg) == LVM_T_ERROR) {
 			// One argument evaled into an error atom. Stop evaling any arguments,
 			// drop any args we already pushed and return this error atom. This
 			// way we unwind the call stack.
@@ -63,7 +71,13 @@ static lvm_atom_p lvm_eval_builtin(lvm_p lvm, lvm_atom_p builtin, lvm_atom_p arg
 	
 	// Call builtin and drop arguments from the arg stack
 	size_t arg_count = lvm->arg_stack_length - prev_length;
+#	ifdef GC_REGION_BAKER
+	uint16_t prev_site = lvm_gc_enter_alloc_site(lvm, builtin);
+#	endif
 	lvm_atom_p result = builtin->builtin(lvm, arg_count, lvm->arg_stack_ptr + prev_length, env);
+#	ifdef GC_REGION_BAKER
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+#	endif
 	lvm_arg_stack_drop(lvm, arg_count);
 	return result;
 }
@@ -73,23 +87,29 @@ static lvm_atom_p lvm_eval_lambda(lvm_p lvm, lvm_atom_p lambda, lvm_atom_p args,
 	
 	lvm_atom_p arg_name = lambda->args;
 	lvm_atom_p arg_value = args;
-	while (arg_name->type == LVM_T_PAIR && arg_value->type == LVM_T_PAIR) {
-		lvm_atom_p evaled_arg_value = lvm_eval(lvm, arg_value->first, env);
-		if (evaled_arg_value->type == LVM_T_ERROR) {
+	while (lvm_atom_type(arg_name) == LVM_T_PAIR && lvm_atom_type(arg_value) == LVM_T_PAIR) {
+		lvm_atom_p evaled_arg_value = lvm_eval(lvm, lvm_pair_first(arg_value), env);
+		if (lvm_atom_type(evaled_arg_value) == LVM_T_ERROR) {
 			// One argument evaled into an error atom. Stop evaling any arguments,
 			// destroy the environment we would have called the lambda and return
 			// this error atom. This way we unwind the call stack.
 			lvm_env_destroy(lvm, lambda_env);
 			return evaled_arg_value;
 		}
-		lvm_env_put(lvm, lambda_env, arg_name->first->str, evaled_arg_value);
+		lvm_env_put(lvm, lambda_env, lvm_pair_first(arg_name)->str, evaled_arg_value);
 		
-		arg_name = arg_name->rest;
-		arg_value = arg_value->rest;
+		arg_name = lvm_pair_rest(arg_name);
+		arg_value = lvm_pair_rest(arg_value);
 	}
 	
 	lvm_atom_p result = lvm_nil_atom(lvm);
-	for(lvm_atom_p expr = lambda->body; expr->type == LVM_T_PAIR; expr = expr->rest)
-		result = lvm_eval(lvm, expr->first, lambda_env);
+#	ifdef GC_REGION_BAKER
+	uint16_t prev_site = lvm_gc_enter_alloc_site(lvm, lambda);
+#	endif
+	for(lvm_atom_p expr = lambda->body; lvm_atom_type(expr) == LVM_T_PAIR; expr = lvm_pair_rest(expr))
+		result = lvm_eval(lvm, lvm_pair_first(expr), lambda_env);
+#	ifdef GC_REGION_BAKER
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+#	endif
 	return result;
 }
\ No newline at end of file
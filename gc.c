@@ -2,6 +2,10 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
 #include "internals.h"
@@ -11,200 +15,1142 @@
 // Garbage collector stuff
 //
 
-
-struct lvm_gc_region_s {
-	lvm_gc_region_p next;
-	uint16_t size_in_64k_chunks;
-	uint16_t flags;
-	uint32_t free_offset;
-	uint32_t free_bytes;
-};
-
 // lvm_gc_region_t.flags
-#define LVM_GC_DONT_MOVE    (0 << 1)
-
-
-
-
-
-typedef void   (*lvm_gc_collect_child_t)(lvm_p lvm, lvm_atom_p* child_atom);
-typedef void   (*lvm_gc_child_collector_t)(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
-typedef size_t (*lvm_gc_get_data_t)(lvm_p lvm, lvm_atom_p atom, void** data_ptr);
-typedef struct {
-	uint32_t size;
-	lvm_gc_child_collector_t child_collector;
-	lvm_gc_get_data_t        get_data;
-} lvm_gc_atom_info_t, *lvm_gc_atom_info_p;
+#define LVM_GC_DONT_MOVE    (1 << 0)
+#define LVM_GC_HUGE_PAGES   (1 << 1)
+// Tenured regions major collections leave alone (from lvm_gc_tenure() or an image)
+#define LVM_GC_KEEP_TENURED (1 << 2)
 
 
-lvm_p lvm_gc_init();
+lvm_p lvm_gc_init(lvm_options_p options);
 void lvm_gc_cleanup(lvm_p lvm);
 lvm_atom_p lvm_gc_alloc(lvm_p lvm, lvm_atom_type_t type, size_t data_size, void** data_ptr);
+lvm_atom_p lvm_gc_alloc_large(lvm_p lvm, lvm_atom_type_t type, size_t data_size, void** data_ptr);
 lvm_atom_p lvm_gc_alloc_atom(lvm_p lvm, lvm_atom_type_t type);
 void*      lvm_gc_alloc_data(lvm_p lvm, size_t size);
+void lvm_gc_check_allocation_budget(lvm_p lvm);
+void lvm_gc_adapt_heap_size(lvm_p lvm);
+void lvm_gc_read_cgroup(lvm_p lvm);
+void lvm_gc_update_alloc_sites(lvm_p lvm, bool major);
+bool lvm_gc_space_contains(lvm_p lvm, lvm_gc_space_p space, void* ptr);
+lvm_gc_region_p lvm_gc_find_region_of_space(lvm_p lvm, lvm_gc_space_p space, void* ptr);
+void lvm_gc_scan_space(lvm_p lvm, lvm_gc_space_p space, lvm_gc_collect_child_t collect_child);
+void lvm_gc_scan_region(lvm_p lvm, lvm_gc_region_p region, lvm_gc_collect_child_t collect_child);
 void lvm_gc_invalidate_data_in_region(lvm_gc_region_p region);
-lvm_gc_region_p lvm_gc_allocate_region(size_t size, uint16_t flags);
+bool lvm_gc_reserve_heap(lvm_gc_heap_p heap, void* address, size_t size, size_t min_size);
+size_t lvm_gc_heap_find_free_chunks(lvm_gc_heap_p heap, size_t count);
+lvm_gc_region_p lvm_gc_allocate_region(lvm_gc_heap_p heap, size_t size, uint16_t flags);
+
+void lvm_gc_free_region(lvm_gc_heap_p heap, lvm_gc_region_p region);
+void lvm_gc_free_regions_of_space(lvm_gc_heap_p heap, lvm_gc_space_p space);
+size_t lvm_gc_count_regions_of_space(lvm_gc_space_p space);
+size_t lvm_gc_used_bytes_of_space(lvm_gc_space_p space);
+void lvm_gc_append_region_to_space(lvm_gc_space_p space, lvm_gc_region_p region);
+void lvm_gc_prepend_region_to_space(lvm_gc_space_p space, lvm_gc_region_p region);
+void lvm_gc_update_space_of_regions(lvm_gc_space_p space);
+lvm_gc_region_p lvm_gc_find_large_atom_region(lvm_p lvm, lvm_gc_space_p space, lvm_atom_p atom);
 
-void lvm_gc_free_region(lvm_gc_region_p region);
+#ifdef LVM_BIBOP
+lvm_gc_region_p lvm_gc_add_page_to_space(lvm_p lvm, lvm_gc_space_p space, lvm_atom_type_t type, bool* added_new_region);
+#endif
 
-void       lvm_gc_ensure_free_bytes_in_space(lvm_gc_space_p space, size_t size, bool* added_new_regiony);
-lvm_atom_p lvm_gc_alloc_atom_from_space(lvm_gc_space_p space, lvm_atom_type_t type, bool* added_new_region);
-void*      lvm_gc_alloc_data_from_space(lvm_gc_space_p space, size_t data_size, bool* added_new_region);
-lvm_atom_p lvm_gc_alloc_from_space(lvm_gc_space_p space, lvm_atom_type_t type, size_t data_size, void** data_ptr, bool* added_new_region);
+lvm_gc_region_p lvm_gc_take_region_from_pool(lvm_p lvm, size_t size);
+lvm_gc_region_p lvm_gc_map_region(lvm_p lvm, size_t size, uint16_t flags);
+void            lvm_gc_put_region_into_pool(lvm_p lvm, lvm_gc_region_p region);
+void            lvm_gc_trim_region_pool(lvm_p lvm);
+void            lvm_gc_take_swept_regions(lvm_p lvm);
+void*           lvm_gc_sweeper_main(void* arg);
 
-void* lvm_gc_calloc(size_t length, size_t size_per_element);
-void  lvm_gc_free(void* ptr);
+lvm_gc_region_p lvm_gc_ensure_free_bytes_in_space(lvm_p lvm, lvm_gc_space_p space, size_t size, bool* added_new_region);
+lvm_atom_p lvm_gc_alloc_atom_from_space(lvm_p lvm, lvm_gc_space_p space, lvm_atom_type_t type, bool* added_new_region);
+void*      lvm_gc_alloc_data_from_space(lvm_p lvm, lvm_gc_space_p space, size_t data_size, bool* added_new_region);
+lvm_atom_p lvm_gc_alloc_from_space(lvm_p lvm, lvm_gc_space_p space, lvm_atom_type_t type, size_t data_size, void** data_ptr, bool* added_new_region);
 
-void lvm_gc_pair_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
+void* lvm_gc_calloc(lvm_p lvm, size_t length, size_t size_per_element);
+void  lvm_gc_free(lvm_p lvm, void* ptr);
+
+void   lvm_gc_pair_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
 size_t lvm_gc_get_str_data(lvm_p lvm, lvm_atom_p atom, void** data_ptr);
+void   lvm_gc_set_str_data(lvm_p lvm, lvm_atom_p atom, void* data_ptr);
+void   lvm_gc_env_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
+size_t lvm_gc_get_env_data(lvm_p lvm, lvm_atom_p atom, void** data_ptr);
+void   lvm_gc_set_env_data(lvm_p lvm, lvm_atom_p atom, void* data_ptr);
+void   lvm_gc_lambda_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
+void   lvm_gc_weak_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
+void   lvm_gc_weak_table_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
+
+// Atoms and data are allocated in multiples of 8 bytes. Otherwise a small atom
+// (e.g. nil) would misalign the pointers of the next atom.
+#define LVM_GC_ALIGN(size)  (((size) + 7) / 8 * 8)
 
 lvm_gc_atom_info_t lvm_gc_atom_infos[] = {
-	[LVM_T_NIL]     = {.size = offsetof(struct lvm_atom_s, type)     + sizeof(lvm_atom_type_t)    },
-	[LVM_T_TRUE]    = {.size = offsetof(struct lvm_atom_s, type)     + sizeof(lvm_atom_type_t)    },
-	[LVM_T_FALSE]   = {.size = offsetof(struct lvm_atom_s, type)     + sizeof(lvm_atom_type_t)    },
-	[LVM_T_NUM]     = {.size = offsetof(struct lvm_atom_s, num)      + sizeof(int64_t)            },
-	[LVM_T_SYM]     = {.size = offsetof(struct lvm_atom_s, str)      + sizeof(char*),             .get_data = lvm_gc_get_str_data },
-	[LVM_T_STR]     = {.size = offsetof(struct lvm_atom_s, str)      + sizeof(char*),             .get_data = lvm_gc_get_str_data },
-	[LVM_T_PAIR]    = {.size = offsetof(struct lvm_atom_s, rest)     + sizeof(lvm_atom_p),        .child_collector = lvm_gc_pair_child_collector },
-	[LVM_T_LAMBDA]  = {.size = offsetof(struct lvm_atom_s, env)      + sizeof(lvm_env_p),         .child_collector = lvm_gc_lambda_child_collector },
-	[LVM_T_BUILTIN] = {.size = offsetof(struct lvm_atom_s, builtin)  + sizeof(lvm_builtin_func_t) },
-	[LVM_T_SYNTAX]  = {.size = offsetof(struct lvm_atom_s, syntax)   + sizeof(lvm_syntax_func_t)  },
-	[LVM_T_ERROR]   = {.size = offsetof(struct lvm_atom_s, str)      + sizeof(char*),             .get_data = lvm_gc_get_str_data }
-	[LVM_T_ENV]     = {.size = offsetof(struct lvm_atom_s, bindings) + sizeof(lvm_dict_t),        .child_collector = lvm_gc_env_child_collector,
-	                                                                                              .get_data = lvm_gc_get_env_data }
+	[LVM_T_NIL]     = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, type)     + sizeof(lvm_atom_type_t))    },
+	[LVM_T_TRUE]    = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, type)     + sizeof(lvm_atom_type_t))    },
+	[LVM_T_FALSE]   = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, type)     + sizeof(lvm_atom_type_t))    },
+#	ifdef LVM_BIBOP
+	[LVM_T_NUM]     = {.size = sizeof(int64_t), .offset = LVM_ATOM_HEADER_SIZE },
+#	else
+	[LVM_T_NUM]     = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, num)      + sizeof(int64_t))            },
+#	endif
+	[LVM_T_SYM]     = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, str)      + sizeof(char*)),             .get_data = lvm_gc_get_str_data, .set_data = lvm_gc_set_str_data },
+	[LVM_T_STR]     = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, str)      + sizeof(char*)),             .get_data = lvm_gc_get_str_data, .set_data = lvm_gc_set_str_data },
+#	ifdef LVM_BIBOP
+	[LVM_T_PAIR]    = {.size = LVM_GC_ALIGN(2 * sizeof(lvm_ref_t)), .offset = LVM_ATOM_HEADER_SIZE,             .child_collector = lvm_gc_pair_child_collector },
+#	else
+	[LVM_T_PAIR]    = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, rest)     + sizeof(lvm_ref_t)),         .child_collector = lvm_gc_pair_child_collector },
+#	endif
+	[LVM_T_LAMBDA]  = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, env)      + sizeof(lvm_env_p)),         .child_collector = lvm_gc_lambda_child_collector },
+	[LVM_T_BUILTIN] = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, builtin)  + sizeof(lvm_builtin_func_t)) },
+	[LVM_T_SYNTAX]  = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, syntax)   + sizeof(lvm_syntax_func_t))  },
+	[LVM_T_ERROR]   = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, str)      + sizeof(char*)),             .get_data = lvm_gc_get_str_data, .set_data = lvm_gc_set_str_data },
+	[LVM_T_ENV]     = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, bindings) + sizeof(lvm_dict_p)),        .child_collector = lvm_gc_env_child_collector,
+	                                                                                                            .get_data = lvm_gc_get_env_data, .set_data = lvm_gc_set_env_data },
+	[LVM_T_WEAK]       = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, target) + sizeof(lvm_atom_p)),        .child_collector = lvm_gc_weak_child_collector },
+	[LVM_T_WEAK_TABLE] = {.size = LVM_GC_ALIGN(offsetof(struct lvm_atom_s, needs_rehash) + sizeof(bool)), .child_collector = lvm_gc_weak_table_child_collector }
 };
 
 #define LVM_GC_64K          (65536)
 #define LVM_GC_REGION_SIZE  (16*1024*1024)
 
+// Regions start at heap chunk (2 MiByte) boundaries so the kernel can back them
+// with huge pages. Configured region sizes are rounded up to a multiple of it.
+#define LVM_GC_REGION_ALIGNMENT  ((size_t)1 << LVM_GC_HEAP_CHUNK_SHIFT)
+#define LVM_GC_HEAP_SIZE         ((size_t)64*1024*1024*1024)
+// The heap has room for at least that many regions of the configured size
+#define LVM_GC_MIN_HEAP_REGIONS  4
+#define LVM_GC_MAX_REGION_SIZE   ((size_t)UINT16_MAX * LVM_GC_64K / LVM_GC_REGION_ALIGNMENT * LVM_GC_REGION_ALIGNMENT)
+
+// BiBoP pages are regions of exactly one heap chunk. So masking the lower bits
+// off the address of any atom gets us to the header of its page or region.
+// Regions larger than one chunk only contain atoms in their first chunk (see
+// lvm_gc_ensure_free_bytes_in_space()). A page header is followed by a bitmap
+// with one bit per atom, it's set when the atom was copied during a collection.
+// Headerless atoms don't have room to mark them as forward pointers.
+#ifdef LVM_BIBOP
+#	if LVM_BIBOP_PAGE_SHIFT != LVM_GC_HEAP_CHUNK_SHIFT
+#	error "BiBoP pages have to be exactly one heap chunk large"
+#	endif
+
+static inline lvm_gc_region_p lvm_gc_page_of(const void* ptr) {
+	return (lvm_gc_region_p)( (uintptr_t)ptr & ~(LVM_BIBOP_PAGE_SIZE - 1) );
+}
+
+// Offset of the first atom in a page, the forwarding bitmap is in front of it
+static inline uint32_t lvm_gc_page_atoms_offset(uint32_t atom_size) {
+	return sizeof(lvm_gc_region_t) + LVM_GC_ALIGN((LVM_BIBOP_PAGE_SIZE / atom_size + 7) / 8);
+}
+
+static inline uint64_t* lvm_gc_page_forwarded_bits(lvm_gc_region_p page) {
+	return (void*)page + sizeof(lvm_gc_region_t);
+}
+
+static inline size_t lvm_gc_page_atom_index(lvm_gc_region_p page, lvm_atom_p atom) {
+	uint32_t atom_size = lvm_gc_atom_infos[page->atom_type].size;
+	return ((void*)atom + LVM_ATOM_HEADER_SIZE - (void*)page - lvm_gc_page_atoms_offset(atom_size)) / atom_size;
+}
+#endif
+
+// Atoms with at least that many bytes (atom and data) get their own region in
+// the large space. They are never copied during a collection.
+#define LVM_GC_LARGE_ATOM_SIZE(region_size)  ((region_size) / 16)
+
+// Default watermarks of the region pool (in regions). Once the pool grows above
+// the high watermark it's trimmed down to the low watermark.
+#define LVM_GC_POOL_LOW_WATERMARK   4
+#define LVM_GC_POOL_HIGH_WATERMARK  16
+
+// Parameters of the adaptive heap sizing policies. The GC overhead is the
+// fraction of work spent on copying survivors compared to allocating. Budgets
+// are in regions.
+static const struct {
+	double target_gc_overhead;
+	size_t min_budget_regions, max_budget_regions;
+} lvm_gc_policy_presets[] = {
+	[LVM_GC_POLICY_THROUGHPUT] = { .target_gc_overhead = 0.05, .min_budget_regions = 2, .max_budget_regions = 256 },
+	[LVM_GC_POLICY_LATENCY]    = { .target_gc_overhead = 0.25, .min_budget_regions = 1, .max_budget_regions = 8   }
+};
+
+// An allocation site is pretenured once at least that many of its bytes
+// were sampled and that fraction of them survived their first collection
+#define LVM_GC_PRETENURE_MIN_BYTES      (256*1024)
+#define LVM_GC_PRETENURE_SURVIVAL_RATE  0.8
+// A major collection is due once that many regions were allocated into the
+// tenured space since the last one, or as many bytes as survived the last one
+// if that's more
+#define LVM_GC_MAJOR_MIN_BUDGET_REGIONS  4
+
+// Where to look for the memory files of our cgroup (cgroup v2)
+#define LVM_GC_CGROUP_PATH  "/sys/fs/cgroup"
+// Between collections the cgroup files are read again only after that many
+// allocated bytes, until then we subtract them from the headroom we read
+#define LVM_GC_CGROUP_READ_INTERVAL  (4*1024*1024)
+// Above that "some avg10" value of memory.pressure (in percent) we give all
+// pooled regions back to the OS
+#define LVM_GC_MEMORY_PRESSURE_THRESHOLD  10.0
+
+// Set of atoms (or environments), e.g. the ones the heap walk already visited
+// or the pinned atoms of a collection
+SH_GEN_DECL(lvm_gc_atom_set, void*, bool);
+#define SLIM_HASH_IMPLEMENTATION
+#include "slim_hash.h"
+SH_GEN_HASH_DEF(lvm_gc_atom_set, void*, bool);
+SH_GEN_HASH_DEF(lvm_gc_finalizer_index, void*, size_t);
 
+// String data already copied into the new space, by content. Used to share the
+// data of equal strings.
+SH_GEN_DECL(lvm_gc_string_table, const char*, const char*);
+SH_GEN_DEF(lvm_gc_string_table, const char*, const char*, lvm_gc_string_table_murmur3_32(key, strlen(key)), (strcmp(a, b) == 0), key, 0);
 
-lvm_p lvm_gc_init() {
-	lvm_gc_region_p first_uncollected_region = lvm_gc_allocate_region(LVM_GC_REGION_SIZE, LVM_GC_DONT_MOVE);
+
+
+lvm_p lvm_gc_init(lvm_options_p options) {
+	size_t region_size = LVM_GC_REGION_SIZE, heap_size = LVM_GC_HEAP_SIZE;
+	void* heap_address = NULL;
+	uint16_t region_flags = 0;
+	bool mark_compact = false, string_dedup = false, background_sweep = false;
+	lvm_gc_policy_t policy = LVM_GC_POLICY_FIXED;
+	const char* cgroup_path = LVM_GC_CGROUP_PATH;
+	if (options != NULL) {
+		if (options->gc_region_size > 0)
+			region_size = (options->gc_region_size + (LVM_GC_REGION_ALIGNMENT - 1)) / LVM_GC_REGION_ALIGNMENT * LVM_GC_REGION_ALIGNMENT;
+		if (region_size > LVM_GC_MAX_REGION_SIZE)
+			region_size = LVM_GC_MAX_REGION_SIZE;
+		if (options->gc_huge_pages)
+			region_flags |= LVM_GC_HUGE_PAGES;
+		if (options->gc_heap_size > 0)
+			heap_size = options->gc_heap_size;
+		heap_address = options->gc_heap_address;
+		mark_compact = options->gc_mark_compact;
+		string_dedup = options->gc_string_dedup;
+		background_sweep = options->gc_background_sweep;
+		policy = options->gc_policy;
+		if (options->gc_cgroup_path != NULL)
+			cgroup_path = options->gc_cgroup_path;
+	}
+	
+#	ifdef LVM_BIBOP
+	// Every region has to be one page large, see lvm_atom_type()
+	region_size = LVM_BIBOP_PAGE_SIZE;
+#	endif
+	
+	if (heap_size < LVM_GC_MIN_HEAP_REGIONS * region_size)
+		heap_size = LVM_GC_MIN_HEAP_REGIONS * region_size;
+	lvm_gc_heap_t heap;
+	if ( !lvm_gc_reserve_heap(&heap, heap_address, heap_size, LVM_GC_MIN_HEAP_REGIONS * region_size) ) {
+		fprintf(stderr, "lvm_gc_init(): can't reserve %zu MiByte of address space for the GC heap\n", heap_size / (1024*1024));
+		exit(1);
+	}
+	
+	lvm_gc_region_p first_uncollected_region = lvm_gc_allocate_region(&heap, region_size, LVM_GC_DONT_MOVE | region_flags);
+	if (first_uncollected_region == NULL) {
+		fprintf(stderr, "lvm_gc_init(): no room for the first region in the GC heap\n");
+		exit(1);
+	}
 	lvm_gc_space_t uncollected = (lvm_gc_space_t){
 		.first = first_uncollected_region,
 		.last  = first_uncollected_region
 	};
 	
-	lvm_p lvm = lvm_gc_alloc_data_from_space(&uncollected, sizeof(lvm_t), NULL);
+	// The first region is empty so the allocation never needs the pool of the
+	// (not yet existing) interpreter context
+	lvm_p lvm = lvm_gc_alloc_data_from_space(NULL, &uncollected, sizeof(lvm_t), NULL);
 	
 	lvm->gc = (lvm_gc_t){
+		.heap = heap,
 		.uncollected = uncollected,
 		.new_space = { NULL, NULL },
 		.old_space = { NULL, NULL },
-		.collect_on_next_possibility = false
+		.large_space = { NULL, NULL },
+		.old_large_space = { NULL, NULL },
+		.region_pool = { NULL, NULL },
+		.tenured_space = { NULL, NULL },
+		.old_tenured_space = { NULL, NULL },
+		.tenured_bytes_allocated = 0,
+		.tenured_budget = LVM_GC_MAJOR_MIN_BUDGET_REGIONS * region_size,
+		.region_pool_length = 0,
+		.region_pool_low_watermark = LVM_GC_POOL_LOW_WATERMARK,
+		.region_pool_high_watermark = LVM_GC_POOL_HIGH_WATERMARK,
+		.collect_on_next_possibility = false,
+		.region_size = region_size,
+		.region_flags = region_flags,
+		.mark_compact = mark_compact,
+		.string_dedup = string_dedup,
+		.background_sweep = background_sweep,
+		.sweeper_stop = false,
+		.sweeper_dirty = { NULL, NULL },
+		.sweeper_clean = { NULL, NULL },
+		.swept_regions = 0,
+		.policy = policy,
+		.allocation_budget = (policy == LVM_GC_POLICY_FIXED) ? region_size : lvm_gc_policy_presets[policy].min_budget_regions * region_size,
+		.bytes_allocated_at_last_collect = 0,
+		.cgroup_memory_max = SIZE_MAX,
+		.cgroup_headroom = SIZE_MAX,
+		.bytes_allocated_at_cgroup_read = 0,
+		.cgroup_pressure = 0,
+		.alloc_sites = { [LVM_GC_IMMORTAL_SITE] = { .pretenure = true, .immortal = true } },
+		.alloc_sites_length = 2,
+		.current_alloc_site = 0,
+		.profile = { .next_sample = SIZE_MAX },
+		.pinned_ptr = NULL,
+		.pinned_length = 0,
+		.pinned_capacity = 0,
+		.finalizers_ptr = NULL,
+		.finalizers_length = 0,
+		.finalizers_capacity = 0,
+		.stats = { 0 },
+		.bytes_collected = 0
 	};
-	lvm->nil_atom   = lvm_gc_alloc_atom_from_space(&uncollected, LVM_T_NIL,   NULL);
-	lvm->true_atom  = lvm_gc_alloc_atom_from_space(&uncollected, LVM_T_TRUE,  NULL);
-	lvm->false_atom = lvm_gc_alloc_atom_from_space(&uncollected, LVM_T_FALSE, NULL);
+	lvm_gc_finalizer_index_new(&lvm->gc.finalizers_index);
+	lvm_gc_update_space_of_regions(&lvm->gc.uncollected);
+	lvm->nil_atom   = lvm_gc_alloc_atom_from_space(lvm, &lvm->gc.uncollected, LVM_T_NIL,   NULL);
+	lvm->true_atom  = lvm_gc_alloc_atom_from_space(lvm, &lvm->gc.uncollected, LVM_T_TRUE,  NULL);
+	lvm->false_atom = lvm_gc_alloc_atom_from_space(lvm, &lvm->gc.uncollected, LVM_T_FALSE, NULL);
+	
+	snprintf(lvm->gc.cgroup_path, sizeof(lvm->gc.cgroup_path), "%s", cgroup_path);
+	lvm_gc_read_cgroup(lvm);
+	
+	if (lvm->gc.background_sweep) {
+		pthread_mutex_init(&lvm->gc.sweeper_mutex, NULL);
+		pthread_cond_init(&lvm->gc.sweeper_cond, NULL);
+		// Without a thread we just reuse the regions dirty
+		if ( pthread_create(&lvm->gc.sweeper_thread, NULL, lvm_gc_sweeper_main, lvm) != 0 )
+			lvm->gc.background_sweep = false;
+	}
 	
 	return lvm;
 }
 
 void lvm_gc_cleanup(lvm_p lvm) {
-	lvm_gc_region_p next = NULL;
-	
-	for(lvm_gc_region_p r = lvm->gc.new_space.first; r != NULL; r = next) {
-		next = r->next;
-		lvm_gc_free_region(r);
+	// Give atoms that still own resources a chance to release them
+	for(size_t i = 0; i < lvm->gc.finalizers_length; i++) {
+		lvm_gc_finalizer_entry_t* entry = &lvm->gc.finalizers_ptr[i];
+		entry->finalizer(lvm, entry->atom, entry->data);
 	}
+	free(lvm->gc.finalizers_ptr);
+	lvm_gc_finalizer_index_destroy(&lvm->gc.finalizers_index);
 	
-	for(lvm_gc_region_p r = lvm->gc.old_space.first; r != NULL; r = next) {
-		next = r->next;
-		lvm_gc_free_region(r);
+	if (lvm->gc.background_sweep) {
+		pthread_mutex_lock(&lvm->gc.sweeper_mutex);
+		lvm->gc.sweeper_stop = true;
+		pthread_cond_signal(&lvm->gc.sweeper_cond);
+		pthread_mutex_unlock(&lvm->gc.sweeper_mutex);
+		pthread_join(lvm->gc.sweeper_thread, NULL);
+		pthread_mutex_destroy(&lvm->gc.sweeper_mutex);
+		pthread_cond_destroy(&lvm->gc.sweeper_cond);
 	}
 	
-	// Free the uncollected region last since it provides the memory for the
-	// lvm_p context struct.
-	for(lvm_gc_region_p r = lvm->gc.uncollected.first; r != NULL; r = next) {
-		next = r->next;
-		lvm_gc_free_region(r);
-	}
+	free(lvm->gc.pinned_ptr);
+	free(lvm->gc.profile.stacks_ptr);
+	free(lvm->gc.profile.sites_ptr);
+	
+	// All regions live in the reserved heap, so unmapping it frees all of
+	// them at once. Including the uncollected region that provides the memory
+	// for the lvm_p context struct, so copy the heap first.
+	lvm_gc_heap_t heap = lvm->gc.heap;
+	munmap(heap.base, heap.size);
+	free(heap.chunk_regions);
+	free(heap.free_tree);
+}
+
+// Counts allocated bytes and takes a profiler sample when they reach the next
+// sample
+static inline void lvm_gc_count_allocation(lvm_p lvm, size_t size) {
+	lvm->gc.stats.bytes_allocated += size;
+	if (lvm->gc.stats.bytes_allocated >= lvm->gc.profile.next_sample)
+		lvm_gc_profile_sample(lvm);
+}
+
+// Space the current allocation site allocates size bytes from. Pretenured
+// sites allocate into the tenured space, that counts towards the next major
+// collection.
+static inline lvm_gc_space_p lvm_gc_space_of_site(lvm_p lvm, lvm_gc_alloc_site_p site, size_t size) {
+	if (!site->pretenure)
+		return &lvm->gc.new_space;
+	lvm->gc.tenured_bytes_allocated += size;
+	return &lvm->gc.tenured_space;
 }
 
 lvm_atom_p lvm_gc_alloc(lvm_p lvm, lvm_atom_type_t type, size_t data_size, void** data_ptr) {
-	return lvm_gc_alloc_from_space(&lvm->gc.new_space, type, data_size, data_ptr, &lvm->gc.collect_on_next_possibility);
+	// Immortal atoms never go into the large space, its regions are freed
+	// when nothing the collector can see references them
+	if (lvm->gc.current_alloc_site == LVM_GC_IMMORTAL_SITE) {
+		lvm_gc_count_allocation(lvm, lvm_gc_atom_infos[type].size + LVM_GC_ALIGN(data_size));
+		return lvm_gc_alloc_from_space(lvm, &lvm->gc.uncollected, type, data_size, data_ptr, NULL);
+	}
+	
+	if (lvm_gc_atom_infos[type].size + data_size >= LVM_GC_LARGE_ATOM_SIZE(lvm->gc.region_size))
+		return lvm_gc_alloc_large(lvm, type, data_size, data_ptr);
+	size_t size = lvm_gc_atom_infos[type].size + LVM_GC_ALIGN(data_size);
+	lvm_gc_count_allocation(lvm, size);
+	lvm_gc_alloc_site_p site = &lvm->gc.alloc_sites[lvm->gc.current_alloc_site];
+	site->allocated_bytes += size;
+	
+	bool added_new_region = false;
+	lvm_atom_p atom = lvm_gc_alloc_from_space(lvm, lvm_gc_space_of_site(lvm, site, size), type, data_size, data_ptr, &added_new_region);
+	if (lvm_gc_atom_infos[type].offset == 0)
+		atom->alloc_site = lvm->gc.current_alloc_site;
+	if (added_new_region)
+		lvm_gc_check_allocation_budget(lvm);
+	return atom;
+}
+
+/**
+ * Maps a dedicated region for one atom and its data and appends it to the
+ * large space. Used by lvm_gc_alloc_large() and by the collector to move big
+ * atoms out of the new space, so it doesn't count the allocation.
+ */
+static lvm_atom_p lvm_gc_alloc_in_large_region(lvm_p lvm, lvm_atom_type_t type, size_t data_size, void** data_ptr) {
+	size_t atom_size = lvm_gc_atom_infos[type].size;
+	data_size = LVM_GC_ALIGN(data_size);
+	lvm_gc_region_p region = lvm_gc_map_region(lvm, sizeof(lvm_gc_region_t) + atom_size + data_size, LVM_GC_DONT_MOVE | lvm->gc.region_flags);
+	lvm_gc_append_region_to_space(&lvm->gc.large_space, region);
+	return lvm_gc_alloc_from_space(lvm, &lvm->gc.large_space, type, data_size, data_ptr, NULL);
+}
+
+/**
+ * Allocates an atom and its data in a dedicated region of the large space. The
+ * atom is placed directly after the region header so the collector can find
+ * the region of a large atom. Large atoms are never moved, a collection only
+ * keeps their region alive or frees it.
+ */
+lvm_atom_p lvm_gc_alloc_large(lvm_p lvm, lvm_atom_type_t type, size_t data_size, void** data_ptr) {
+	lvm_gc_count_allocation(lvm, lvm_gc_atom_infos[type].size + LVM_GC_ALIGN(data_size));
+	lvm_atom_p atom = lvm_gc_alloc_in_large_region(lvm, type, data_size, data_ptr);
+	
+	// We just mapped more memory so check the budget as we would for a new
+	// region in the new space
+	lvm_gc_check_allocation_budget(lvm);
+	
+	return atom;
 }
 
 lvm_atom_p lvm_gc_alloc_atom(lvm_p lvm, lvm_atom_type_t type) {
-	return lvm_gc_alloc_atom_from_space(&lvm->gc.new_space, type, &lvm->gc.collect_on_next_possibility);
+	lvm_gc_count_allocation(lvm, lvm_gc_atom_infos[type].size);
+	lvm_gc_alloc_site_p site = &lvm->gc.alloc_sites[lvm->gc.current_alloc_site];
+	if (site->immortal)
+		return lvm_gc_alloc_atom_from_space(lvm, &lvm->gc.uncollected, type, NULL);
+	
+	bool added_new_region = false;
+	lvm_atom_p atom = lvm_gc_alloc_atom_from_space(lvm, lvm_gc_space_of_site(lvm, site, lvm_gc_atom_infos[type].size), type, &added_new_region);
+	// Headerless atoms can't remember their allocation site, so they don't
+	// count for it
+	if (lvm_gc_atom_infos[type].offset == 0) {
+		atom->alloc_site = lvm->gc.current_alloc_site;
+		site->allocated_bytes += lvm_gc_atom_infos[type].size;
+	}
+	if (added_new_region)
+		lvm_gc_check_allocation_budget(lvm);
+	return atom;
 }
 
+// Data of an atom from a pretenured site is allocated in the tenured space as
+// well, data of immortal atoms in the uncollected space
 void* lvm_gc_alloc_data(lvm_p lvm, size_t size) {
-	return lvm_gc_alloc_data_from_space(&lvm->gc.new_space, size, &lvm->gc.collect_on_next_possibility);
+	lvm_gc_count_allocation(lvm, LVM_GC_ALIGN(size));
+	lvm_gc_alloc_site_p site = &lvm->gc.alloc_sites[lvm->gc.current_alloc_site];
+	if (site->immortal)
+		return lvm_gc_alloc_data_from_space(lvm, &lvm->gc.uncollected, size, NULL);
+	site->allocated_bytes += LVM_GC_ALIGN(size);
+	
+	bool added_new_region = false;
+	void* data_ptr = lvm_gc_alloc_data_from_space(lvm, lvm_gc_space_of_site(lvm, site, LVM_GC_ALIGN(size)), size, &added_new_region);
+	if (added_new_region)
+		lvm_gc_check_allocation_budget(lvm);
+	return data_ptr;
+}
+
+/**
+ * Called whenever the heap grew by a region. The fixed policy collects right
+ * away (on the next possibility), the adaptive ones only once the program
+ * would exceed its budget before the next region is added. Checking only when a
+ * region is added keeps the allocation fast path free of that.
+ */
+void lvm_gc_check_allocation_budget(lvm_p lvm) {
+	size_t allocated = lvm->gc.stats.bytes_allocated - lvm->gc.bytes_allocated_at_last_collect;
+	if (lvm->gc.policy == LVM_GC_POLICY_FIXED || allocated + lvm->gc.region_size > lvm->gc.allocation_budget)
+		lvm->gc.collect_on_next_possibility = true;
+	// The tenured space only shrinks with a major collection
+	if (lvm->gc.tenured_bytes_allocated >= lvm->gc.tenured_budget)
+		lvm->gc.collect_on_next_possibility = true;
+	
+	// Close to the memory limit of our cgroup collect regardless of the
+	// budget. A collection can need as much memory again for the survivors so
+	// we only use half of the headroom.
+	if (lvm->gc.cgroup_headroom != SIZE_MAX) {
+		size_t allocated_since_read = lvm->gc.stats.bytes_allocated - lvm->gc.bytes_allocated_at_cgroup_read;
+		if (allocated_since_read >= LVM_GC_CGROUP_READ_INTERVAL) {
+			lvm_gc_read_cgroup(lvm);
+			allocated_since_read = 0;
+		}
+		
+		size_t headroom = (lvm->gc.cgroup_headroom > allocated_since_read) ? lvm->gc.cgroup_headroom - allocated_since_read : 0;
+		if (lvm->gc.region_size > headroom / 2)
+			lvm->gc.collect_on_next_possibility = true;
+	}
+}
+
+/**
+ * Sizes the allocation budget until the next collection after a collection.
+ * The work of a collection is proportional to the live bytes L, the work of the
+ * program to the allocated bytes B. For a target GC overhead o = L / (L + B)
+ * we can allocate B = L * (1 - o) / o bytes. L is what survived this
+ * collection so the survival rate drives the budget.
+ * 
+ * The pool watermarks follow the budget: We keep enough regions around to
+ * serve the next budget without mapping new ones and give back the rest.
+ */
+void lvm_gc_adapt_heap_size(lvm_p lvm) {
+	lvm->gc.bytes_allocated_at_last_collect = lvm->gc.stats.bytes_allocated;
+	lvm->gc.collect_on_next_possibility = false;
+	lvm_gc_read_cgroup(lvm);
+	if (lvm->gc.policy == LVM_GC_POLICY_FIXED)
+		return;
+	
+	double o = lvm_gc_policy_presets[lvm->gc.policy].target_gc_overhead;
+	size_t live_bytes = lvm_gc_used_bytes_of_space(&lvm->gc.new_space) + lvm_gc_used_bytes_of_space(&lvm->gc.large_space);
+	size_t budget = live_bytes * (1 - o) / o;
+	
+	size_t min_budget = lvm_gc_policy_presets[lvm->gc.policy].min_budget_regions * lvm->gc.region_size;
+	size_t max_budget = lvm_gc_policy_presets[lvm->gc.policy].max_budget_regions * lvm->gc.region_size;
+	if (budget < min_budget)
+		budget = min_budget;
+	if (budget > max_budget)
+		budget = max_budget;
+	// Don't plan to allocate more than half of what's left until the memory
+	// limit (the other half is for the survivors of the next collection)
+	if (lvm->gc.cgroup_headroom != SIZE_MAX && budget > lvm->gc.cgroup_headroom / 2)
+		budget = (lvm->gc.cgroup_headroom / 2 > lvm->gc.region_size) ? lvm->gc.cgroup_headroom / 2 : lvm->gc.region_size;
+	lvm->gc.allocation_budget = budget;
+	
+	size_t budget_regions = (budget + lvm->gc.region_size - 1) / lvm->gc.region_size;
+	lvm->gc.region_pool_low_watermark = budget_regions;
+	lvm->gc.region_pool_high_watermark = 2 * budget_regions;
+}
+
+
+/**
+ * Reads a small file of our cgroup into buffer. Returns false if the file
+ * doesn't exist (e.g. no cgroup v2 or no memory controller).
+ */
+static bool lvm_gc_read_cgroup_file(lvm_p lvm, const char* name, char* buffer, size_t buffer_size) {
+	char path[sizeof(lvm->gc.cgroup_path) + 32];
+	snprintf(path, sizeof(path), "%s/%s", lvm->gc.cgroup_path, name);
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+	
+	size_t length = fread(buffer, 1, buffer_size - 1, file);
+	buffer[length] = '\0';
+	fclose(file);
+	return true;
+}
+
+/**
+ * Updates the memory limit, the headroom until that limit and the memory
+ * pressure from the cgroup v2 files. Called at startup, after each collection
+ * and while we're under a limit every LVM_GC_CGROUP_READ_INTERVAL allocated
+ * bytes when a region is added.
+ */
+void lvm_gc_read_cgroup(lvm_p lvm) {
+	if (lvm->gc.cgroup_path[0] == '\0')
+		return;
+	
+	char buffer[256];
+	unsigned long long value = 0;
+	lvm->gc.cgroup_memory_max = SIZE_MAX;
+	lvm->gc.cgroup_headroom = SIZE_MAX;
+	if ( lvm_gc_read_cgroup_file(lvm, "memory.max", buffer, sizeof(buffer)) && sscanf(buffer, "%llu", &value) == 1 ) {
+		lvm->gc.cgroup_memory_max = value;
+		
+		size_t current = 0;
+		if ( lvm_gc_read_cgroup_file(lvm, "memory.current", buffer, sizeof(buffer)) && sscanf(buffer, "%llu", &value) == 1 )
+			current = value;
+		lvm->gc.cgroup_headroom = (current < lvm->gc.cgroup_memory_max) ? lvm->gc.cgroup_memory_max - current : 0;
+	}
+	
+	// The first line looks like "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+	double pressure = 0;
+	lvm->gc.cgroup_pressure = 0;
+	if ( lvm_gc_read_cgroup_file(lvm, "memory.pressure", buffer, sizeof(buffer)) && sscanf(buffer, "some avg10=%lf", &pressure) == 1 )
+		lvm->gc.cgroup_pressure = pressure;
+	
+	lvm->gc.bytes_allocated_at_cgroup_read = lvm->gc.stats.bytes_allocated;
+}
+
+/**
+ * Pretenures allocation sites whose atoms mostly survive. The collector counts
+ * the bytes of each atom that survives its first collection for the atom's
+ * site (and then resets the atom's site to 0 so it's only counted once).
+ * Pretenured sites allocate directly into the tenured space. The statistics of
+ * the other sites decay so they follow changes in the program's behavior.
+ * 
+ * Atoms of pretenured sites only get their first collection with a major one.
+ * There we check how much of what the site allocated since the last major
+ * survived and demote the site if that's not enough anymore.
+ */
+void lvm_gc_update_alloc_sites(lvm_p lvm, bool major) {
+	for(size_t i = 1; i < lvm->gc.alloc_sites_length; i++) {
+		lvm_gc_alloc_site_p site = &lvm->gc.alloc_sites[i];
+		if (site->immortal)
+			continue;
+		if (site->pretenure) {
+			if ( !major || site->allocated_bytes < LVM_GC_PRETENURE_MIN_BYTES )
+				continue;
+			if (site->survived_bytes < site->allocated_bytes * LVM_GC_PRETENURE_SURVIVAL_RATE) {
+				site->pretenure = false;
+				lvm->gc.stats.pretenured_sites--;
+				lvm->gc.stats.demoted_sites++;
+			}
+			site->allocated_bytes = 0;
+			site->survived_bytes = 0;
+			continue;
+		}
+		
+		if ( site->allocated_bytes >= LVM_GC_PRETENURE_MIN_BYTES && site->survived_bytes >= site->allocated_bytes * LVM_GC_PRETENURE_SURVIVAL_RATE ) {
+			site->pretenure = true;
+			lvm->gc.stats.pretenured_sites++;
+			// From now on only what it allocates into the tenured space counts
+			site->allocated_bytes = 0;
+			site->survived_bytes = 0;
+			continue;
+		}
+		
+		site->allocated_bytes /= 2;
+		site->survived_bytes /= 2;
+	}
 }
 
 
 void lvm_gc_collect_atom(lvm_p lvm, lvm_atom_p* atom);
+void lvm_gc_mark_compact(lvm_p lvm, lvm_atom_p* survivers[], lvm_env_p envs[]);
+void lvm_gc_heap_dump(lvm_p lvm, FILE* output, FILE* graph_output, lvm_atom_p* survivers[], lvm_env_p envs[]);
+void lvm_gc_profile_write(lvm_p lvm, FILE* output, lvm_env_p envs[]);
+void lvm_gc_update_stats(lvm_p lvm, struct timespec start, size_t bytes_in_old_space, size_t bytes_copied);
+void lvm_gc_collect_pinned_atoms(lvm_p lvm, lvm_gc_atom_set_t* pins);
+void lvm_gc_keep_pinned_regions(lvm_p lvm, lvm_gc_atom_set_t* pins);
+void lvm_gc_evacuate_tenured_space(lvm_p lvm);
+
+typedef struct {
+	lvm_atom_p* atoms;
+	size_t length, capacity;
+} lvm_gc_weak_list_t, *lvm_gc_weak_list_p;
+typedef bool (*lvm_gc_is_reached_t)(lvm_p lvm, lvm_atom_p* atom);
+
+// Ephemerons of weak tables whose keys weren't reached yet wait by their key,
+// see lvm_gc_process_weak_atoms(). keys maps a key to its first waiting
+// ephemeron, the others are chained with next (SIZE_MAX ends the chain).
+// Ephemerons whose key was reached go on the ready list.
+SH_GEN_DECL(lvm_gc_ephemeron_keys, void*, size_t);
+SH_GEN_HASH_DEF(lvm_gc_ephemeron_keys, void*, size_t);
+typedef struct {
+	lvm_ephemeron_p entry;
+	size_t next;
+} lvm_gc_waiting_ephemeron_t;
+typedef struct {
+	lvm_gc_ephemeron_keys_t keys;
+	lvm_gc_waiting_ephemeron_t* waiting_ptr;
+	size_t waiting_length, waiting_capacity;
+	lvm_ephemeron_p* ready_ptr;
+	size_t ready_length, ready_capacity;
+} lvm_gc_ephemerons_t, *lvm_gc_ephemerons_p;
+
+// The child collector functions don't take a context, so lvm->gc.collection
+// points to the state of the running collection (or heap dump). Fields that
+// don't apply to it are NULL.
+struct lvm_gc_collection_s {
+	lvm_gc_atom_set_t* pins;
+	lvm_gc_string_table_t* strings;
+	// Weak atoms are only recorded while this is set
+	lvm_gc_weak_list_p weak_list;
+	// The collectors report every atom they reach for the first time while this
+	// is set, see lvm_gc_reached_key()
+	lvm_gc_ephemerons_p ephemerons;
+	// Envs aren't atoms, the running trace follows the envs of lambdas through
+	// this function
+	void (*env_collector)(lvm_p lvm, lvm_env_p env);
+	lvm_gc_atom_set_t* envs;
+	struct lvm_gc_heap_walk_s* heap_walk;
+	struct lvm_gc_mark_compact_s* mark_compact;
+};
+static void lvm_gc_reached_key(lvm_p lvm, lvm_atom_p key);
+void lvm_gc_process_weak_atoms(lvm_p lvm, lvm_gc_weak_list_p list, lvm_gc_is_reached_t is_reached, lvm_gc_collect_child_t keep);
+void lvm_gc_run_finalizers(lvm_p lvm, lvm_gc_is_reached_t is_reached);
+static bool lvm_gc_is_copied(lvm_p lvm, lvm_atom_p* atom);
+
+/**
+ * Returns where the slots of a dict keep the pointer to the atom that owns
+ * them (see lvm_gc_calloc()) or NULL if the slots aren't in the heap, e.g.
+ * calloc()ed ones. Tells the atom about its dict so it knows the size of the
+ * slots and where to patch them when they move.
+ */
+static lvm_atom_p* lvm_gc_dict_storage(lvm_p lvm, lvm_dict_p dict) {
+	if ( dict->slots == NULL || lvm_gc_region_of(&lvm->gc.heap, dict->slots) == NULL )
+		return NULL;
+	
+	lvm_atom_p* storage = (lvm_atom_p*)dict->slots - 1;
+	if ((*storage)->bindings != dict)
+		(*storage)->bindings = dict;
+	return storage;
+}
+
+/**
+ * Copies the slots of an env (and its parents) and collects the atoms bound in
+ * them. Envs shared by several lambdas are only collected once.
+ */
+static void lvm_gc_collect_env(lvm_p lvm, lvm_env_p env) {
+	for(; env != NULL; env = env->parent) {
+		if ( lvm_gc_atom_set_contains(lvm->gc.collection->envs, env) )
+			return;
+		lvm_gc_atom_set_put(lvm->gc.collection->envs, env, true);
+		
+		lvm_atom_p* storage = lvm_gc_dict_storage(lvm, &env->bindings);
+		if (storage != NULL)
+			lvm_gc_collect_atom(lvm, storage);
+		for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it))
+			lvm_gc_collect_atom(lvm, &it->value);
+	}
+}
 
 void lvm_gc_collect(lvm_p lvm, lvm_atom_p* survivers[], lvm_env_p envs[]) {
+	// Collections normally leave the tenured space alone and scan its atoms as
+	// roots. Once it grew by its budget a major collection evacuates it as
+	// well, see lvm_gc_evacuate_tenured_space().
+	bool major = lvm->gc.tenured_bytes_allocated >= lvm->gc.tenured_budget;
+	
+	// Mark-compact slides every live atom. With pinned atoms around we use the
+	// copying collector instead, it can leave their regions where they are.
+	// BiBoP pages always use the copying collector, compacting would slide
+	// atoms of different types into the same page. So do major collections,
+	// mark-compact only works on the new space.
+#	ifndef LVM_BIBOP
+	if (lvm->gc.mark_compact && lvm->gc.pinned_length == 0 && !major) {
+		lvm_gc_mark_compact(lvm, survivers, envs);
+		return;
+	}
+#	endif
+	
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t bytes_copied_before = lvm->gc.stats.bytes_copied;
+	lvm_gc_collection_t collection = { 0 };
+	lvm->gc.collection = &collection;
+	
 	// Swap spaces
 	lvm_gc_space_t temp = lvm->gc.new_space;
 	lvm->gc.new_space = lvm->gc.old_space;
 	lvm->gc.old_space = temp;
+	lvm_gc_update_space_of_regions(&lvm->gc.new_space);
+	lvm_gc_update_space_of_regions(&lvm->gc.old_space);
+	size_t bytes_in_old_space = lvm_gc_used_bytes_of_space(&lvm->gc.old_space);
+	if (major) {
+		lvm_gc_evacuate_tenured_space(lvm);
+		bytes_in_old_space += lvm_gc_used_bytes_of_space(&lvm->gc.old_tenured_space);
+	}
+	
+	// Move all large atoms into the old large space. Every large atom we reach
+	// is tagged with the large space again and moved back once we're done, the
+	// remaining ones are garbage.
+	lvm->gc.old_large_space = lvm->gc.large_space;
+	lvm->gc.large_space = (lvm_gc_space_t){ 0 };
+	lvm_gc_update_space_of_regions(&lvm->gc.old_large_space);
+	
+	// Weak atoms we come across are only recorded and processed once we
+	// copied all strongly reachable atoms
+	lvm_gc_weak_list_t weak_list = { 0 };
+	collection.weak_list = &weak_list;
+	
+	lvm_gc_string_table_t strings;
+	if (lvm->gc.string_dedup) {
+		lvm_gc_string_table_new(&strings);
+		collection.strings = &strings;
+	}
+	
+	lvm_gc_atom_set_t visited_envs;
+	lvm_gc_atom_set_new(&visited_envs);
+	collection.envs = &visited_envs;
+	collection.env_collector = lvm_gc_collect_env;
+	
+	// Root: Pinned atoms, they have to be known before any other atom is
+	// collected
+	lvm_gc_atom_set_t pins;
+	lvm_gc_collect_pinned_atoms(lvm, &pins);
 	
 	// Root: Atoms on the argument stack
 	for(size_t i = 0; i < lvm->arg_stack_length; i++) {
 		lvm_gc_collect_atom(lvm, &lvm->arg_stack_ptr[i]);
 	}
 	
+	// Root: Variables registered in handle scopes
+	for(size_t i = 0; i < lvm->handle_stack_length; i++) {
+		lvm_gc_collect_atom(lvm, lvm->handle_stack_ptr[i]);
+	}
+	
 	// Root: Argument atoms of the collect function that have to survive
 	for(size_t i = 0; survivers[i] != NULL; i++) {
 		lvm_gc_collect_atom(lvm, survivers[i]);
 	}
 	
-	// Root: Environments passed to the collector function
+	// Root: References of tenured atoms (we don't know which ones changed). A
+	// major collection only scans the regions it keeps, the atoms it copied
+	// into the tenured space so far have been collected already.
+	for(lvm_gc_region_p r = lvm->gc.tenured_space.first; r != NULL; r = r->next) {
+		if ( !major || (r->flags & (LVM_GC_KEEP_TENURED | LVM_GC_DONT_MOVE)) )
+			lvm_gc_scan_region(lvm, r, lvm_gc_collect_atom);
+	}
+	
+	// Root: Environments passed to the collector function (and their parents)
 	for(size_t i = 0; envs[i] != NULL; i++) {
-		// Go up the parent chain for this environment
-		for(lvm_env_p env = envs[i]; env != NULL; env = env->parent) {
-			for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it)) {
-				//const char* key = it->key;
-				lvm_gc_collect_atom(lvm, &it->value);
-			}
+		lvm_gc_collect_env(lvm, envs[i]);
+	}
+	
+	// Root: Slots of the symbol table, the symbols themselves are immortal
+	lvm_atom_p* symbol_slots = lvm_gc_dict_storage(lvm, &lvm->symbol_table);
+	if (symbol_slots != NULL)
+		lvm_gc_collect_atom(lvm, symbol_slots);
+	
+	// Keep weak table values of reached keys and clear references to atoms we
+	// didn't reach. Needs the old space, it tells us which atoms were reached.
+	collection.weak_list = NULL;
+	lvm_gc_process_weak_atoms(lvm, &weak_list, lvm_gc_is_copied, lvm_gc_collect_atom);
+	free(weak_list.atoms);
+	lvm_gc_run_finalizers(lvm, lvm_gc_is_copied);
+	collection.env_collector = NULL;
+	collection.envs = NULL;
+	lvm_gc_atom_set_destroy(&visited_envs);
+	
+	if (lvm->gc.string_dedup) {
+		collection.strings = NULL;
+		lvm_gc_string_table_destroy(&strings);
+	}
+	
+	// Hand the regions of the old space back to the pool so the next
+	// allocations can reuse them instead of mapping fresh ones. Regions with
+	// pinned atoms stay in the new space.
+	lvm_gc_keep_pinned_regions(lvm, &pins);
+	lvm_gc_region_p next = NULL;
+	for(lvm_gc_region_p r = lvm->gc.old_space.first; r != NULL; r = next) {
+		next = r->next;
+		lvm_gc_put_region_into_pool(lvm, r);
+	}
+	lvm->gc.old_space = (lvm_gc_space_t){ 0 };
+	
+	// Large atoms we haven't reached are garbage
+	for(lvm_gc_region_p r = lvm->gc.old_large_space.first; r != NULL; r = next) {
+		next = r->next;
+		r->next = NULL;
+		if (r->space == &lvm->gc.large_space)
+			lvm_gc_append_region_to_space(&lvm->gc.large_space, r);
+		else
+			lvm_gc_free_region(&lvm->gc.heap, r);
+	}
+	lvm->gc.old_large_space = (lvm_gc_space_t){ 0 };
+	
+	// Evacuated tenured regions go the same way as the old space. The next
+	// major is due once the tenured space grew by what survived this one.
+	if (major) {
+		for(lvm_gc_region_p r = lvm->gc.old_tenured_space.first; r != NULL; r = next) {
+			next = r->next;
+			lvm_gc_put_region_into_pool(lvm, r);
+		}
+		lvm->gc.old_tenured_space = (lvm_gc_space_t){ 0 };
+		
+		size_t tenured_bytes = lvm_gc_used_bytes_of_space(&lvm->gc.tenured_space);
+		size_t min_budget = LVM_GC_MAJOR_MIN_BUDGET_REGIONS * lvm->gc.region_size;
+		lvm->gc.tenured_budget = (tenured_bytes > min_budget) ? tenured_bytes : min_budget;
+		lvm->gc.tenured_bytes_allocated = 0;
+		lvm->gc.stats.major_collections++;
+	}
+	
+	lvm_gc_update_alloc_sites(lvm, major);
+	lvm_gc_adapt_heap_size(lvm);
+	lvm_gc_trim_region_pool(lvm);
+	lvm->gc.collection = NULL;
+	
+	lvm_gc_update_stats(lvm, start, bytes_in_old_space, lvm->gc.stats.bytes_copied - bytes_copied_before);
+}
+
+void lvm_gc_update_stats(lvm_p lvm, struct timespec start, size_t bytes_in_old_space, size_t bytes_copied) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double pause_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	
+	lvm_gc_stats_p stats = &lvm->gc.stats;
+	stats->collections++;
+	stats->total_pause_ms += pause_ms;
+	if (pause_ms > stats->max_pause_ms)
+		stats->max_pause_ms = pause_ms;
+	
+	size_t bucket = 0;
+	for(double limit = 1; pause_ms >= limit && bucket < LVM_GC_PAUSE_HISTOGRAM_BUCKETS - 1; limit *= 2)
+		bucket++;
+	stats->pause_histogram[bucket]++;
+	
+	lvm->gc.bytes_collected += bytes_in_old_space;
+	stats->last_survival_rate = (bytes_in_old_space > 0) ? (double)bytes_copied / bytes_in_old_space : 0;
+	stats->average_survival_rate = (lvm->gc.bytes_collected > 0) ? (double)stats->bytes_copied / lvm->gc.bytes_collected : 0;
+}
+
+/**
+ * Collects and then moves every surviving atom into the tenured space. Their
+ * regions are prepended so pretenured allocations don't go into them and
+ * flagged so major collections don't evacuate them. After a fork() the
+ * children only read these pages during their collections (to find references
+ * into their new space) and keep sharing them with the parent.
+ */
+void lvm_gc_tenure(lvm_p lvm, lvm_env_p env) {
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ env, NULL });
+	
+	lvm_gc_space_p spaces[] = { &lvm->gc.new_space, &lvm->gc.large_space };
+	for(size_t i = 0; i < sizeof(spaces) / sizeof(spaces[0]); i++) {
+		lvm_gc_region_p r = spaces[i]->first;
+		while (r != NULL) {
+			lvm_gc_region_p next = r->next;
+			r->flags |= LVM_GC_KEEP_TENURED;
+			lvm_gc_prepend_region_to_space(&lvm->gc.tenured_space, r);
+			r = next;
+		}
+		*spaces[i] = (lvm_gc_space_t){ 0 };
+	}
+}
+
+/**
+ * Starts a major collection right after the spaces were swapped. The regions of
+ * the tenured space move into the old tenured space, lvm_gc_collect_atom()
+ * copies the atoms reached there back into the tenured space and the regions
+ * are freed along with the old space. Regions flagged with LVM_GC_KEEP_TENURED
+ * stay, so do regions with pinned atoms or their data (flagged with
+ * LVM_GC_DONT_MOVE until the next major). Kept regions are still roots.
+ * 
+ * An atom and its data can end up in different regions when the data doesn't
+ * fit into the region of the atom. Kept atoms aren't copied, so the ones with
+ * data in an evacuated region get a copy of it here.
+ */
+void lvm_gc_evacuate_tenured_space(lvm_p lvm) {
+	lvm_gc_space_p tenured = &lvm->gc.tenured_space, old_tenured = &lvm->gc.old_tenured_space;
+	for(lvm_gc_region_p r = tenured->first; r != NULL; r = r->next) {
+		if ( !(r->flags & LVM_GC_KEEP_TENURED) )
+			r->flags &= ~LVM_GC_DONT_MOVE;
+	}
+	for(size_t i = 0; i < lvm->gc.pinned_length; i++) {
+		lvm_atom_p atom = lvm->gc.pinned_ptr[i];
+		lvm_gc_region_p region = lvm_gc_find_region_of_space(lvm, tenured, atom);
+		if (region == NULL)
+			continue;
+		region->flags |= LVM_GC_DONT_MOVE;
+		
+		void* data_ptr = NULL;
+		if ( lvm_gc_atom_infos[lvm_atom_type(atom)].get_data != NULL && lvm_gc_atom_infos[lvm_atom_type(atom)].get_data(lvm, atom, &data_ptr) > 0 ) {
+			lvm_gc_region_p data_region = lvm_gc_find_region_of_space(lvm, tenured, data_ptr);
+			if (data_region != NULL)
+				data_region->flags |= LVM_GC_DONT_MOVE;
+		}
+	}
+	
+	lvm_gc_region_p next = NULL, first = tenured->first;
+	*tenured = (lvm_gc_space_t){ 0 };
+	for(lvm_gc_region_p r = first; r != NULL; r = next) {
+		next = r->next;
+		r->next = NULL;
+		if (r->flags & (LVM_GC_KEEP_TENURED | LVM_GC_DONT_MOVE))
+			lvm_gc_prepend_region_to_space(tenured, r);
+		else
+			lvm_gc_append_region_to_space(old_tenured, r);
+	}
+	
+	// Regions for the copied data are appended, the loop passes them without
+	// finding any atoms
+	for(lvm_gc_region_p r = tenured->first; r != NULL; r = r->next) {
+#		ifdef LVM_BIBOP
+		// Headerless atoms don't have data
+		if (r->atom_type != LVM_T_MAX)
+			continue;
+#		endif
+		for(uint32_t offset = sizeof(lvm_gc_region_t); offset < r->free_offset; ) {
+			lvm_atom_p atom = (void*)r + offset;
+			lvm_gc_atom_info_p info = &lvm_gc_atom_infos[lvm_atom_type(atom)];
+			offset += info->size;
 			
+			void* data_ptr = NULL;
+			size_t data_size = (info->get_data != NULL) ? info->get_data(lvm, atom, &data_ptr) : 0;
+			if ( data_size == 0 || !lvm_gc_space_contains(lvm, old_tenured, data_ptr) )
+				continue;
+			void* new_data_ptr = lvm_gc_alloc_data_from_space(lvm, tenured, data_size, NULL);
+			memcpy(new_data_ptr, data_ptr, data_size);
+			info->set_data(lvm, atom, new_data_ptr);
+			lvm->gc.stats.bytes_copied += LVM_GC_ALIGN(data_size);
 		}
 	}
+}
+
+void lvm_gc_stats(lvm_p lvm, lvm_gc_stats_p stats) {
+	*stats = lvm->gc.stats;
+	stats->uncollected_regions = lvm_gc_count_regions_of_space(&lvm->gc.uncollected);
+	stats->new_space_regions   = lvm_gc_count_regions_of_space(&lvm->gc.new_space);
+	stats->large_space_regions = lvm_gc_count_regions_of_space(&lvm->gc.large_space);
+	stats->pooled_regions      = lvm->gc.region_pool_length;
+	if (lvm->gc.background_sweep) {
+		pthread_mutex_lock(&lvm->gc.sweeper_mutex);
+		stats->swept_regions    = lvm->gc.swept_regions;
+		stats->regions_to_sweep = lvm_gc_count_regions_of_space(&lvm->gc.sweeper_dirty);
+		pthread_mutex_unlock(&lvm->gc.sweeper_mutex);
+	}
+	stats->tenured_regions     = lvm_gc_count_regions_of_space(&lvm->gc.tenured_space);
+	stats->pinned_regions      = 0;
+	for(lvm_gc_region_p r = lvm->gc.new_space.first; r != NULL; r = r->next) {
+		if (r->flags & LVM_GC_DONT_MOVE)
+			stats->pinned_regions++;
+	}
+	stats->allocation_budget   = lvm->gc.allocation_budget;
+	stats->memory_limit        = (lvm->gc.cgroup_memory_max != SIZE_MAX) ? lvm->gc.cgroup_memory_max : 0;
+	stats->memory_pressure     = lvm->gc.cgroup_pressure;
+}
+
+/**
+ * Returns where the collector copied an atom to or NULL if it wasn't copied
+ * (yet). Copied atoms are overwritten by a forward pointer, for headerless
+ * atoms the bitmap of their page tells us if the payload is one.
+ */
+static lvm_atom_p lvm_gc_forwarded_atom(lvm_atom_p atom, lvm_atom_type_t type) {
+	if (type == LVM_T_FORWARD_PTR)
+		return atom->new_atom;
 	
-	// Invalidate regions in old space
-	for(lvm_gc_region_p r = lvm->gc.old_space.first; r != NULL; r = r->next) {
-		lvm_gc_invalidate_data_in_region(r);
+#	ifdef LVM_BIBOP
+	// The page header tells us if the atom is headerless. LVM_T_FORWARD_PTR
+	// has no entry in lvm_gc_atom_infos so don't look there.
+	lvm_gc_region_p page = lvm_gc_page_of(atom);
+	if (page->atom_type != LVM_T_MAX) {
+		size_t index = lvm_gc_page_atom_index(page, atom);
+		return ( lvm_gc_page_forwarded_bits(page)[index / 64] & (1ULL << (index % 64)) ) ? atom->new_atom : NULL;
+	}
+#	endif
+	return NULL;
+}
+
+static void lvm_gc_write_forward_ptr(lvm_atom_p atom, lvm_atom_type_t type, lvm_atom_p new_atom) {
+#	ifdef LVM_BIBOP
+	lvm_gc_region_p page = lvm_gc_page_of(atom);
+	if (page->atom_type != LVM_T_MAX) {
+		size_t index = lvm_gc_page_atom_index(page, atom);
+		lvm_gc_page_forwarded_bits(page)[index / 64] |= 1ULL << (index % 64);
+		atom->new_atom = new_atom;
+		return;
 	}
+#	endif
+	atom->type = LVM_T_FORWARD_PTR;
+	atom->new_atom = new_atom;
 }
 
 void lvm_gc_collect_atom(lvm_p lvm, lvm_atom_p* atom) {
-	lvm_atom_type_t type = (*atom)->type;
+	lvm_atom_type_t type = lvm_atom_type(*atom);
 	
 	// We already collected the atom in question. Just patch the pointer to point directly to the new atom (instead of a
 	// forward pointer).
-	if (type == LVM_T_FORWARD_PTR) {
-		*atom = (*atom)->new_atom;
+	lvm_atom_p forwarded_atom = lvm_gc_forwarded_atom(*atom, type);
+	if (forwarded_atom != NULL) {
+		*atom = forwarded_atom;
+		return;
+	}
+	
+	// Pinned atoms stay where they are, only collect their children the first
+	// time we see them
+	lvm_gc_collection_p collection = lvm->gc.collection;
+	if ( collection->pins != NULL && lvm_gc_atom_set_contains(collection->pins, *atom) ) {
+		if ( !lvm_gc_atom_set_get(collection->pins, *atom, true) ) {
+			lvm_gc_atom_set_put(collection->pins, *atom, true);
+			if (collection->ephemerons != NULL)
+				lvm_gc_reached_key(lvm, *atom);
+			if (lvm_gc_atom_infos[type].child_collector != NULL)
+				lvm_gc_atom_infos[type].child_collector(lvm, *atom, lvm_gc_collect_atom);
+		}
+		return;
+	}
+	
+	// One heap lookup tells us the space of the atom
+	lvm_gc_region_p region = lvm_gc_region_of(&lvm->gc.heap, *atom);
+	lvm_gc_space_p space = (region != NULL) ? region->space : NULL;
+	
+	// Immortal atoms (nil, symbols, builtins, ...) never move and only
+	// reference other immortal atoms, so there is nothing to do for them
+	if (space == &lvm->gc.uncollected)
+		return;
+	
+	// Not ours to move, the atom isn't in the heap
+	if (region == NULL)
+		return;
+	
+	// Tenured atoms don't move, their references are scanned separately. A
+	// major collection copies the ones it evacuates back into the tenured space.
+	if (space == &lvm->gc.tenured_space)
+		return;
+	lvm_gc_space_p to_space = (space == &lvm->gc.old_tenured_space) ? &lvm->gc.tenured_space : &lvm->gc.new_space;
+	
+	// Large atoms stay where they are. If it's still in the old large space
+	// tag its region with the large space and collect its children. The
+	// region stays in the list of the old large space until the collection is
+	// done, so we don't need to unlink it here. Large atoms already in the
+	// large space have been collected before.
+	if (space == &lvm->gc.old_large_space) {
+		region->space = &lvm->gc.large_space;
+		if (collection->ephemerons != NULL)
+			lvm_gc_reached_key(lvm, *atom);
+		if (lvm_gc_atom_infos[type].child_collector != NULL)
+			lvm_gc_atom_infos[type].child_collector(lvm, *atom, lvm_gc_collect_atom);
+		return;
+	} else if (space == &lvm->gc.large_space) {
 		return;
 	}
 	
+	
 	// Copy atom to new space
 	size_t data_size = 0;
 	void* old_data_ptr = NULL;
 	if (lvm_gc_atom_infos[type].get_data != NULL)
 		data_size = lvm_gc_atom_infos[type].get_data(lvm, *atom, &old_data_ptr);
 	
+	// Strings are immutable, so an equal string copied before can share its
+	// data with this one
+	const char* shared_data = NULL;
+	if ( type == LVM_T_STR && collection->strings != NULL ) {
+		shared_data = lvm_gc_string_table_get(collection->strings, old_data_ptr, NULL);
+		if (shared_data != NULL) {
+			lvm->gc.stats.string_dedup_bytes += LVM_GC_ALIGN(data_size);
+			data_size = 0;
+		}
+	}
+	
+	// Atoms that grew big after allocation (e.g. strings built with
+	// lvm_gc_alloc_atom() and lvm_gc_alloc_data()) go into the large space
+	// now, so they are copied once and not again on every collection.
+	size_t atom_size = lvm_gc_atom_infos[type].size, atom_offset = lvm_gc_atom_infos[type].offset;
 	void* new_data_ptr = NULL;
-	lvm_atom_p new_atom = lvm_gc_alloc_from_space(&lvm->gc.new_space, type, data_size, &new_data_ptr, NULL);
-	size_t atom_size = lvm_gc_atom_infos[type].size;
-	memcpy(new_atom, *atom, atom_size);
+	lvm_atom_p new_atom = NULL;
+	if (atom_size + LVM_GC_ALIGN(data_size) >= LVM_GC_LARGE_ATOM_SIZE(lvm->gc.region_size))
+		new_atom = lvm_gc_alloc_in_large_region(lvm, type, data_size, &new_data_ptr);
+	else
+		new_atom = lvm_gc_alloc_from_space(lvm, to_space, type, data_size, &new_data_ptr, NULL);
+	memcpy((void*)new_atom + atom_offset, (void*)*atom + atom_offset, atom_size);
+	lvm->gc.stats.bytes_copied += atom_size + LVM_GC_ALIGN(data_size);
+	
+	// Count the first survival for the allocation site of the atom
+	if (atom_offset == 0) {
+		lvm->gc.alloc_sites[new_atom->alloc_site].survived_bytes += atom_size + LVM_GC_ALIGN(data_size);
+		new_atom->alloc_site = 0;
+	}
 	
 	// Copy data to new space
 	if (data_size > 0) {
 		memcpy(new_data_ptr, old_data_ptr, data_size);
-		// TODO: Find a proper way to patch the data pointer of the atom
-		if (new_atom->type == LVM_T_ENV)
-			new_atom->bindings->slots = new_data_ptr;
-		else
-			new_atom->str = new_data_ptr;
+		lvm_gc_atom_infos[type].set_data(lvm, new_atom, new_data_ptr);
+		if ( type == LVM_T_STR && collection->strings != NULL )
+			lvm_gc_string_table_put(collection->strings, new_data_ptr, new_data_ptr);
+	} else if (shared_data != NULL) {
+		lvm_gc_atom_infos[type].set_data(lvm, new_atom, (void*)shared_data);
 	}
 	
 	// Write forward pointer
-	(*atom)->type = LVM_T_FORWARD_PTR;
-	(*atom)->new_atom = new_atom;
+	lvm_gc_write_forward_ptr(*atom, type, new_atom);
+	if (collection->ephemerons != NULL)
+		lvm_gc_reached_key(lvm, *atom);
 	
 	// Patch old atom pointer directly to new atom
 	*atom = new_atom;
@@ -216,71 +1162,2148 @@ void lvm_gc_collect_atom(lvm_p lvm, lvm_atom_p* atom) {
 
 
 
-lvm_gc_region_p lvm_gc_allocate_region(size_t size, uint16_t flags) {
-	size_t size_in_64k_chunks = (size + (LVM_GC_64K - 1)) / LVM_GC_64K;
-	lvm_gc_region_p region = mmap(NULL, size_in_64k_chunks * LVM_GC_64K, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (region == MAP_FAILED) {
-		// TODO: error handling
-		exit(1);
-	}
-	
-	*region = (lvm_gc_region_t){
-		.next = NULL,
-		.size_in_64k_chunks = size_in_64k_chunks,
-		.flags = flags,
-		.free_offset = sizeof(lvm_gc_region_t),
-		.free_bytes = (size_in_64k_chunks * LVM_GC_64K) - sizeof(lvm_gc_region_t)
-	};
+//
+// Heap dump
+//
+
+static const char* lvm_gc_type_names[] = {
+	[LVM_T_NIL]         = "nil",
+	[LVM_T_TRUE]        = "true",
+	[LVM_T_FALSE]       = "false",
+	[LVM_T_NUM]         = "num",
+	[LVM_T_SYM]         = "sym",
+	[LVM_T_STR]         = "str",
+	[LVM_T_PAIR]        = "pair",
+	[LVM_T_LAMBDA]      = "lambda",
+	[LVM_T_BUILTIN]     = "builtin",
+	[LVM_T_SYNTAX]      = "syntax",
+	[LVM_T_ERROR]       = "error",
+	[LVM_T_ENV]         = "env",
+	[LVM_T_WEAK]        = "weak",
+	[LVM_T_WEAK_TABLE]  = "weak_table",
+	[LVM_T_FORWARD_PTR] = "forward_ptr"
+};
+
+typedef struct lvm_gc_heap_walk_s {
+	lvm_gc_atom_set_t visited;
+	lvm_atom_p* stack;
+	size_t stack_length, stack_capacity;
 	
-	return region;
-}
+	size_t counts[LVM_T_MAX], bytes[LVM_T_MAX];
+	size_t total_bytes;
+	FILE* graph_output;
+} lvm_gc_heap_walk_t, *lvm_gc_heap_walk_p;
 
-void lvm_gc_invalidate_data_in_region(lvm_gc_region_p region) {
-	// Don't invalidate the header struct at the start of the region. So leave one 4k page there.
-	void* ptr = (void*)(((size_t)region + sizeof(lvm_gc_region_t) + 4096 - 1) / 4096 * 4096);
-	madvise(ptr, region->size_in_64k_chunks * LVM_GC_64K - 4096, MADV_DONTNEED);
+static void lvm_gc_heap_walk_push(lvm_gc_heap_walk_p walk, lvm_atom_p atom) {
+	if (walk->stack_length >= walk->stack_capacity) {
+		walk->stack_capacity = (walk->stack_capacity + 1) * 2;
+		walk->stack = realloc(walk->stack, walk->stack_capacity * sizeof(walk->stack[0]));
+	}
+	walk->stack[walk->stack_length++] = atom;
 }
 
-void lvm_gc_free_region(lvm_gc_region_p region) {
-	munmap(region, region->size_in_64k_chunks * LVM_GC_64K);
+static void lvm_gc_heap_walk_child(lvm_p lvm, lvm_atom_p* child) {
+	lvm_gc_heap_walk_p walk = lvm->gc.collection->heap_walk;
+	if (walk->graph_output)
+		fprintf(walk->graph_output, " %p", (void*)*child);
+	lvm_gc_heap_walk_push(walk, *child);
 }
 
+static void lvm_gc_heap_walk_env(lvm_p lvm, lvm_gc_heap_walk_p walk, lvm_env_p env) {
+	for(; env != NULL; env = env->parent) {
+		if ( lvm_gc_atom_set_contains(&walk->visited, env) )
+			return;
+		lvm_gc_atom_set_put(&walk->visited, env, true);
+		
+		for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it))
+			lvm_gc_heap_walk_push(walk, it->value);
+	}
+}
 
-void lvm_gc_ensure_free_bytes_in_space(lvm_gc_space_p space, size_t size, bool* added_new_region) {
-	lvm_gc_region_p region = space->last;
-	if ( region == NULL || region->free_bytes < size ) {
-		// Not enough space, we need to add another region to this space
-		lvm_gc_region_p new_region = lvm_gc_allocate_region(LVM_GC_REGION_SIZE, 0);
+/**
+ * Visits all atoms on the stack of the walk (and everything reachable from
+ * them). Uses an explicit stack so long lists don't overflow the C stack.
+ */
+static void lvm_gc_heap_walk_drain(lvm_p lvm, lvm_gc_heap_walk_p walk) {
+	while (walk->stack_length > 0) {
+		lvm_atom_p atom = walk->stack[--walk->stack_length];
+		if ( lvm_gc_atom_set_contains(&walk->visited, atom) )
+			continue;
+		lvm_gc_atom_set_put(&walk->visited, atom, true);
 		
-		// Wire new region into space
-		if (region != NULL)
-			region->next = new_region;
-		else
-			space->first = new_region;
-		space->last = new_region;
+		lvm_atom_type_t type = lvm_atom_type(atom);
+		size_t size = lvm_gc_atom_infos[type].size;
+		void* data_ptr = NULL;
+		if (lvm_gc_atom_infos[type].get_data != NULL)
+			size += LVM_GC_ALIGN(lvm_gc_atom_infos[type].get_data(lvm, atom, &data_ptr));
+		
+		walk->counts[type]++;
+		walk->bytes[type] += size;
+		walk->total_bytes += size;
+		
+		if (walk->graph_output)
+			fprintf(walk->graph_output, "atom %p %s %zu", (void*)atom, lvm_gc_type_names[type], size);
+		
+		if (type == LVM_T_LAMBDA) {
+			// Lambda environments aren't atoms (yet), walk their bindings directly
+			lvm_gc_heap_walk_child(lvm, &atom->args);
+			lvm_gc_heap_walk_child(lvm, &atom->body);
+			lvm_gc_heap_walk_env(lvm, walk, atom->env);
+		} else if (lvm_gc_atom_infos[type].child_collector != NULL) {
+			lvm_gc_atom_infos[type].child_collector(lvm, atom, lvm_gc_heap_walk_child);
+		}
 		
-		// Set marker if the caller wants to know
-		if (added_new_region)
-			*added_new_region = true;
+		if (walk->graph_output)
+			fprintf(walk->graph_output, "\n");
 	}
 }
 
-lvm_atom_p lvm_gc_alloc_atom_from_space(lvm_gc_space_p space, lvm_atom_type_t type, bool* added_new_region) {
-	uint32_t atom_size = lvm_gc_atom_infos[type].size;
-	lvm_gc_ensure_free_bytes_in_space(space, atom_size, added_new_region);
-	lvm_gc_region_p region = space->last;
+/**
+ * Walks all live atoms from the same roots lvm_gc_collect() uses and writes a
+ * census to output: Count and bytes (atom and data) per atom type and the
+ * retained size of each binding in the root environments.
+ * 
+ * The retained size is an estimate: Atoms reachable from several bindings are
+ * only counted for the first binding that reaches them.
+ * 
+ * If graph_output isn't NULL the entire object graph is written there. One
+ * line per root and atom:
+ * 
+ *   root <kind> <name> <address>
+ *   atom <address> <type> <bytes> <child address>...
+ * 
+ * tools/heap_analyzer can query that file.
+ */
+void lvm_gc_heap_dump(lvm_p lvm, FILE* output, FILE* graph_output, lvm_atom_p* survivers[], lvm_env_p envs[]) {
+	lvm_gc_heap_walk_t walk = { .graph_output = graph_output };
+	lvm_gc_atom_set_new(&walk.visited);
+	lvm_gc_collection_t collection = { .heap_walk = &walk };
+	lvm->gc.collection = &collection;
 	
-	lvm_atom_p atom = (void*)region + region->free_offset;
-	atom->type = type;
-	region->free_offset += atom_size;
-	region->free_bytes  -= atom_size;
+	fprintf(output, "# retained by binding\n");
+	for(size_t i = 0; envs[i] != NULL; i++) {
+		for(lvm_env_p env = envs[i]; env != NULL; env = env->parent) {
+			if ( lvm_gc_atom_set_contains(&walk.visited, env) )
+				break;
+			lvm_gc_atom_set_put(&walk.visited, env, true);
+			
+			for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it)) {
+				if (graph_output)
+					fprintf(graph_output, "root binding %s %p\n", it->key, (void*)it->value);
+				
+				size_t bytes_before = walk.total_bytes;
+				lvm_gc_heap_walk_push(&walk, it->value);
+				lvm_gc_heap_walk_drain(lvm, &walk);
+				fprintf(output, "%-24s %10zu bytes\n", it->key, walk.total_bytes - bytes_before);
+			}
+		}
+	}
 	
-	return atom;
-}
+	for(size_t i = 0; i < lvm->arg_stack_length; i++) {
+		if (graph_output)
+			fprintf(graph_output, "root arg_stack %zu %p\n", i, (void*)lvm->arg_stack_ptr[i]);
+		lvm_gc_heap_walk_push(&walk, lvm->arg_stack_ptr[i]);
+	}
+	for(size_t i = 0; i < lvm->handle_stack_length; i++) {
+		if (graph_output)
+			fprintf(graph_output, "root handle %zu %p\n", i, (void*)*lvm->handle_stack_ptr[i]);
+		lvm_gc_heap_walk_push(&walk, *lvm->handle_stack_ptr[i]);
+	}
+	for(size_t i = 0; survivers[i] != NULL; i++) {
+		if (graph_output)
+			fprintf(graph_output, "root surviver %zu %p\n", i, (void*)*survivers[i]);
+		lvm_gc_heap_walk_push(&walk, *survivers[i]);
+	}
+	for(size_t i = 0; i < lvm->gc.pinned_length; i++) {
+		if (graph_output)
+			fprintf(graph_output, "root pinned %zu %p\n", i, (void*)lvm->gc.pinned_ptr[i]);
+		lvm_gc_heap_walk_push(&walk, lvm->gc.pinned_ptr[i]);
+	}
+	lvm_gc_heap_walk_drain(lvm, &walk);
+	
+	fprintf(output, "# live atoms by type\n");
+	size_t total_count = 0;
+	for(size_t type = 0; type < LVM_T_MAX; type++) {
+		if (walk.counts[type] == 0)
+			continue;
+		fprintf(output, "%-24s %10zu atoms %10zu bytes\n", lvm_gc_type_names[type], walk.counts[type], walk.bytes[type]);
+		total_count += walk.counts[type];
+	}
+	fprintf(output, "%-24s %10zu atoms %10zu bytes\n", "total", total_count, walk.total_bytes);
+	
+	lvm->gc.collection = NULL;
+	lvm_gc_atom_set_destroy(&walk.visited);
+	free(walk.stack);
+}
+
+void lvm_heap_dump(lvm_p lvm, FILE* output, FILE* graph_output) {
+	lvm_gc_heap_dump(lvm, output, graph_output, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ lvm->base_env, NULL });
+}
+
+
+//
+// Allocation profiler
+//
+// While the profiler is on lvm_gc_enter_alloc_site() keeps a stack of the
+// allocation sites of all running builtins, syntax and lambdas. Every
+// sample_interval allocated bytes the allocation functions call
+// lvm_gc_profile_sample() which charges the interval to the current call stack. Stacks are aggregated right away, so
+// the profile only grows with the number of distinct stacks. There are few of
+// those and samples are rare, a linear search is fast enough to find them.
+//
+
+void lvm_profile_start(lvm_p lvm, size_t sample_interval) {
+	lvm_gc_profile_t* profile = &lvm->gc.profile;
+	profile->stacks_length = 0;
+	profile->sites_length = 0;
+	profile->call_depth = 0;
+	profile->sample_interval = (sample_interval > 0) ? sample_interval : LVM_GC_DEFAULT_SAMPLE_INTERVAL;
+	profile->next_sample = lvm->gc.stats.bytes_allocated + profile->sample_interval;
+}
+
+void lvm_profile_stop(lvm_p lvm) {
+	lvm->gc.profile.next_sample = SIZE_MAX;
+}
+
+void lvm_gc_profile_sample(lvm_p lvm) {
+	lvm_gc_profile_t* profile = &lvm->gc.profile;
+	// One large allocation can cover several intervals
+	size_t intervals = (lvm->gc.stats.bytes_allocated - profile->next_sample) / profile->sample_interval + 1;
+	profile->next_sample += intervals * profile->sample_interval;
+	
+	size_t depth = (profile->call_depth < LVM_GC_MAX_CALL_DEPTH) ? profile->call_depth : LVM_GC_MAX_CALL_DEPTH;
+	// FNV-1a over the sites of the stack
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < depth; i++)
+		hash = (hash ^ profile->call_stack[i]) * 1099511628211ULL;
+	
+	lvm_gc_profile_stack_p stack = NULL;
+	for(size_t i = 0; i < profile->stacks_length; i++) {
+		lvm_gc_profile_stack_p candidate = &profile->stacks_ptr[i];
+		if ( candidate->hash == hash && candidate->depth == depth && memcmp(profile->sites_ptr + candidate->sites_offset, profile->call_stack, depth * sizeof(uint16_t)) == 0 ) {
+			stack = candidate;
+			break;
+		}
+	}
+	
+	if (stack == NULL) {
+		if (profile->sites_length + depth > profile->sites_capacity) {
+			profile->sites_capacity = (profile->sites_capacity + depth + 1) * 2;
+			profile->sites_ptr = realloc(profile->sites_ptr, profile->sites_capacity * sizeof(profile->sites_ptr[0]));
+		}
+		if (profile->stacks_length >= profile->stacks_capacity) {
+			profile->stacks_capacity = (profile->stacks_capacity + 1) * 2;
+			profile->stacks_ptr = realloc(profile->stacks_ptr, profile->stacks_capacity * sizeof(profile->stacks_ptr[0]));
+		}
+		
+		memcpy(profile->sites_ptr + profile->sites_length, profile->call_stack, depth * sizeof(uint16_t));
+		stack = &profile->stacks_ptr[profile->stacks_length++];
+		*stack = (lvm_gc_profile_stack_t){ .hash = hash, .sites_offset = profile->sites_length, .depth = depth };
+		profile->sites_length += depth;
+	}
+	
+	stack->bytes += intervals * profile->sample_interval;
+	stack->samples++;
+}
+
+/**
+ * Writes the profile in the collapsed stack format of flamegraph.pl, one line
+ * per call stack (outermost function first) with the sampled bytes:
+ * 
+ *   main;build-list;cons 1048576
+ * 
+ * Functions are named after the first binding to them found in envs (and
+ * their parents). Unbound functions are named by type and site (lambda#12),
+ * allocations outside of any function are charged to "toplevel".
+ */
+void lvm_gc_profile_write(lvm_p lvm, FILE* output, lvm_env_p envs[]) {
+	lvm_gc_profile_t* profile = &lvm->gc.profile;
+	const char** names = calloc(lvm->gc.alloc_sites_length, sizeof(names[0]));
+	for(size_t i = 0; envs[i] != NULL; i++) {
+		for(lvm_env_p env = envs[i]; env != NULL; env = env->parent) {
+			for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it)) {
+				lvm_atom_type_t type = lvm_atom_type(it->value);
+				if (type != LVM_T_BUILTIN && type != LVM_T_SYNTAX && type != LVM_T_LAMBDA)
+					continue;
+				if (it->value->call_site != 0 && names[it->value->call_site] == NULL)
+					names[it->value->call_site] = it->key;
+			}
+		}
+	}
+	
+	for(size_t i = 0; i < profile->stacks_length; i++) {
+		lvm_gc_profile_stack_p stack = &profile->stacks_ptr[i];
+		if (stack->depth == 0)
+			fprintf(output, "toplevel");
+		
+		for(size_t j = 0; j < stack->depth; j++) {
+			uint16_t site = profile->sites_ptr[stack->sites_offset + j];
+			if (j > 0)
+				fprintf(output, ";");
+			
+			if (site == 0)
+				fprintf(output, "unknown");
+			else if (site == LVM_GC_IMMORTAL_SITE)
+				fprintf(output, "immortal");
+			else if (names[site] != NULL)
+				fprintf(output, "%s", names[site]);
+			else
+				fprintf(output, "%s#%u", lvm_gc_type_names[lvm->gc.alloc_sites[site].func_type], site);
+		}
+		
+		fprintf(output, " %zu\n", stack->bytes);
+	}
+	
+	free(names);
+}
+
+void lvm_profile_write(lvm_p lvm, FILE* output, lvm_env_p env) {
+	lvm_gc_profile_write(lvm, output, (lvm_env_p[]){ env, NULL });
+}
+
+
+//
+// Heap images
+//
+// lvm_image_save() copies everything reachable from the base env and the
+// symbol table into one region and writes it to a file:
+// 
+//   header         lvm_gc_image_header_t, padded to 64 KiByte
+//   region         A complete region with a header, the atoms packed at its
+//                  start and their data (strings, binding names) at its end.
+//                  Its pointers already have the values they need when the
+//                  region is loaded at image_address.
+//   relocations    Every pointer in the region (lvm_gc_image_reloc_t)
+//   envs           lvm_gc_image_env_t, parents before their children
+//   bindings       lvm_gc_image_binding_t of all envs
+//   symbols        Addresses of all symbol atoms
+// 
+// lvm_image_load() asks for a heap at the address of the saving heap. There
+// it carves out the image region and maps the file over it (MAP_PRIVATE, the
+// kernel only reads the pages we touch). If the region ends up at
+// image_address and nil, true and false where they were when the image was
+// saved, no atom needs a fix-up. Otherwise the relocations are applied. Envs
+// are malloc()ed, so they're always rebuilt from their bindings and lambdas
+// are patched to point to them. Builtins and syntax need a fix-up if the code
+// was loaded somewhere else (ASLR).
+// 
+// The image region belongs to the tenured space: Its atoms are never moved or
+// freed (not even by major collections) but can be changed to point to new
+// atoms.
+//
+
+#define LVM_GC_IMAGE_MAGIC          "lvmimg1"
+#define LVM_GC_IMAGE_REGION_OFFSET  LVM_GC_64K
+
+typedef enum {
+	// A pointer to an atom or data in the region or to nil, true or false
+	LVM_GC_IMAGE_RELOC_PTR,
+	// A reference in a pair, compressed with LVM_COMPRESSED_REFS
+	LVM_GC_IMAGE_RELOC_REF,
+	// The function of a builtin or syntax
+	LVM_GC_IMAGE_RELOC_FUNC,
+	// The env of a lambda, the slot holds the index of the env in the image
+	LVM_GC_IMAGE_RELOC_ENV
+} lvm_gc_image_reloc_kind_t;
+
+typedef struct {
+	uint32_t offset, kind;
+} lvm_gc_image_reloc_t;
+
+typedef struct {
+	int64_t parent;
+	uint64_t first_binding, binding_count;
+} lvm_gc_image_env_t;
+
+typedef struct {
+	// key_offset is relative to data_start
+	uint64_t key_offset, value;
+} lvm_gc_image_binding_t;
+
+typedef struct {
+	char magic[8];
+	// Images only fit an interpreter with the same atom layout
+	uint32_t atom_size, reserved;
+	uint64_t heap_base, image_address, region_size, data_start;
+	uint64_t nil_atom, true_atom, false_atom;
+	// Address of lvm_image_save() and the distance to lvm_eval(). The
+	// distance has to match, otherwise it's a different build.
+	uint64_t code_anchor, code_check;
+	uint64_t relocs_length, envs_length, bindings_length, symbols_length;
+	uint64_t base_env;
+} lvm_gc_image_header_t;
+
+SH_GEN_DECL(lvm_gc_image_table, void*, size_t);
+SH_GEN_HASH_DEF(lvm_gc_image_table, void*, size_t);
+
+typedef struct {
+	lvm_p lvm;
+	uint64_t image_address;
+	const char* error;
+	
+	// Offset of each copied atom in the region and index plus one of each env
+	lvm_gc_image_table_t atom_offsets, env_indices;
+	lvm_atom_p* queue;
+	size_t queue_length, queue_capacity, queue_next;
+	
+	char* atoms;
+	size_t atoms_length, atoms_capacity;
+	char* data;
+	size_t data_length, data_capacity;
+	// Region offsets of slots pointing into the data, their value is the
+	// offset of the data until the final layout is known
+	uint32_t* data_slots;
+	size_t data_slots_length, data_slots_capacity;
+	
+	lvm_gc_image_reloc_t* relocs;
+	size_t relocs_length, relocs_capacity;
+	lvm_gc_image_env_t* envs;
+	size_t envs_length, envs_capacity;
+	lvm_gc_image_binding_t* bindings;
+	size_t bindings_length, bindings_capacity;
+	uint64_t* symbols;
+	size_t symbols_length, symbols_capacity;
+} lvm_gc_image_writer_t, *lvm_gc_image_writer_p;
+
+// Makes room for one more element
+static void* lvm_gc_image_grow(void* ptr, size_t length, size_t* capacity, size_t needed, size_t element_size) {
+	if (length + needed > *capacity) {
+		*capacity = (*capacity + needed + 1) * 2;
+		ptr = realloc(ptr, *capacity * element_size);
+	}
+	return ptr;
+}
+
+static void lvm_gc_image_add_reloc(lvm_gc_image_writer_p w, size_t offset, lvm_gc_image_reloc_kind_t kind) {
+	w->relocs = lvm_gc_image_grow(w->relocs, w->relocs_length, &w->relocs_capacity, 1, sizeof(w->relocs[0]));
+	w->relocs[w->relocs_length++] = (lvm_gc_image_reloc_t){ .offset = offset, .kind = kind };
+}
+
+static size_t lvm_gc_image_add_data(lvm_gc_image_writer_p w, const void* ptr, size_t size) {
+	size_t aligned_size = LVM_GC_ALIGN(size);
+	w->data = lvm_gc_image_grow(w->data, w->data_length, &w->data_capacity, aligned_size, 1);
+	memcpy(w->data + w->data_length, ptr, size);
+	memset(w->data + w->data_length + size, 0, aligned_size - size);
+	w->data_length += aligned_size;
+	return w->data_length - aligned_size;
+}
+
+/**
+ * Returns the address an atom will have in the image. Atoms seen for the first
+ * time get their place in the region and are queued to be copied. nil, true
+ * and false aren't copied, the loader maps them to its own.
+ */
+static uint64_t lvm_gc_image_atom_address(lvm_gc_image_writer_p w, lvm_atom_p atom) {
+	if (atom == w->lvm->nil_atom || atom == w->lvm->true_atom || atom == w->lvm->false_atom)
+		return (uintptr_t)atom;
+	
+	size_t offset = lvm_gc_image_table_get(&w->atom_offsets, atom, 0);
+	if (offset == 0) {
+		lvm_atom_type_t type = lvm_atom_type(atom);
+		switch (type) {
+			case LVM_T_WEAK:
+				w->error = "weak references can't be saved";
+				return 0;
+			case LVM_T_WEAK_TABLE:
+				w->error = "weak tables can't be saved";
+				return 0;
+			case LVM_T_ENV:
+				w->error = "env atoms can't be saved, envs are saved with the lambdas and bindings that use them";
+				return 0;
+			case LVM_T_FORWARD_PTR:
+				// Forward pointers only exist during a collection
+				fprintf(stderr, "lvm_image_save(): found forward pointer %p, the heap is corrupt!\n", (void*)atom);
+				abort();
+			default:
+				break;
+		}
+		
+		size_t size = lvm_gc_atom_infos[type].size;
+		w->atoms = lvm_gc_image_grow(w->atoms, w->atoms_length, &w->atoms_capacity, size, 1);
+		offset = w->atoms_length;
+		w->atoms_length += size;
+		lvm_gc_image_table_put(&w->atom_offsets, atom, offset);
+		
+		w->queue = lvm_gc_image_grow(w->queue, w->queue_length, &w->queue_capacity, 1, sizeof(w->queue[0]));
+		w->queue[w->queue_length++] = atom;
+	}
+	
+	return w->image_address + offset;
+}
+
+// Records an env (and its parents) with its bindings, returns its index
+static size_t lvm_gc_image_env_index(lvm_gc_image_writer_p w, lvm_env_p env) {
+	size_t index_plus_one = lvm_gc_image_table_get(&w->env_indices, env, 0);
+	if (index_plus_one != 0)
+		return index_plus_one - 1;
+	
+	int64_t parent = (env->parent != NULL) ? (int64_t)lvm_gc_image_env_index(w, env->parent) : -1;
+	w->envs = lvm_gc_image_grow(w->envs, w->envs_length, &w->envs_capacity, 1, sizeof(w->envs[0]));
+	size_t index = w->envs_length++;
+	w->envs[index] = (lvm_gc_image_env_t){ .parent = parent, .first_binding = w->bindings_length, .binding_count = 0 };
+	lvm_gc_image_table_put(&w->env_indices, env, index + 1);
+	
+	for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it)) {
+		w->bindings = lvm_gc_image_grow(w->bindings, w->bindings_length, &w->bindings_capacity, 1, sizeof(w->bindings[0]));
+		w->bindings[w->bindings_length++] = (lvm_gc_image_binding_t){
+			.key_offset = lvm_gc_image_add_data(w, it->key, strlen(it->key) + 1),
+			.value = lvm_gc_image_atom_address(w, it->value)
+		};
+		w->envs[index].binding_count++;
+	}
+	
+	return index;
+}
+
+// Copies a queued atom into the region and records the relocations of its
+// pointers
+static void lvm_gc_image_copy_atom(lvm_gc_image_writer_p w, lvm_atom_p atom) {
+	lvm_atom_type_t type = lvm_atom_type(atom);
+	size_t offset = lvm_gc_image_table_get(&w->atom_offsets, atom, 0);
+	lvm_atom_p copy = (lvm_atom_p)(w->atoms + offset);
+	memcpy(copy, atom, lvm_gc_atom_infos[type].size);
+	// Sites are numbered per interpreter
+	copy->alloc_site = 0;
+	copy->call_site = 0;
+	
+	switch(type) {
+		case LVM_T_SYM:
+		case LVM_T_STR:
+		case LVM_T_ERROR: {
+			void* data_ptr = NULL;
+			size_t data_size = lvm_gc_atom_infos[type].get_data(w->lvm, atom, &data_ptr);
+			w->data_slots = lvm_gc_image_grow(w->data_slots, w->data_slots_length, &w->data_slots_capacity, 1, sizeof(w->data_slots[0]));
+			w->data_slots[w->data_slots_length++] = offset + offsetof(struct lvm_atom_s, str);
+			*(uint64_t*)&copy->str = lvm_gc_image_add_data(w, data_ptr, data_size);
+			lvm_gc_image_add_reloc(w, offset + offsetof(struct lvm_atom_s, str), LVM_GC_IMAGE_RELOC_PTR);
+			} break;
+		case LVM_T_PAIR: {
+			uint64_t first = lvm_gc_image_atom_address(w, lvm_pair_first(atom));
+			uint64_t rest = lvm_gc_image_atom_address(w, lvm_pair_rest(atom));
+			// atom_address() might have moved the buffer
+			copy = (lvm_atom_p)(w->atoms + offset);
+			lvm_pair_set_first(copy, (lvm_atom_p)(uintptr_t)first);
+			lvm_pair_set_rest(copy, (lvm_atom_p)(uintptr_t)rest);
+			lvm_gc_image_add_reloc(w, offset + offsetof(struct lvm_atom_s, first), LVM_GC_IMAGE_RELOC_REF);
+			lvm_gc_image_add_reloc(w, offset + offsetof(struct lvm_atom_s, rest), LVM_GC_IMAGE_RELOC_REF);
+			} break;
+		case LVM_T_LAMBDA: {
+			uint64_t args = lvm_gc_image_atom_address(w, atom->args);
+			uint64_t body = lvm_gc_image_atom_address(w, atom->body);
+			uint64_t env = lvm_gc_image_env_index(w, atom->env);
+			copy = (lvm_atom_p)(w->atoms + offset);
+			*(uint64_t*)&copy->args = args;
+			*(uint64_t*)&copy->body = body;
+			*(uint64_t*)&copy->env = env;
+			lvm_gc_image_add_reloc(w, offset + offsetof(struct lvm_atom_s, args), LVM_GC_IMAGE_RELOC_PTR);
+			lvm_gc_image_add_reloc(w, offset + offsetof(struct lvm_atom_s, body), LVM_GC_IMAGE_RELOC_PTR);
+			lvm_gc_image_add_reloc(w, offset + offsetof(struct lvm_atom_s, env), LVM_GC_IMAGE_RELOC_ENV);
+			} break;
+		case LVM_T_BUILTIN:
+		case LVM_T_SYNTAX:
+			lvm_gc_image_add_reloc(w, offset + offsetof(struct lvm_atom_s, builtin), LVM_GC_IMAGE_RELOC_FUNC);
+			break;
+		default:
+			break;
+	}
+}
 
-void* lvm_gc_alloc_data_from_space(lvm_gc_space_p space, size_t data_size, bool* added_new_region) {
-	lvm_gc_ensure_free_bytes_in_space(space, data_size, added_new_region);
+static void lvm_gc_image_writer_destroy(lvm_gc_image_writer_p w) {
+	lvm_gc_image_table_destroy(&w->atom_offsets);
+	lvm_gc_image_table_destroy(&w->env_indices);
+	free(w->queue);
+	free(w->atoms);
+	free(w->data);
+	free(w->data_slots);
+	free(w->relocs);
+	free(w->envs);
+	free(w->bindings);
+	free(w->symbols);
+}
+
+bool lvm_image_save(lvm_p lvm, const char* path) {
+#	ifdef LVM_BIBOP
+	fprintf(stderr, "lvm_image_save(): images don't support BiBoP pages\n");
+	return false;
+#	endif
+	
+	// The image is laid out for a heap at the same address as ours. There
+	// lvm_image_load() gets the chunks right after the first uncollected region.
+	size_t first_region_size = (size_t)lvm->gc.uncollected.first->size_in_64k_chunks * LVM_GC_64K;
+	lvm_gc_image_writer_t w = {
+		.lvm = lvm,
+		.image_address = (uintptr_t)lvm->gc.uncollected.first + (first_region_size + (LVM_GC_REGION_ALIGNMENT - 1)) / LVM_GC_REGION_ALIGNMENT * LVM_GC_REGION_ALIGNMENT
+	};
+	lvm_gc_image_table_new(&w.atom_offsets);
+	lvm_gc_image_table_new(&w.env_indices);
+	w.atoms = lvm_gc_image_grow(NULL, 0, &w.atoms_capacity, sizeof(lvm_gc_region_t), 1);
+	w.atoms_length = sizeof(lvm_gc_region_t);
+	
+	size_t base_env = lvm_gc_image_env_index(&w, lvm->base_env);
+	for(lvm_dict_it_p it = lvm_dict_start(&lvm->symbol_table); it != NULL; it = lvm_dict_next(&lvm->symbol_table, it)) {
+		w.symbols = lvm_gc_image_grow(w.symbols, w.symbols_length, &w.symbols_capacity, 1, sizeof(w.symbols[0]));
+		w.symbols[w.symbols_length++] = lvm_gc_image_atom_address(&w, it->value);
+	}
+	while (w.queue_next < w.queue_length && w.error == NULL)
+		lvm_gc_image_copy_atom(&w, w.queue[w.queue_next++]);
+	
+	if (w.error != NULL) {
+		fprintf(stderr, "lvm_image_save(): %s\n", w.error);
+		lvm_gc_image_writer_destroy(&w);
+		return false;
+	}
+	
+	// Atoms at the start of the region, data at its end, free space between
+	// them as in any other region
+	size_t region_size = (w.atoms_length + w.data_length + (LVM_GC_64K - 1)) / LVM_GC_64K * LVM_GC_64K;
+	size_t data_start = region_size - w.data_length;
+	char* region = calloc(region_size, 1);
+	memcpy(region, w.atoms, w.atoms_length);
+	memcpy(region + data_start, w.data, w.data_length);
+	for(size_t i = 0; i < w.data_slots_length; i++)
+		*(uint64_t*)(region + w.data_slots[i]) += w.image_address + data_start;
+	*(lvm_gc_region_p)region = (lvm_gc_region_t){
+		.atom_type = LVM_T_MAX,
+		.size_in_64k_chunks = region_size / LVM_GC_64K,
+		.flags = LVM_GC_DONT_MOVE,
+		.free_offset = w.atoms_length,
+		.free_bytes = data_start - w.atoms_length
+	};
+	
+	lvm_gc_image_header_t header = {
+		.magic = LVM_GC_IMAGE_MAGIC,
+		.atom_size = sizeof(struct lvm_atom_s),
+		.heap_base = (uintptr_t)lvm->gc.heap.base,
+		.image_address = w.image_address,
+		.region_size = region_size,
+		.data_start = data_start,
+		.nil_atom = (uintptr_t)lvm->nil_atom,
+		.true_atom = (uintptr_t)lvm->true_atom,
+		.false_atom = (uintptr_t)lvm->false_atom,
+		.code_anchor = (uintptr_t)lvm_image_save,
+		.code_check = (uintptr_t)lvm_eval - (uintptr_t)lvm_image_save,
+		.relocs_length = w.relocs_length,
+		.envs_length = w.envs_length,
+		.bindings_length = w.bindings_length,
+		.symbols_length = w.symbols_length,
+		.base_env = base_env
+	};
+	
+	bool written = false;
+	FILE* file = fopen(path, "wb");
+	if (file != NULL) {
+		written = fwrite(&header, sizeof(header), 1, file) == 1
+			&& fseek(file, LVM_GC_IMAGE_REGION_OFFSET, SEEK_SET) == 0
+			&& fwrite(region, region_size, 1, file) == 1
+			&& fwrite(w.relocs, sizeof(w.relocs[0]), w.relocs_length, file) == w.relocs_length
+			&& fwrite(w.envs, sizeof(w.envs[0]), w.envs_length, file) == w.envs_length
+			&& fwrite(w.bindings, sizeof(w.bindings[0]), w.bindings_length, file) == w.bindings_length
+			&& fwrite(w.symbols, sizeof(w.symbols[0]), w.symbols_length, file) == w.symbols_length;
+		written = (fclose(file) == 0) && written;
+	}
+	if (!written)
+		fprintf(stderr, "lvm_image_save(): can't write %s: %s\n", path, strerror(errno));
+	
+	free(region);
+	lvm_gc_image_writer_destroy(&w);
+	return written;
+}
+
+typedef struct {
+	lvm_p lvm;
+	lvm_gc_image_header_t* header;
+	void* region;
+} lvm_gc_image_loader_t, *lvm_gc_image_loader_p;
+
+// Maps an address of the saved heap to our heap, NULL if it doesn't point into
+// the image or to nil, true or false
+static void* lvm_gc_image_relocate(lvm_gc_image_loader_p l, uint64_t address) {
+	if (address - l->header->image_address < l->header->region_size)
+		return (char*)l->region + (address - l->header->image_address);
+	if (address == l->header->nil_atom)
+		return l->lvm->nil_atom;
+	if (address == l->header->true_atom)
+		return l->lvm->true_atom;
+	if (address == l->header->false_atom)
+		return l->lvm->false_atom;
+	return NULL;
+}
+
+lvm_p lvm_image_load(const char* path, lvm_options_p options) {
+#	ifdef LVM_BIBOP
+	fprintf(stderr, "lvm_image_load(): images don't support BiBoP pages\n");
+	return NULL;
+#	endif
+	
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "lvm_image_load(): can't open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	
+	lvm_gc_image_header_t header;
+	if ( pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, LVM_GC_IMAGE_MAGIC, sizeof(header.magic)) != 0 ) {
+		fprintf(stderr, "lvm_image_load(): %s is not an image\n", path);
+		close(fd);
+		return NULL;
+	}
+	if ( header.atom_size != sizeof(struct lvm_atom_s) || header.code_check != (uintptr_t)lvm_eval - (uintptr_t)lvm_image_save ) {
+		fprintf(stderr, "lvm_image_load(): %s was saved by a different build\n", path);
+		close(fd);
+		return NULL;
+	}
+	
+	size_t metadata_size = header.relocs_length * sizeof(lvm_gc_image_reloc_t) + header.envs_length * sizeof(lvm_gc_image_env_t)
+		+ header.bindings_length * sizeof(lvm_gc_image_binding_t) + header.symbols_length * sizeof(uint64_t);
+	char* metadata = malloc(metadata_size);
+	if ( pread(fd, metadata, metadata_size, LVM_GC_IMAGE_REGION_OFFSET + header.region_size) != (ssize_t)metadata_size ) {
+		fprintf(stderr, "lvm_image_load(): %s is truncated\n", path);
+		free(metadata);
+		close(fd);
+		return NULL;
+	}
+	lvm_gc_image_reloc_t* relocs = (void*)metadata;
+	lvm_gc_image_env_t* envs = (void*)(relocs + header.relocs_length);
+	lvm_gc_image_binding_t* bindings = (void*)(envs + header.envs_length);
+	uint64_t* symbols = (void*)(bindings + header.bindings_length);
+	
+	// Try to get the heap where it was when the image was saved
+	lvm_options_t heap_options = (options != NULL) ? *options : (lvm_options_t){ 0 };
+	if (heap_options.gc_heap_address == NULL)
+		heap_options.gc_heap_address = (void*)(uintptr_t)header.heap_base;
+	lvm_p lvm = lvm_gc_init(&heap_options);
+	lvm_mem_init(lvm);
+	
+	lvm_gc_region_p region = lvm_gc_allocate_region(&lvm->gc.heap, header.region_size, LVM_GC_DONT_MOVE | LVM_GC_KEEP_TENURED);
+	if (region == NULL) {
+		fprintf(stderr, "lvm_image_load(): no room for the %zu MiByte image region in the GC heap\n", (size_t)header.region_size / (1024*1024));
+		free(metadata);
+		close(fd);
+		lvm_mem_free(lvm);
+		lvm_gc_cleanup(lvm);
+		return NULL;
+	}
+	if ( mmap(region, header.region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, LVM_GC_IMAGE_REGION_OFFSET) == MAP_FAILED ) {
+		fprintf(stderr, "lvm_image_load(): can't map %s: %s\n", path, strerror(errno));
+		free(metadata);
+		close(fd);
+		lvm_mem_free(lvm);
+		lvm_gc_cleanup(lvm);
+		return NULL;
+	}
+	close(fd);
+	// Prepended so pretenured allocations don't go into the rest of the region
+	lvm_gc_prepend_region_to_space(&lvm->gc.tenured_space, region);
+	
+	lvm_gc_image_loader_t loader = { .lvm = lvm, .header = &header, .region = region };
+	bool relocate = (uintptr_t)region != header.image_address || (uintptr_t)lvm->nil_atom != header.nil_atom
+		|| (uintptr_t)lvm->true_atom != header.true_atom || (uintptr_t)lvm->false_atom != header.false_atom;
+	uintptr_t code_delta = (uintptr_t)lvm_image_save - header.code_anchor;
+	
+	lvm_env_p* loaded_envs = malloc(header.envs_length * sizeof(loaded_envs[0]));
+	for(size_t i = 0; i < header.envs_length; i++) {
+		lvm_env_p env = lvm_env_new(lvm, (envs[i].parent >= 0) ? loaded_envs[envs[i].parent] : NULL);
+		for(size_t j = envs[i].first_binding; j < envs[i].first_binding + envs[i].binding_count; j++)
+			lvm_env_put(lvm, env, (char*)region + header.data_start + bindings[j].key_offset, lvm_gc_image_relocate(&loader, bindings[j].value));
+		loaded_envs[i] = env;
+	}
+	
+	for(size_t i = 0; i < header.relocs_length; i++) {
+		void* slot = (char*)region + relocs[i].offset;
+		switch(relocs[i].kind) {
+			case LVM_GC_IMAGE_RELOC_PTR:
+				if (relocate)
+					*(void**)slot = lvm_gc_image_relocate(&loader, *(uint64_t*)slot);
+				break;
+			case LVM_GC_IMAGE_RELOC_REF:
+				if (relocate) {
+					// Decompress relative to where the slot was in the saved heap
+					lvm_atom_p saved = lvm_decompress_ref((void*)(uintptr_t)(header.image_address + relocs[i].offset), *(lvm_ref_t*)slot);
+					*(lvm_ref_t*)slot = lvm_compress_ref(lvm_gc_image_relocate(&loader, (uintptr_t)saved));
+				}
+				break;
+			case LVM_GC_IMAGE_RELOC_FUNC:
+				if (code_delta != 0)
+					*(uintptr_t*)slot += code_delta;
+				break;
+			case LVM_GC_IMAGE_RELOC_ENV:
+				*(lvm_env_p*)slot = loaded_envs[*(uint64_t*)slot];
+				break;
+		}
+	}
+	
+	for(size_t i = 0; i < header.symbols_length; i++) {
+		lvm_atom_p symbol = lvm_gc_image_relocate(&loader, symbols[i]);
+		lvm_dict_put(&lvm->symbol_table, symbol->str, symbol);
+	}
+	
+	lvm->base_env = loaded_envs[header.base_env];
+	free(loaded_envs);
+	free(metadata);
+	return lvm;
+}
+
+
+//
+// Pinning
+//
+// Pinned atoms keep their address until they're unpinned. The copying
+// collector flags the regions holding pinned atoms (or their data) with
+// LVM_GC_DONT_MOVE and keeps them as a whole instead of handing them back to
+// the pool. All other live atoms in such a region are copied out as usual, the
+// leftovers are garbage until the last pin in the region is gone.
+//
+
+void lvm_pin(lvm_p lvm, lvm_atom_p atom) {
+	if (lvm->gc.pinned_length >= lvm->gc.pinned_capacity) {
+		lvm->gc.pinned_capacity = (lvm->gc.pinned_capacity + 1) * 2;
+		lvm->gc.pinned_ptr = realloc(lvm->gc.pinned_ptr, lvm->gc.pinned_capacity * sizeof(lvm->gc.pinned_ptr[0]));
+	}
+	lvm->gc.pinned_ptr[lvm->gc.pinned_length++] = atom;
+}
+
+void lvm_unpin(lvm_p lvm, lvm_atom_p atom) {
+	for(size_t i = 0; i < lvm->gc.pinned_length; i++) {
+		if (lvm->gc.pinned_ptr[i] == atom) {
+			lvm->gc.pinned_ptr[i] = lvm->gc.pinned_ptr[--lvm->gc.pinned_length];
+			return;
+		}
+	}
+	
+	fprintf(stderr, "trying to unpin an atom that isn't pinned!\n");
+	abort();
+}
+
+/**
+ * Called right after the spaces were swapped. Flags the regions of the old
+ * space that contain pinned atoms or their data and collects the pinned atoms
+ * as roots. Pins is initialized when there are pinned atoms and used by
+ * lvm_gc_collect_atom() to leave them in place.
+ */
+void lvm_gc_collect_pinned_atoms(lvm_p lvm, lvm_gc_atom_set_t* pins) {
+	// Regions are only flagged as long as they contain pinned atoms
+	for(lvm_gc_region_p r = lvm->gc.old_space.first; r != NULL; r = r->next)
+		r->flags &= ~LVM_GC_DONT_MOVE;
+	
+	if (lvm->gc.pinned_length == 0)
+		return;
+	
+	lvm_gc_atom_set_new(pins);
+	for(size_t i = 0; i < lvm->gc.pinned_length; i++) {
+		lvm_atom_p atom = lvm->gc.pinned_ptr[i];
+		lvm_gc_region_p region = lvm_gc_find_region_of_space(lvm, &lvm->gc.old_space, atom);
+		// Pinned atoms in other spaces never move anyway
+		if (region == NULL)
+			continue;
+		region->flags |= LVM_GC_DONT_MOVE;
+		lvm_gc_atom_set_put(pins, atom, false);
+		
+		void* data_ptr = NULL;
+		if ( lvm_gc_atom_infos[lvm_atom_type(atom)].get_data != NULL && lvm_gc_atom_infos[lvm_atom_type(atom)].get_data(lvm, atom, &data_ptr) > 0 ) {
+			lvm_gc_region_p data_region = lvm_gc_find_region_of_space(lvm, &lvm->gc.old_space, data_ptr);
+			if (data_region != NULL)
+				data_region->flags |= LVM_GC_DONT_MOVE;
+		}
+	}
+	
+	lvm->gc.collection->pins = pins;
+	for(size_t i = 0; i < lvm->gc.pinned_length; i++) {
+		lvm_atom_p atom = lvm->gc.pinned_ptr[i];
+		lvm_gc_collect_atom(lvm, &atom);
+	}
+}
+
+/**
+ * Moves the flagged regions from the old space to the start of the new space.
+ * New atoms are still allocated from the last region of the new space.
+ */
+void lvm_gc_keep_pinned_regions(lvm_p lvm, lvm_gc_atom_set_t* pins) {
+	if (lvm->gc.pinned_length == 0)
+		return;
+	lvm->gc.collection->pins = NULL;
+	lvm_gc_atom_set_destroy(pins);
+	
+	lvm_gc_space_p old_space = &lvm->gc.old_space, new_space = &lvm->gc.new_space;
+	lvm_gc_region_p prev = NULL, next = NULL;
+	for(lvm_gc_region_p r = old_space->first; r != NULL; r = next) {
+		next = r->next;
+		if ( !(r->flags & LVM_GC_DONT_MOVE) ) {
+			prev = r;
+			continue;
+		}
+		
+		if (prev != NULL)
+			prev->next = next;
+		else
+			old_space->first = next;
+		if (old_space->last == r)
+			old_space->last = prev;
+		
+		// Only a normal region can become the one we allocate from, not a
+		// page or an oversized region
+		lvm_gc_prepend_region_to_space(new_space, r);
+		if ( new_space->last == NULL && r->atom_type == LVM_T_MAX && r->size_in_64k_chunks * LVM_GC_64K == lvm->gc.region_size )
+			new_space->last = r;
+	}
+}
+
+
+//
+// Weak references and weak tables
+//
+// During the trace the child collectors of weak atoms only record them in the
+// current weak list instead of collecting their references. Once everything
+// strongly reachable was collected lvm_gc_process_weak_atoms() keeps the values
+// of weak tables whose keys were reached and clears the references to
+// everything else. Outside of a trace (when patching pointers or walking the
+// heap) the references are handled like normal ones.
+//
+
+static void lvm_gc_record_weak_atom(lvm_gc_weak_list_p list, lvm_atom_p atom) {
+	if (list->length >= list->capacity) {
+		list->capacity = (list->capacity + 1) * 2;
+		list->atoms = realloc(list->atoms, list->capacity * sizeof(list->atoms[0]));
+	}
+	list->atoms[list->length++] = atom;
+}
+
+void lvm_gc_weak_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child) {
+	if (lvm->gc.collection != NULL && lvm->gc.collection->weak_list != NULL)
+		lvm_gc_record_weak_atom(lvm->gc.collection->weak_list, atom);
+	else
+		collect_child(lvm, &atom->target);
+}
+
+void lvm_gc_weak_table_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child) {
+	if (lvm->gc.collection != NULL && lvm->gc.collection->weak_list != NULL) {
+		lvm_gc_record_weak_atom(lvm->gc.collection->weak_list, atom);
+		return;
+	}
+	
+	// Keys that moved (e.g. when mark-compact patches pointers) are in the
+	// wrong slot now
+	for(uint32_t i = 0; i < atom->capacity; i++) {
+		lvm_atom_p key = atom->entries[i].key;
+		if (key == NULL)
+			continue;
+		collect_child(lvm, &atom->entries[i].key);
+		collect_child(lvm, &atom->entries[i].value);
+		if (atom->entries[i].key != key)
+			atom->needs_rehash = true;
+	}
+}
+
+static void lvm_gc_ready_ephemeron(lvm_gc_ephemerons_p ephemerons, lvm_ephemeron_p entry) {
+	if (ephemerons->ready_length >= ephemerons->ready_capacity) {
+		ephemerons->ready_capacity = (ephemerons->ready_capacity + 1) * 2;
+		ephemerons->ready_ptr = realloc(ephemerons->ready_ptr, ephemerons->ready_capacity * sizeof(ephemerons->ready_ptr[0]));
+	}
+	ephemerons->ready_ptr[ephemerons->ready_length++] = entry;
+}
+
+// Called by the collectors for every atom they reach for the first time during
+// the ephemeron fixpoint. The ephemerons waiting for that atom are ready now.
+static void lvm_gc_reached_key(lvm_p lvm, lvm_atom_p key) {
+	lvm_gc_ephemerons_p ephemerons = lvm->gc.collection->ephemerons;
+	size_t* first = lvm_gc_ephemeron_keys_get_ptr(&ephemerons->keys, key);
+	if (first == NULL)
+		return;
+	
+	for(size_t i = *first; i != SIZE_MAX; i = ephemerons->waiting_ptr[i].next)
+		lvm_gc_ready_ephemeron(ephemerons, ephemerons->waiting_ptr[i].entry);
+	lvm_gc_ephemeron_keys_del(&ephemerons->keys, key);
+}
+
+static void lvm_gc_wait_for_key(lvm_gc_ephemerons_p ephemerons, lvm_ephemeron_p entry) {
+	if (ephemerons->waiting_length >= ephemerons->waiting_capacity) {
+		ephemerons->waiting_capacity = (ephemerons->waiting_capacity + 1) * 2;
+		ephemerons->waiting_ptr = realloc(ephemerons->waiting_ptr, ephemerons->waiting_capacity * sizeof(ephemerons->waiting_ptr[0]));
+	}
+	
+	size_t next = lvm_gc_ephemeron_keys_get(&ephemerons->keys, entry->key, SIZE_MAX);
+	ephemerons->waiting_ptr[ephemerons->waiting_length] = (lvm_gc_waiting_ephemeron_t){ entry, next };
+	lvm_gc_ephemeron_keys_put(&ephemerons->keys, entry->key, ephemerons->waiting_length++);
+}
+
+/**
+ * Called after the trace with the recorded weak atoms. is_reached tells if the
+ * trace reached an atom (and may patch the pointer to its new location), keep
+ * traces an atom that has to survive.
+ * 
+ * Keeping values can reach more keys (and record more weak tables). Instead of
+ * going over all tables until nothing changes, ephemerons whose key wasn't
+ * reached wait for it. The collectors report the atoms they reach while we
+ * keep values, so every ephemeron is looked at once when its table is seen
+ * and once more when its key is reached.
+ */
+void lvm_gc_process_weak_atoms(lvm_p lvm, lvm_gc_weak_list_p list, lvm_gc_is_reached_t is_reached, lvm_gc_collect_child_t keep) {
+	lvm_gc_collection_p collection = lvm->gc.collection;
+	lvm_gc_weak_list_p prev_list = collection->weak_list;
+	collection->weak_list = list;
+	lvm_gc_ephemerons_t ephemerons = { 0 };
+	lvm_gc_ephemeron_keys_new(&ephemerons.keys);
+	collection->ephemerons = &ephemerons;
+	
+	size_t scanned_atoms = 0;
+	while (true) {
+		// Tables recorded since the last time, at first all of them
+		for(; scanned_atoms < list->length; scanned_atoms++) {
+			lvm_atom_p table = list->atoms[scanned_atoms];
+			if (lvm_atom_type(table) != LVM_T_WEAK_TABLE)
+				continue;
+			
+			for(uint32_t j = 0; j < table->capacity; j++) {
+				lvm_ephemeron_p entry = &table->entries[j];
+				lvm_atom_p key = entry->key;
+				if (key == NULL)
+					continue;
+				if ( is_reached(lvm, &entry->key) ) {
+					if (entry->key != key)
+						table->needs_rehash = true;
+					lvm_gc_ready_ephemeron(&ephemerons, entry);
+				} else {
+					lvm_gc_wait_for_key(&ephemerons, entry);
+				}
+			}
+		}
+		
+		if (ephemerons.ready_length == 0)
+			break;
+		lvm_ephemeron_p entry = ephemerons.ready_ptr[--ephemerons.ready_length];
+		if ( !is_reached(lvm, &entry->value) )
+			keep(lvm, &entry->value);
+	}
+	
+	collection->ephemerons = NULL;
+	lvm_gc_ephemeron_keys_destroy(&ephemerons.keys);
+	free(ephemerons.waiting_ptr);
+	free(ephemerons.ready_ptr);
+	collection->weak_list = prev_list;
+	
+	for(size_t i = 0; i < list->length; i++) {
+		lvm_atom_p atom = list->atoms[i];
+		if (lvm_atom_type(atom) == LVM_T_WEAK) {
+			if ( !is_reached(lvm, &atom->target) ) {
+				atom->target = lvm->nil_atom;
+				lvm->gc.stats.weak_refs_cleared++;
+			}
+		} else {
+			// Moved keys and cleared entries both break the probing of the
+			// table, lvm_weak_table_get() and _put() rehash it on their next
+			// call
+			for(uint32_t j = 0; j < atom->capacity; j++) {
+				lvm_ephemeron_p entry = &atom->entries[j];
+				lvm_atom_p key = entry->key;
+				if (key == NULL)
+					continue;
+				if ( is_reached(lvm, &entry->key) ) {
+					if (entry->key != key)
+						atom->needs_rehash = true;
+					continue;
+				}
+				*entry = (lvm_ephemeron_t){ NULL, NULL };
+				atom->length--;
+				atom->needs_rehash = true;
+				lvm->gc.stats.weak_refs_cleared++;
+			}
+		}
+	}
+}
+
+/**
+ * Tells the weak processing of the copying collector if an atom was reached.
+ * Patches the pointer when the atom was copied.
+ */
+static bool lvm_gc_is_copied(lvm_p lvm, lvm_atom_p* atom) {
+	lvm_atom_p forwarded_atom = lvm_gc_forwarded_atom(*atom, lvm_atom_type(*atom));
+	if (forwarded_atom != NULL) {
+		*atom = forwarded_atom;
+		return true;
+	}
+	
+	// Pinned atoms are the only ones that stay in the old space
+	if ( lvm_gc_space_contains(lvm, &lvm->gc.old_space, *atom) )
+		return lvm->gc.collection->pins != NULL && lvm_gc_atom_set_get(lvm->gc.collection->pins, *atom, false);
+	if ( lvm_gc_find_large_atom_region(lvm, &lvm->gc.old_large_space, *atom) != NULL )
+		return false;
+	if ( lvm_gc_space_contains(lvm, &lvm->gc.old_tenured_space, *atom) )
+		return false;
+	
+	// Everything else never moves (immortal, tenured and reached large atoms)
+	// or is already in the new space
+	return true;
+}
+
+
+//
+// Finalization
+//
+// The finalization table isn't a root. After the trace we walk it once: Atoms
+// that were reached just get their pointer patched, the finalizers of the
+// others are called and their entries removed. The walk only costs as much as
+// there are finalizable atoms. The unreached atoms are still intact at that
+// point since their memory is released after the walk.
+//
+// lvm_finalize() finds the entry of an atom through finalizers_index. The
+// index uses the atom addresses, so it's rebuilt after the walk.
+//
+
+void lvm_finalize(lvm_p lvm, lvm_atom_p atom, lvm_finalizer_t finalizer, void* data) {
+	lvm_gc_p gc = &lvm->gc;
+	size_t* index = lvm_gc_finalizer_index_get_ptr(&gc->finalizers_index, atom);
+	if (index != NULL) {
+		size_t i = *index;
+		if (finalizer != NULL) {
+			gc->finalizers_ptr[i] = (lvm_gc_finalizer_entry_t){ atom, finalizer, data };
+		} else {
+			// Move the last entry into the gap
+			lvm_gc_finalizer_index_del(&gc->finalizers_index, atom);
+			gc->finalizers_ptr[i] = gc->finalizers_ptr[--gc->finalizers_length];
+			if (i < gc->finalizers_length)
+				lvm_gc_finalizer_index_put(&gc->finalizers_index, gc->finalizers_ptr[i].atom, i);
+		}
+		return;
+	}
+	
+	if (finalizer == NULL)
+		return;
+	if (gc->finalizers_length >= gc->finalizers_capacity) {
+		gc->finalizers_capacity = (gc->finalizers_capacity + 1) * 2;
+		gc->finalizers_ptr = realloc(gc->finalizers_ptr, gc->finalizers_capacity * sizeof(gc->finalizers_ptr[0]));
+	}
+	lvm_gc_finalizer_index_put(&gc->finalizers_index, atom, gc->finalizers_length);
+	gc->finalizers_ptr[gc->finalizers_length++] = (lvm_gc_finalizer_entry_t){ atom, finalizer, data };
+}
+
+static void lvm_gc_index_finalizers(lvm_p lvm) {
+	lvm_gc_p gc = &lvm->gc;
+	lvm_gc_finalizer_index_destroy(&gc->finalizers_index);
+	lvm_gc_finalizer_index_new(&gc->finalizers_index);
+	for(size_t i = 0; i < gc->finalizers_length; i++)
+		lvm_gc_finalizer_index_put(&gc->finalizers_index, gc->finalizers_ptr[i].atom, i);
+}
+
+void lvm_gc_run_finalizers(lvm_p lvm, lvm_gc_is_reached_t is_reached) {
+	lvm_gc_p gc = &lvm->gc;
+	for(size_t i = 0; i < gc->finalizers_length; ) {
+		lvm_gc_finalizer_entry_t* entry = &gc->finalizers_ptr[i];
+		if ( is_reached(lvm, &entry->atom) ) {
+			i++;
+			continue;
+		}
+		
+		entry->finalizer(lvm, entry->atom, entry->data);
+		gc->stats.finalized_atoms++;
+		*entry = gc->finalizers_ptr[--gc->finalizers_length];
+	}
+	lvm_gc_index_finalizers(lvm);
+}
+
+
+//
+// Mark-compact collection
+//
+// Compacts the new space in place. Instead of a second half space it only
+// needs a mark bitmap for each region (one bit per 8 bytes of atoms) and a
+// forwarding table for the live atoms. Works in four passes:
+// 
+// 1. Mark all atoms reachable from the roots and remember the data blocks of
+//    the live atoms.
+// 2. Compute the new address of each live atom and data block. Atoms slide to
+//    the start of the region list, data blocks to the ends of the regions.
+// 3. Patch all references (roots and children of live atoms).
+// 4. Move the atoms and data blocks and patch the data pointers.
+// 
+// Items are processed region by region in list order, atoms in ascending and
+// data in descending address order (the order they were allocated in). That
+// way an item never moves over another item that wasn't moved yet.
+//
+
+SH_GEN_DECL(lvm_gc_forward_table, void*, void*);
+SH_GEN_HASH_DEF(lvm_gc_forward_table, void*, void*);
+
+typedef struct {
+	lvm_gc_region_p region;
+	size_t region_size;
+	// Position of the region in the new space, SIZE_MAX for large regions
+	size_t list_index;
+	// One bit per 8 bytes of the atom area at the start of the region
+	uint64_t* mark_bits;
+} lvm_gc_mark_region_t, *lvm_gc_mark_region_p;
+
+typedef struct {
+	void* data_ptr;
+	size_t size;
+	lvm_atom_p atom;
+	size_t list_index;
+	void* new_data_ptr;
+} lvm_gc_data_block_t, *lvm_gc_data_block_p;
+
+typedef struct lvm_gc_mark_compact_s {
+	// Regions of the new and large space sorted by address
+	lvm_gc_mark_region_p regions;
+	size_t regions_length;
+	// Regions of the new space in list order
+	lvm_gc_mark_region_p* list;
+	size_t list_length;
+	
+	lvm_atom_p* stack;
+	size_t stack_length, stack_capacity;
+	lvm_gc_data_block_p data_blocks;
+	size_t data_blocks_length, data_blocks_capacity;
+	
+	// Environments of lambdas, they aren't atoms so we patch their bindings
+	// separately
+	lvm_gc_atom_set_t visited_envs;
+	lvm_env_p* envs;
+	size_t envs_length, envs_capacity;
+	
+	lvm_gc_forward_table_t forward_table;
+} lvm_gc_mark_compact_t, *lvm_gc_mark_compact_p;
+
+static int lvm_gc_compare_mark_regions(const void* a, const void* b) {
+	const lvm_gc_mark_region_t *ra = a, *rb = b;
+	return (ra->region > rb->region) - (ra->region < rb->region);
+}
+
+// Sorts by list index and then by descending address
+static int lvm_gc_compare_data_blocks(const void* a, const void* b) {
+	const lvm_gc_data_block_t *da = a, *db = b;
+	if (da->list_index != db->list_index)
+		return (da->list_index > db->list_index) - (da->list_index < db->list_index);
+	return (da->data_ptr < db->data_ptr) - (da->data_ptr > db->data_ptr);
+}
+
+static lvm_gc_mark_region_p lvm_gc_find_mark_region(lvm_gc_mark_compact_p mc, void* ptr) {
+	size_t low = 0, high = mc->regions_length;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		lvm_gc_mark_region_p r = &mc->regions[middle];
+		if (ptr < (void*)r->region)
+			high = middle;
+		else if (ptr >= (void*)r->region + r->region_size)
+			low = middle + 1;
+		else
+			return r;
+	}
+	
+	return NULL;
+}
+
+static void lvm_gc_add_mark_region(lvm_gc_mark_compact_p mc, lvm_gc_region_p region, size_t list_index) {
+	size_t words = (region->free_offset / 8 + 63) / 64;
+	mc->regions[mc->regions_length++] = (lvm_gc_mark_region_t){
+		.region = region,
+		.region_size = region->size_in_64k_chunks * LVM_GC_64K,
+		.list_index = list_index,
+		.mark_bits = calloc(words, sizeof(uint64_t))
+	};
+}
+
+static void lvm_gc_mark(lvm_p lvm, lvm_gc_mark_compact_p mc, lvm_atom_p atom) {
+	lvm_gc_mark_region_p r = lvm_gc_find_mark_region(mc, atom);
+	// Atoms outside of the new and large space (e.g. nil, symbols) are never collected
+	if (r == NULL)
+		return;
+	
+	size_t bit = ((void*)atom - (void*)r->region) / 8;
+	if ( r->mark_bits[bit / 64] & (1ULL << (bit % 64)) )
+		return;
+	r->mark_bits[bit / 64] |= 1ULL << (bit % 64);
+	if (lvm->gc.collection->ephemerons != NULL)
+		lvm_gc_reached_key(lvm, atom);
+	
+	if (mc->stack_length >= mc->stack_capacity) {
+		mc->stack_capacity = (mc->stack_capacity + 1) * 2;
+		mc->stack = realloc(mc->stack, mc->stack_capacity * sizeof(mc->stack[0]));
+	}
+	mc->stack[mc->stack_length++] = atom;
+}
+
+static void lvm_gc_mark_child(lvm_p lvm, lvm_atom_p* child) {
+	lvm_gc_mark(lvm, lvm->gc.collection->mark_compact, *child);
+}
+
+static void lvm_gc_mark_env(lvm_p lvm, lvm_gc_mark_compact_p mc, lvm_env_p env) {
+	for(; env != NULL; env = env->parent) {
+		if ( lvm_gc_atom_set_contains(&mc->visited_envs, env) )
+			return;
+		lvm_gc_atom_set_put(&mc->visited_envs, env, true);
+		
+		if (mc->envs_length >= mc->envs_capacity) {
+			mc->envs_capacity = (mc->envs_capacity + 1) * 2;
+			mc->envs = realloc(mc->envs, mc->envs_capacity * sizeof(mc->envs[0]));
+		}
+		mc->envs[mc->envs_length++] = env;
+		
+		lvm_atom_p* storage = lvm_gc_dict_storage(lvm, &env->bindings);
+		if (storage != NULL)
+			lvm_gc_mark(lvm, mc, *storage);
+		for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it))
+			lvm_gc_mark(lvm, mc, it->value);
+	}
+}
+
+// Marks the envs of tenured lambdas, see lvm_gc_collection_t
+static void lvm_gc_mark_lambda_env(lvm_p lvm, lvm_env_p env) {
+	lvm_gc_mark_env(lvm, lvm->gc.collection->mark_compact, env);
+}
+
+static void lvm_gc_mark_drain(lvm_p lvm, lvm_gc_mark_compact_p mc) {
+	while (mc->stack_length > 0) {
+		lvm_atom_p atom = mc->stack[--mc->stack_length];
+		lvm_atom_type_t type = lvm_atom_type(atom);
+		size_t atom_size = lvm_gc_atom_infos[type].size;
+		size_t data_size = 0;
+		
+		if (lvm_gc_atom_infos[type].get_data != NULL) {
+			void* data_ptr = NULL;
+			data_size = lvm_gc_atom_infos[type].get_data(lvm, atom, &data_ptr);
+			// Data of large atoms stays in their region, so does data outside of the new space
+			lvm_gc_mark_region_p r = lvm_gc_find_mark_region(mc, data_ptr);
+			if (data_size > 0 && r != NULL && r->list_index != SIZE_MAX) {
+				if (mc->data_blocks_length >= mc->data_blocks_capacity) {
+					mc->data_blocks_capacity = (mc->data_blocks_capacity + 1) * 2;
+					mc->data_blocks = realloc(mc->data_blocks, mc->data_blocks_capacity * sizeof(mc->data_blocks[0]));
+				}
+				mc->data_blocks[mc->data_blocks_length++] = (lvm_gc_data_block_t){
+					.data_ptr = data_ptr,
+					.size = LVM_GC_ALIGN(data_size),
+					.atom = atom,
+					.list_index = r->list_index
+				};
+			}
+		}
+		
+		// Count the first survival for the allocation site of the atom
+		lvm->gc.alloc_sites[atom->alloc_site].survived_bytes += atom_size + LVM_GC_ALIGN(data_size);
+		atom->alloc_site = 0;
+		
+		if (type == LVM_T_LAMBDA) {
+			// Lambda environments aren't atoms (yet), mark their bindings directly
+			lvm_gc_mark(lvm, mc, atom->args);
+			lvm_gc_mark(lvm, mc, atom->body);
+			lvm_gc_mark_env(lvm, mc, atom->env);
+		} else if (lvm_gc_atom_infos[type].child_collector != NULL) {
+			lvm_gc_atom_infos[type].child_collector(lvm, atom, lvm_gc_mark_child);
+		}
+	}
+}
+
+// Weak processing of the mark-compact collector, see lvm_gc_process_weak_atoms()
+static bool lvm_gc_is_marked(lvm_p lvm, lvm_atom_p* atom) {
+	lvm_gc_mark_region_p r = lvm_gc_find_mark_region(lvm->gc.collection->mark_compact, *atom);
+	if (r == NULL)
+		return true;
+	size_t bit = ((void*)*atom - (void*)r->region) / 8;
+	return (r->mark_bits[bit / 64] & (1ULL << (bit % 64))) != 0;
+}
+
+static void lvm_gc_mark_and_drain(lvm_p lvm, lvm_atom_p* atom) {
+	lvm_gc_mark(lvm, lvm->gc.collection->mark_compact, *atom);
+	lvm_gc_mark_drain(lvm, lvm->gc.collection->mark_compact);
+}
+
+static void lvm_gc_forward_child(lvm_p lvm, lvm_atom_p* child) {
+	// Only write if the atom moved, tenured atoms might live in pages we share
+	// with a forked parent (see lvm_gc_tenure())
+	lvm_atom_p forwarded = lvm_gc_forward_table_get(&lvm->gc.collection->mark_compact->forward_table, *child, *child);
+	if (forwarded != *child)
+		*child = forwarded;
+}
+
+/**
+ * Calls func for each marked atom of the region in ascending address order.
+ * The atom type has to be intact when the function is called since we need
+ * it to get the atom size.
+ */
+static void lvm_gc_for_each_marked_atom(lvm_p lvm, lvm_gc_mark_region_p r, void (*func)(lvm_p lvm, lvm_atom_p atom, void* context), void* context) {
+	size_t words = (r->region->free_offset / 8 + 63) / 64;
+	for(size_t w = 0; w < words; w++) {
+		uint64_t bits = r->mark_bits[w];
+		while (bits != 0) {
+			size_t bit = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			func(lvm, (void*)r->region + bit * 8, context);
+		}
+	}
+}
+
+typedef struct {
+	size_t index;
+	lvm_gc_region_p region;
+	uint32_t atom_offset, data_offset;
+	// Resulting free offsets and bytes of each region in list order
+	uint32_t* free_offsets;
+	uint32_t* free_bytes;
+} lvm_gc_compact_cursor_t, *lvm_gc_compact_cursor_p;
+
+static void lvm_gc_compact_cursor_advance(lvm_gc_mark_compact_p mc, lvm_gc_compact_cursor_p cursor) {
+	cursor->free_offsets[cursor->index] = cursor->atom_offset;
+	cursor->free_bytes[cursor->index] = cursor->data_offset - cursor->atom_offset;
+	
+	cursor->index++;
+	cursor->region = mc->list[cursor->index]->region;
+	cursor->atom_offset = sizeof(lvm_gc_region_t);
+	cursor->data_offset = mc->list[cursor->index]->region_size;
+}
+
+static void lvm_gc_compute_atom_forward(lvm_p lvm, lvm_atom_p atom, void* context) {
+	lvm_gc_compact_cursor_p cursor = context;
+	lvm_gc_mark_compact_p mc = lvm->gc.collection->mark_compact;
+	uint32_t atom_size = lvm_gc_atom_infos[lvm_atom_type(atom)].size;
+	
+	while (cursor->atom_offset + atom_size > cursor->data_offset)
+		lvm_gc_compact_cursor_advance(mc, cursor);
+	
+	lvm_atom_p new_atom = (void*)cursor->region + cursor->atom_offset;
+	cursor->atom_offset += atom_size;
+	if (new_atom != atom)
+		lvm_gc_forward_table_put(&mc->forward_table, atom, new_atom);
+}
+
+static void lvm_gc_forward_children(lvm_p lvm, lvm_atom_p atom, void* context) {
+	if (lvm_gc_atom_infos[lvm_atom_type(atom)].child_collector != NULL)
+		lvm_gc_atom_infos[lvm_atom_type(atom)].child_collector(lvm, atom, lvm_gc_forward_child);
+}
+
+static void lvm_gc_move_atom(lvm_p lvm, lvm_atom_p atom, void* context) {
+	lvm_atom_p new_atom = lvm_gc_forward_table_get(&lvm->gc.collection->mark_compact->forward_table, atom, atom);
+	size_t atom_size = lvm_gc_atom_infos[lvm_atom_type(atom)].size;
+	if (new_atom != atom) {
+		memmove(new_atom, atom, atom_size);
+		lvm->gc.stats.bytes_copied += atom_size;
+	}
+}
+
+void lvm_gc_mark_compact(lvm_p lvm, lvm_atom_p* survivers[], lvm_env_p envs[]) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t bytes_copied_before = lvm->gc.stats.bytes_copied;
+	size_t bytes_in_space = lvm_gc_used_bytes_of_space(&lvm->gc.new_space);
+	
+	lvm_gc_mark_compact_t mc = { 0 };
+	lvm_gc_collection_t collection = { .mark_compact = &mc };
+	lvm->gc.collection = &collection;
+	lvm_gc_atom_set_new(&mc.visited_envs);
+	lvm_gc_forward_table_new(&mc.forward_table);
+	
+	size_t new_space_regions = lvm_gc_count_regions_of_space(&lvm->gc.new_space);
+	size_t large_space_regions = lvm_gc_count_regions_of_space(&lvm->gc.large_space);
+	mc.regions = malloc((new_space_regions + large_space_regions) * sizeof(mc.regions[0]));
+	size_t list_index = 0;
+	for(lvm_gc_region_p r = lvm->gc.new_space.first; r != NULL; r = r->next)
+		lvm_gc_add_mark_region(&mc, r, list_index++);
+	for(lvm_gc_region_p r = lvm->gc.large_space.first; r != NULL; r = r->next)
+		lvm_gc_add_mark_region(&mc, r, SIZE_MAX);
+	qsort(mc.regions, mc.regions_length, sizeof(mc.regions[0]), lvm_gc_compare_mark_regions);
+	
+	mc.list = malloc(new_space_regions * sizeof(mc.list[0]));
+	mc.list_length = new_space_regions;
+	for(size_t i = 0; i < mc.regions_length; i++) {
+		if (mc.regions[i].list_index != SIZE_MAX)
+			mc.list[mc.regions[i].list_index] = &mc.regions[i];
+	}
+	
+	// Pass 1: Mark everything reachable from the roots. Weak atoms are
+	// processed once we know all strongly reachable atoms.
+	lvm_gc_weak_list_t weak_list = { 0 };
+	collection.weak_list = &weak_list;
+	for(size_t i = 0; i < lvm->arg_stack_length; i++)
+		lvm_gc_mark(lvm, &mc, lvm->arg_stack_ptr[i]);
+	for(size_t i = 0; i < lvm->handle_stack_length; i++)
+		lvm_gc_mark(lvm, &mc, *lvm->handle_stack_ptr[i]);
+	for(size_t i = 0; survivers[i] != NULL; i++)
+		lvm_gc_mark(lvm, &mc, *survivers[i]);
+	collection.env_collector = lvm_gc_mark_lambda_env;
+	for(size_t i = 0; envs[i] != NULL; i++)
+		lvm_gc_mark_env(lvm, &mc, envs[i]);
+	lvm_atom_p* symbol_slots = lvm_gc_dict_storage(lvm, &lvm->symbol_table);
+	if (symbol_slots != NULL)
+		lvm_gc_mark(lvm, &mc, *symbol_slots);
+	lvm_gc_scan_space(lvm, &lvm->gc.tenured_space, lvm_gc_mark_child);
+	lvm_gc_mark_drain(lvm, &mc);
+	collection.weak_list = NULL;
+	lvm_gc_process_weak_atoms(lvm, &weak_list, lvm_gc_is_marked, lvm_gc_mark_and_drain);
+	free(weak_list.atoms);
+	lvm_gc_run_finalizers(lvm, lvm_gc_is_marked);
+	collection.env_collector = NULL;
+	
+	// Pass 2: Compute new addresses
+	qsort(mc.data_blocks, mc.data_blocks_length, sizeof(mc.data_blocks[0]), lvm_gc_compare_data_blocks);
+	lvm_gc_compact_cursor_t cursor = { 0 };
+	if (mc.list_length > 0) {
+		cursor = (lvm_gc_compact_cursor_t){
+			.index = 0,
+			.region = mc.list[0]->region,
+			.atom_offset = sizeof(lvm_gc_region_t),
+			.data_offset = mc.list[0]->region_size,
+			.free_offsets = malloc(mc.list_length * sizeof(uint32_t)),
+			.free_bytes = malloc(mc.list_length * sizeof(uint32_t))
+		};
+	}
+	
+	size_t block_index = 0;
+	for(size_t i = 0; i < mc.list_length; i++) {
+		lvm_gc_for_each_marked_atom(lvm, mc.list[i], lvm_gc_compute_atom_forward, &cursor);
+		
+		for(; block_index < mc.data_blocks_length && mc.data_blocks[block_index].list_index == i; block_index++) {
+			lvm_gc_data_block_p block = &mc.data_blocks[block_index];
+			// Atoms sharing their data (deduplicated strings) keep sharing it.
+			// Their blocks are next to each other after sorting.
+			if (block_index > 0 && block->data_ptr == block[-1].data_ptr) {
+				block->new_data_ptr = block[-1].new_data_ptr;
+				continue;
+			}
+			while (cursor.data_offset < cursor.atom_offset + block->size)
+				lvm_gc_compact_cursor_advance(&mc, &cursor);
+			cursor.data_offset -= block->size;
+			block->new_data_ptr = (void*)cursor.region + cursor.data_offset;
+		}
+	}
+	
+	// Pass 3: Patch references in the roots and all live atoms
+	for(size_t i = 0; i < lvm->arg_stack_length; i++)
+		lvm_gc_forward_child(lvm, &lvm->arg_stack_ptr[i]);
+	for(size_t i = 0; i < lvm->handle_stack_length; i++)
+		lvm_gc_forward_child(lvm, lvm->handle_stack_ptr[i]);
+	for(size_t i = 0; survivers[i] != NULL; i++)
+		lvm_gc_forward_child(lvm, survivers[i]);
+	for(size_t i = 0; i < mc.envs_length; i++) {
+		for(lvm_dict_it_p it = lvm_dict_start(&mc.envs[i]->bindings); it != NULL; it = lvm_dict_next(&mc.envs[i]->bindings, it))
+			lvm_gc_forward_child(lvm, &it->value);
+	}
+	for(size_t i = 0; i < mc.regions_length; i++)
+		lvm_gc_for_each_marked_atom(lvm, &mc.regions[i], lvm_gc_forward_children, NULL);
+	lvm_gc_scan_space(lvm, &lvm->gc.tenured_space, lvm_gc_forward_child);
+	for(size_t i = 0; i < lvm->gc.finalizers_length; i++)
+		lvm_gc_forward_child(lvm, &lvm->gc.finalizers_ptr[i].atom);
+	lvm_gc_index_finalizers(lvm);
+	
+	// Pass 4: Move atoms and data in the same order we computed the addresses
+	block_index = 0;
+	for(size_t i = 0; i < mc.list_length; i++) {
+		lvm_gc_for_each_marked_atom(lvm, mc.list[i], lvm_gc_move_atom, NULL);
+		
+		for(; block_index < mc.data_blocks_length && mc.data_blocks[block_index].list_index == i; block_index++) {
+			lvm_gc_data_block_p block = &mc.data_blocks[block_index];
+			if (block_index > 0 && block->data_ptr == block[-1].data_ptr)
+				continue;
+			if (block->new_data_ptr != block->data_ptr) {
+				memmove(block->new_data_ptr, block->data_ptr, block->size);
+				lvm->gc.stats.bytes_copied += block->size;
+			}
+		}
+	}
+	for(size_t i = 0; i < mc.data_blocks_length; i++) {
+		lvm_gc_data_block_p block = &mc.data_blocks[i];
+		lvm_atom_p atom = lvm_gc_forward_table_get(&mc.forward_table, block->atom, block->atom);
+		lvm_gc_atom_infos[lvm_atom_type(atom)].set_data(lvm, atom, block->new_data_ptr);
+	}
+	
+	// Update the region headers. Regions after the last one we compacted into
+	// are empty now and go back into the pool.
+	if (mc.list_length > 0) {
+		cursor.free_offsets[cursor.index] = cursor.atom_offset;
+		cursor.free_bytes[cursor.index] = cursor.data_offset - cursor.atom_offset;
+		for(size_t i = 0; i <= cursor.index; i++) {
+			mc.list[i]->region->free_offset = cursor.free_offsets[i];
+			mc.list[i]->region->free_bytes = cursor.free_bytes[i];
+		}
+		
+		for(size_t i = cursor.index + 1; i < mc.list_length; i++)
+			lvm_gc_put_region_into_pool(lvm, mc.list[i]->region);
+		cursor.region->next = NULL;
+		lvm->gc.new_space.last = cursor.region;
+		
+		free(cursor.free_offsets);
+		free(cursor.free_bytes);
+	}
+	
+	// Unmarked large atoms are garbage
+	lvm_gc_space_t large_space = lvm->gc.large_space;
+	lvm->gc.large_space = (lvm_gc_space_t){ 0 };
+	lvm_gc_region_p next = NULL;
+	for(lvm_gc_region_p r = large_space.first; r != NULL; r = next) {
+		next = r->next;
+		r->next = NULL;
+		if (lvm_gc_find_mark_region(&mc, r)->mark_bits[0] != 0)
+			lvm_gc_append_region_to_space(&lvm->gc.large_space, r);
+		else
+			lvm_gc_free_region(&lvm->gc.heap, r);
+	}
+	
+	lvm_gc_update_alloc_sites(lvm, false);
+	lvm_gc_adapt_heap_size(lvm);
+	lvm_gc_trim_region_pool(lvm);
+	
+	for(size_t i = 0; i < mc.regions_length; i++)
+		free(mc.regions[i].mark_bits);
+	free(mc.regions);
+	free(mc.list);
+	free(mc.stack);
+	free(mc.data_blocks);
+	free(mc.envs);
+	lvm_gc_atom_set_destroy(&mc.visited_envs);
+	lvm_gc_forward_table_destroy(&mc.forward_table);
+	lvm->gc.collection = NULL;
+	
+	lvm_gc_update_stats(lvm, start, bytes_in_space, lvm->gc.stats.bytes_copied - bytes_copied_before);
+}
+
+
+// Recomputes a node of the free chunk tree from its children. span is the
+// number of chunks below each child.
+static void lvm_gc_heap_update_node(lvm_gc_heap_p heap, size_t node, uint32_t span) {
+	lvm_gc_heap_node_t left = heap->free_tree[2*node], right = heap->free_tree[2*node + 1];
+	uint32_t longest = (left.longest > right.longest) ? left.longest : right.longest;
+	if (left.suffix + right.prefix > longest)
+		longest = left.suffix + right.prefix;
+	
+	heap->free_tree[node] = (lvm_gc_heap_node_t){
+		.prefix  = (left.prefix == span) ? span + right.prefix : left.prefix,
+		.suffix  = (right.suffix == span) ? span + left.suffix : right.suffix,
+		.longest = longest
+	};
+}
+
+// Marks count chunks starting at start as free or used in the free chunk tree.
+// Only the nodes above those chunks are updated, level by level.
+static void lvm_gc_heap_mark_chunks(lvm_gc_heap_p heap, size_t start, size_t count, bool is_free) {
+	uint32_t length = is_free ? 1 : 0;
+	for(size_t i = start; i < start + count; i++)
+		heap->free_tree[heap->tree_leaves + i] = (lvm_gc_heap_node_t){ length, length, length };
+	
+	size_t first = heap->tree_leaves + start, last = heap->tree_leaves + start + count - 1;
+	for(uint32_t span = 1; first > 1; span *= 2) {
+		first /= 2;
+		last /= 2;
+		for(size_t node = first; node <= last; node++)
+			lvm_gc_heap_update_node(heap, node, span);
+	}
+}
+
+/**
+ * Reserves the address range all regions are carved out of. It's mapped with
+ * MAP_NORESERVE so only the pages we actually touch take up memory. If the
+ * kernel refuses (e.g. with strict overcommit) we try again with half the size
+ * as long as it's at least min_size. mmap() only guarantees page alignment so
+ * we map a bit more and unmap the unaligned parts before and after the heap.
+ * address is only a hint, NULL lets the kernel choose.
+ */
+bool lvm_gc_reserve_heap(lvm_gc_heap_p heap, void* address, size_t size, size_t min_size) {
+	size = (size + (LVM_GC_REGION_ALIGNMENT - 1)) / LVM_GC_REGION_ALIGNMENT * LVM_GC_REGION_ALIGNMENT;
+	size_t alignment = LVM_GC_REGION_ALIGNMENT;
+#	ifdef LVM_COMPRESSED_REFS
+	// Compressed references get the heap base by masking off the lower bits
+	// of an atom address, see lvm_decompress_ref()
+	alignment = LVM_COMPRESSED_HEAP_SIZE;
+	if (size > LVM_COMPRESSED_HEAP_SIZE)
+		size = LVM_COMPRESSED_HEAP_SIZE;
+#	endif
+	
+	void* mapping = MAP_FAILED;
+	size_t mapped_size = 0;
+	while (true) {
+		mapped_size = size + alignment;
+		mapping = mmap(address, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mapping != MAP_FAILED)
+			break;
+		if (size / 2 < min_size)
+			return false;
+		size = size / 2 / LVM_GC_REGION_ALIGNMENT * LVM_GC_REGION_ALIGNMENT;
+	}
+	
+	void* base = (void*)( ((size_t)mapping + (alignment - 1)) / alignment * alignment );
+	size_t unaligned_head = base - mapping;
+	size_t unaligned_tail = mapped_size - unaligned_head - size;
+	if (unaligned_head > 0)
+		munmap(mapping, unaligned_head);
+	if (unaligned_tail > 0)
+		munmap(base + size, unaligned_tail);
+	
+	size_t chunk_count = size >> LVM_GC_HEAP_CHUNK_SHIFT;
+	size_t tree_leaves = 1;
+	while (tree_leaves < chunk_count)
+		tree_leaves *= 2;
+	*heap = (lvm_gc_heap_t){
+		.base = base,
+		.size = size,
+		.chunk_regions = calloc(chunk_count, sizeof(heap->chunk_regions[0])),
+		.chunk_count = chunk_count,
+		// Zeroed nodes are used chunks, that's right for the leaves after the
+		// last chunk
+		.free_tree = calloc(2 * tree_leaves, sizeof(heap->free_tree[0])),
+		.tree_leaves = tree_leaves
+	};
+	lvm_gc_heap_mark_chunks(heap, 0, chunk_count, true);
+	
+	return true;
+}
+
+/**
+ * Returns the first chunk of the first run of at least count free chunks or
+ * SIZE_MAX if there is none. We go down the tree and prefer the left child: If
+ * the run isn't in there it might start at the end of the left child and
+ * continue in the right one, otherwise it has to be in the right child.
+ */
+size_t lvm_gc_heap_find_free_chunks(lvm_gc_heap_p heap, size_t count) {
+	if (heap->free_tree[1].longest < count)
+		return SIZE_MAX;
+	
+	size_t node = 1, offset = 0, span = heap->tree_leaves;
+	while (node < heap->tree_leaves) {
+		span /= 2;
+		lvm_gc_heap_node_t left = heap->free_tree[2*node], right = heap->free_tree[2*node + 1];
+		if (left.longest >= count) {
+			node = 2*node;
+		} else if (left.suffix + right.prefix >= count) {
+			return offset + span - left.suffix;
+		} else {
+			node = 2*node + 1;
+			offset += span;
+		}
+	}
+	
+	return offset;
+}
+
+/**
+ * Carves a new region out of the reserved heap. We take the first run of unused
+ * chunks that is large enough, so regions always start at a 2 MiByte boundary.
+ * Returns NULL if there is no such run left. The caller can then free regions
+ * (e.g. the pooled ones) and try again or report an error, see
+ * lvm_gc_map_region().
+ * 
+ * With the LVM_GC_HUGE_PAGES flag we ask the kernel to back the region with
+ * transparent huge pages. If the kernel doesn't support that the flag is
+ * removed from the region.
+ */
+lvm_gc_region_p lvm_gc_allocate_region(lvm_gc_heap_p heap, size_t size, uint16_t flags) {
+	size_t size_in_64k_chunks = (size + (LVM_GC_64K - 1)) / LVM_GC_64K;
+	size_t region_size = size_in_64k_chunks * LVM_GC_64K;
+	size_t chunks = (region_size + (LVM_GC_REGION_ALIGNMENT - 1)) >> LVM_GC_HEAP_CHUNK_SHIFT;
+	
+	size_t start = lvm_gc_heap_find_free_chunks(heap, chunks);
+	if (start == SIZE_MAX)
+		return NULL;
+	
+	for(size_t i = start; i < start + chunks; i++)
+		heap->chunk_regions[i] = start + 1;
+	lvm_gc_heap_mark_chunks(heap, start, chunks, false);
+	
+	lvm_gc_region_p region = heap->base + (start << LVM_GC_HEAP_CHUNK_SHIFT);
+	if ( (flags & LVM_GC_HUGE_PAGES) && madvise(region, region_size, MADV_HUGEPAGE) != 0 )
+		flags &= ~LVM_GC_HUGE_PAGES;
+	
+	*region = (lvm_gc_region_t){
+		.atom_type = LVM_T_MAX,
+		.next = NULL,
+		.space = NULL,
+		.size_in_64k_chunks = size_in_64k_chunks,
+		.flags = flags,
+		.free_offset = sizeof(lvm_gc_region_t),
+		.free_bytes = (size_in_64k_chunks * LVM_GC_64K) - sizeof(lvm_gc_region_t)
+	};
+	
+	return region;
+}
+
+void lvm_gc_invalidate_data_in_region(lvm_gc_region_p region) {
+	// Don't invalidate the header struct at the start of the region. So leave one 4k page there.
+	void* ptr = (void*)(((size_t)region + sizeof(lvm_gc_region_t) + 4096 - 1) / 4096 * 4096);
+	madvise(ptr, region->size_in_64k_chunks * LVM_GC_64K - 4096, MADV_DONTNEED);
+}
+
+// Gives the pages of the region back to the kernel and its chunks back to the heap
+void lvm_gc_free_region(lvm_gc_heap_p heap, lvm_gc_region_p region) {
+	size_t start = ((void*)region - heap->base) >> LVM_GC_HEAP_CHUNK_SHIFT;
+	size_t chunks = (region->size_in_64k_chunks * LVM_GC_64K + (LVM_GC_REGION_ALIGNMENT - 1)) >> LVM_GC_HEAP_CHUNK_SHIFT;
+	madvise(region, chunks << LVM_GC_HEAP_CHUNK_SHIFT, MADV_DONTNEED);
+	
+	for(size_t i = start; i < start + chunks; i++)
+		heap->chunk_regions[i] = 0;
+	lvm_gc_heap_mark_chunks(heap, start, chunks, true);
+}
+
+void lvm_gc_free_regions_of_space(lvm_gc_heap_p heap, lvm_gc_space_p space) {
+	lvm_gc_region_p next = NULL;
+	for(lvm_gc_region_p r = space->first; r != NULL; r = next) {
+		next = r->next;
+		lvm_gc_free_region(heap, r);
+	}
+	
+	space->first = NULL;
+	space->last = NULL;
+}
+
+size_t lvm_gc_count_regions_of_space(lvm_gc_space_p space) {
+	size_t count = 0;
+	for(lvm_gc_region_p r = space->first; r != NULL; r = r->next)
+		count++;
+	return count;
+}
+
+// Bytes used by atoms and data in all regions of the space
+size_t lvm_gc_used_bytes_of_space(lvm_gc_space_p space) {
+	size_t used_bytes = 0;
+	for(lvm_gc_region_p r = space->first; r != NULL; r = r->next) {
+#		ifdef LVM_BIBOP
+		// Don't count the forwarding bitmap of pages
+		if (r->atom_type != LVM_T_MAX) {
+			used_bytes += r->free_offset - lvm_gc_page_atoms_offset(lvm_gc_atom_infos[r->atom_type].size);
+			continue;
+		}
+#		endif
+		used_bytes += r->size_in_64k_chunks * LVM_GC_64K - sizeof(lvm_gc_region_t) - r->free_bytes;
+	}
+	return used_bytes;
+}
+
+void lvm_gc_append_region_to_space(lvm_gc_space_p space, lvm_gc_region_p region) {
+	if (space->last != NULL) {
+		space->last->next = region;
+	} else if (space->first != NULL) {
+		// The space only has regions we don't allocate from (pages and
+		// oversized regions), append after them
+		lvm_gc_region_p r = space->first;
+		while (r->next != NULL)
+			r = r->next;
+		r->next = region;
+	} else {
+		space->first = region;
+	}
+	space->last = region;
+	region->space = space;
+}
+
+// Puts a region at the start of a space without making it the region we
+// allocate from
+void lvm_gc_prepend_region_to_space(lvm_gc_space_p space, lvm_gc_region_p region) {
+	region->next = space->first;
+	region->space = space;
+	space->first = region;
+}
+
+// Tags all regions of a space after its region list was moved over from
+// another space (e.g. when the new and old space are swapped)
+void lvm_gc_update_space_of_regions(lvm_gc_space_p space) {
+	for(lvm_gc_region_p r = space->first; r != NULL; r = r->next)
+		r->space = space;
+}
+
+/**
+ * Returns the region a large atom of the space lives in. A large atom is always
+ * placed directly after its region header. Returns NULL if the atom isn't a
+ * large atom of that space.
+ */
+lvm_gc_region_p lvm_gc_find_large_atom_region(lvm_p lvm, lvm_gc_space_p space, lvm_atom_p atom) {
+	lvm_gc_region_p region = lvm_gc_find_region_of_space(lvm, space, atom);
+	if ( region == NULL || (void*)region + sizeof(lvm_gc_region_t) != (void*)atom )
+		return NULL;
+	return region;
+}
+
+
+bool lvm_gc_space_contains(lvm_p lvm, lvm_gc_space_p space, void* ptr) {
+	return lvm_gc_find_region_of_space(lvm, space, ptr) != NULL;
+}
+
+// Constant time, the heap tells us the region and its header the space
+lvm_gc_region_p lvm_gc_find_region_of_space(lvm_p lvm, lvm_gc_space_p space, void* ptr) {
+	lvm_gc_region_p region = lvm_gc_region_of(&lvm->gc.heap, ptr);
+	if (region == NULL || region->space != space)
+		return NULL;
+	return region;
+}
+
+/**
+ * Calls the child collectors of all atoms in a space (or in one region of it
+ * with lvm_gc_scan_region()) with collect_child. The atoms of a region are
+ * packed at its start so we can step through them by their size. All atoms of
+ * a page have the same type, so there we don't have to look at each atom and
+ * can skip pages of atoms without children.
+ */
+void lvm_gc_scan_space(lvm_p lvm, lvm_gc_space_p space, lvm_gc_collect_child_t collect_child) {
+	for(lvm_gc_region_p r = space->first; r != NULL; r = r->next)
+		lvm_gc_scan_region(lvm, r, collect_child);
+}
+
+void lvm_gc_scan_region(lvm_p lvm, lvm_gc_region_p region, lvm_gc_collect_child_t collect_child) {
+#	ifdef LVM_BIBOP
+	if (region->atom_type != LVM_T_MAX) {
+		lvm_gc_atom_info_p info = &lvm_gc_atom_infos[region->atom_type];
+		if (info->child_collector == NULL)
+			return;
+		for(uint32_t offset = lvm_gc_page_atoms_offset(info->size); offset < region->free_offset; offset += info->size)
+			info->child_collector(lvm, (void*)region + offset - info->offset, collect_child);
+		return;
+	}
+#	endif
+	
+	for(uint32_t offset = sizeof(lvm_gc_region_t); offset < region->free_offset; ) {
+		lvm_atom_p atom = (void*)region + offset;
+		if (lvm_gc_atom_infos[lvm_atom_type(atom)].child_collector != NULL)
+			lvm_gc_atom_infos[lvm_atom_type(atom)].child_collector(lvm, atom, collect_child);
+		offset += lvm_gc_atom_infos[lvm_atom_type(atom)].size;
+	}
+}
+
+/**
+ * The pool keeps the regions of old spaces around after a collection. New
+ * regions are taken from there instead of mapping fresh ones. Regions from the
+ * pool are not zeroed, they still contain the garbage of the last cycle.
+ * 
+ * Only regions of the configured region size are pooled. Returns NULL if the pool is
+ * empty or can't provide a region of the requested size.
+ */
+lvm_gc_region_p lvm_gc_take_region_from_pool(lvm_p lvm, size_t size) {
+	if (lvm == NULL || size > lvm->gc.region_size)
+		return NULL;
+	if (lvm->gc.region_pool.first == NULL)
+		lvm_gc_take_swept_regions(lvm);
+	if (lvm->gc.region_pool.first == NULL)
+		return NULL;
+	
+	lvm_gc_region_p region = lvm->gc.region_pool.first;
+	lvm->gc.region_pool.first = region->next;
+	if (lvm->gc.region_pool.first == NULL)
+		lvm->gc.region_pool.last = NULL;
+	lvm->gc.region_pool_length--;
+	
+	*region = (lvm_gc_region_t){
+		.atom_type = LVM_T_MAX,
+		.next = NULL,
+		.space = NULL,
+		.size_in_64k_chunks = region->size_in_64k_chunks,
+		.flags = region->flags & LVM_GC_HUGE_PAGES,
+		.free_offset = sizeof(lvm_gc_region_t),
+		.free_bytes = (region->size_in_64k_chunks * LVM_GC_64K) - sizeof(lvm_gc_region_t)
+	};
+	
+	return region;
+}
+
+/**
+ * Allocates a new region in the heap for the allocation functions. When the
+ * heap is exhausted we give the pooled regions back to the heap and try again,
+ * that also joins their chunks into larger runs. We can't collect here since
+ * we don't know the roots, so if that doesn't help either it's an error.
+ */
+lvm_gc_region_p lvm_gc_map_region(lvm_p lvm, size_t size, uint16_t flags) {
+	lvm_gc_region_p region = lvm_gc_allocate_region(&lvm->gc.heap, size, flags);
+	if (region != NULL)
+		return region;
+	
+	lvm_gc_take_swept_regions(lvm);
+	lvm_gc_free_regions_of_space(&lvm->gc.heap, &lvm->gc.region_pool);
+	lvm->gc.region_pool_length = 0;
+	region = lvm_gc_allocate_region(&lvm->gc.heap, size, flags);
+	if (region == NULL) {
+		fprintf(stderr, "lvm_gc_map_region(): GC heap exhausted, no room for %zu bytes in the reserved %zu MiByte\n",
+			size, lvm->gc.heap.size / (1024*1024));
+		exit(1);
+	}
+	return region;
+}
+
+void lvm_gc_put_region_into_pool(lvm_p lvm, lvm_gc_region_p region) {
+	// Hand the region to the background sweeper, it comes back into the pool
+	// once it's clean
+	if (lvm->gc.background_sweep) {
+		region->next = NULL;
+		pthread_mutex_lock(&lvm->gc.sweeper_mutex);
+		lvm_gc_append_region_to_space(&lvm->gc.sweeper_dirty, region);
+		pthread_cond_signal(&lvm->gc.sweeper_cond);
+		pthread_mutex_unlock(&lvm->gc.sweeper_mutex);
+		return;
+	}
+	
+	// Oversized regions don't fit the pool, give them back right away
+	if (region->size_in_64k_chunks * LVM_GC_64K != lvm->gc.region_size) {
+		lvm_gc_free_region(&lvm->gc.heap, region);
+		return;
+	}
+	
+	region->next = NULL;
+	lvm_gc_append_region_to_space(&lvm->gc.region_pool, region);
+	lvm->gc.region_pool_length++;
+}
+
+/**
+ * Releases pooled regions to the OS once the pool grew above its high
+ * watermark. We then free regions until we're down to the low watermark. The
+ * gap between both avoids mapping and unmapping the same regions over and over
+ * again when the heap size oscillates a bit.
+ */
+void lvm_gc_trim_region_pool(lvm_p lvm) {
+	lvm_gc_take_swept_regions(lvm);
+	
+	// Under memory pressure we give back all pooled regions
+	size_t low_watermark = lvm->gc.region_pool_low_watermark;
+	if (lvm->gc.cgroup_pressure >= LVM_GC_MEMORY_PRESSURE_THRESHOLD)
+		low_watermark = 0;
+	else if (lvm->gc.region_pool_length <= lvm->gc.region_pool_high_watermark)
+		return;
+	
+	while (lvm->gc.region_pool_length > low_watermark) {
+		lvm_gc_region_p region = lvm->gc.region_pool.first;
+		lvm->gc.region_pool.first = region->next;
+		lvm->gc.region_pool_length--;
+		lvm_gc_free_region(&lvm->gc.heap, region);
+	}
+	
+	if (lvm->gc.region_pool.first == NULL)
+		lvm->gc.region_pool.last = NULL;
+}
+
+/**
+ * Moves the regions the background sweeper cleaned into the pool. Oversized
+ * regions don't fit the pool, their chunks go back to the heap. That has to
+ * happen here since only the interpreter thread touches the heap.
+ */
+void lvm_gc_take_swept_regions(lvm_p lvm) {
+	if (!lvm->gc.background_sweep)
+		return;
+	
+	pthread_mutex_lock(&lvm->gc.sweeper_mutex);
+	lvm_gc_space_t clean = lvm->gc.sweeper_clean;
+	lvm->gc.sweeper_clean = (lvm_gc_space_t){ 0 };
+	pthread_mutex_unlock(&lvm->gc.sweeper_mutex);
+	
+	lvm_gc_region_p next = NULL;
+	for(lvm_gc_region_p r = clean.first; r != NULL; r = next) {
+		next = r->next;
+		r->next = NULL;
+		if (r->size_in_64k_chunks * LVM_GC_64K != lvm->gc.region_size) {
+			lvm_gc_free_region(&lvm->gc.heap, r);
+		} else {
+			lvm_gc_append_region_to_space(&lvm->gc.region_pool, r);
+			lvm->gc.region_pool_length++;
+		}
+	}
+}
+
+/**
+ * Background sweeper thread. Takes evacuated regions, gives their pages back
+ * to the kernel (the next access gets zeroed pages) and puts them into the
+ * clean space the allocator takes pooled regions from. The madvise() calls are
+ * done without holding the mutex.
+ */
+void* lvm_gc_sweeper_main(void* arg) {
+	lvm_p lvm = arg;
+	lvm_gc_p gc = &lvm->gc;
+	
+	pthread_mutex_lock(&gc->sweeper_mutex);
+	while (!gc->sweeper_stop) {
+		lvm_gc_region_p region = gc->sweeper_dirty.first;
+		if (region == NULL) {
+			pthread_cond_wait(&gc->sweeper_cond, &gc->sweeper_mutex);
+			continue;
+		}
+		gc->sweeper_dirty.first = region->next;
+		if (gc->sweeper_dirty.first == NULL)
+			gc->sweeper_dirty.last = NULL;
+		region->next = NULL;
+		pthread_mutex_unlock(&gc->sweeper_mutex);
+		
+		lvm_gc_invalidate_data_in_region(region);
+		
+		pthread_mutex_lock(&gc->sweeper_mutex);
+		lvm_gc_append_region_to_space(&gc->sweeper_clean, region);
+		gc->swept_regions++;
+	}
+	pthread_mutex_unlock(&gc->sweeper_mutex);
+	
+	return NULL;
+}
+
+
+/**
+ * Returns a region of the space with at least size free bytes. That's the last
+ * region unless it's full, then a new one is taken from the pool or mapped and
+ * appended. lvm can only be NULL if the space has enough free bytes (used when
+ * allocating the interpreter context).
+ * 
+ * Allocations that don't fit into a region get an oversized region of their
+ * own. It's put at the start of the space and never becomes the last region,
+ * so later atoms don't end up in it. With LVM_BIBOP that would put them outside
+ * of the first chunk of the region where lvm_atom_type() can't find its header.
+ */
+lvm_gc_region_p lvm_gc_ensure_free_bytes_in_space(lvm_p lvm, lvm_gc_space_p space, size_t size, bool* added_new_region) {
 	lvm_gc_region_p region = space->last;
+	if ( region != NULL && region->free_bytes >= size )
+		return region;
+	
+	// Set marker if the caller wants to know
+	if (added_new_region)
+		*added_new_region = true;
+	
+	if (sizeof(lvm_gc_region_t) + size > lvm->gc.region_size) {
+		region = lvm_gc_map_region(lvm, sizeof(lvm_gc_region_t) + size, lvm->gc.region_flags);
+		lvm_gc_prepend_region_to_space(space, region);
+		return region;
+	}
+	
+	region = lvm_gc_take_region_from_pool(lvm, lvm->gc.region_size);
+	if (region == NULL)
+		region = lvm_gc_map_region(lvm, lvm->gc.region_size, lvm->gc.region_flags);
+	lvm_gc_append_region_to_space(space, region);
+	return region;
+}
+
+#ifdef LVM_BIBOP
+/**
+ * Starts a new page for headerless atoms of type in the space (see LVM_BIBOP in
+ * lvm.h). Pages are put at the start of the space, the last region stays the one
+ * other atoms and data are allocated from.
+ */
+lvm_gc_region_p lvm_gc_add_page_to_space(lvm_p lvm, lvm_gc_space_p space, lvm_atom_type_t type, bool* added_new_region) {
+	lvm_gc_region_p page = lvm_gc_take_region_from_pool(lvm, lvm->gc.region_size);
+	if (page == NULL)
+		page = lvm_gc_map_region(lvm, lvm->gc.region_size, lvm->gc.region_flags);
+	
+	uint32_t atoms_offset = lvm_gc_page_atoms_offset(lvm_gc_atom_infos[type].size);
+	memset(lvm_gc_page_forwarded_bits(page), 0, atoms_offset - sizeof(lvm_gc_region_t));
+	page->atom_type = type;
+	page->free_bytes -= atoms_offset - page->free_offset;
+	page->free_offset = atoms_offset;
+	
+	lvm_gc_prepend_region_to_space(space, page);
+	space->pages[type] = page;
+	if (added_new_region)
+		*added_new_region = true;
+	return page;
+}
+#endif
+
+lvm_atom_p lvm_gc_alloc_atom_from_space(lvm_p lvm, lvm_gc_space_p space, lvm_atom_type_t type, bool* added_new_region) {
+	lvm_gc_atom_info_p info = &lvm_gc_atom_infos[type];
+	lvm_gc_region_p region = NULL;
+#	ifdef LVM_BIBOP
+	if (info->offset != 0) {
+		region = space->pages[type];
+		if (region == NULL || region->free_bytes < info->size)
+			region = lvm_gc_add_page_to_space(lvm, space, type, added_new_region);
+	}
+#	endif
+	if (region == NULL)
+		region = lvm_gc_ensure_free_bytes_in_space(lvm, space, info->size, added_new_region);
+	
+	lvm_atom_p atom = (void*)region + region->free_offset - info->offset;
+	if (info->offset == 0) {
+		atom->type = type;
+		atom->alloc_site = 0;
+	}
+	region->free_offset += info->size;
+	region->free_bytes  -= info->size;
+	
+	return atom;
+}
+
+void* lvm_gc_alloc_data_from_space(lvm_p lvm, lvm_gc_space_p space, size_t data_size, bool* added_new_region) {
+	data_size = LVM_GC_ALIGN(data_size);
+	lvm_gc_region_p region = lvm_gc_ensure_free_bytes_in_space(lvm, space, data_size, added_new_region);
 	
 	void* data_ptr = (void*)region + region->free_offset + region->free_bytes - data_size;
 	region->free_bytes -= data_size;
@@ -288,13 +3311,18 @@ void* lvm_gc_alloc_data_from_space(lvm_gc_space_p space, size_t data_size, bool*
 	return data_ptr;
 }
 
-lvm_atom_p lvm_gc_alloc_from_space(lvm_gc_space_p space, lvm_atom_type_t type, size_t data_size, void** data_ptr, bool* added_new_region) {
+lvm_atom_p lvm_gc_alloc_from_space(lvm_p lvm, lvm_gc_space_p space, lvm_atom_type_t type, size_t data_size, void** data_ptr, bool* added_new_region) {
+	// Headerless atoms live in pages and never have data
+	if (lvm_gc_atom_infos[type].offset != 0)
+		return lvm_gc_alloc_atom_from_space(lvm, space, type, added_new_region);
+	
+	data_size = LVM_GC_ALIGN(data_size);
 	uint32_t atom_size = lvm_gc_atom_infos[type].size;
-	lvm_gc_ensure_free_bytes_in_space(space, atom_size + data_size, added_new_region);
+	lvm_gc_region_p region = lvm_gc_ensure_free_bytes_in_space(lvm, space, atom_size + data_size, added_new_region);
 	
-	lvm_gc_region_p region = space->last;
 	lvm_atom_p atom = (void*)region + region->free_offset;
 	atom->type = type;
+	atom->alloc_site = 0;
 	region->free_offset += atom_size;
 	region->free_bytes  -= atom_size;
 	
@@ -306,13 +3334,31 @@ lvm_atom_p lvm_gc_alloc_from_space(lvm_gc_space_p space, lvm_atom_type_t type, s
 	return atom;
 }
 
-void* lvm_gc_calloc(size_t length, size_t size_per_element) {
-	// FIXME: How to get the lvm_p pointer?!
+/**
+ * Allocates the slots of a dict (the bindings of an env or the symbol table) as
+ * data of an LVM_T_ENV atom. The data starts with a pointer back to that atom,
+ * the slots follow. That way the collector gets from a dict to the atom that
+ * owns its slots (see lvm_gc_dict_storage()). The atom only learns about its
+ * dict during a collection since rehashing allocates for a temporary dict.
+ */
+void* lvm_gc_calloc(lvm_p lvm, size_t length, size_t size_per_element) {
+	size_t size = sizeof(lvm_atom_p) + length * size_per_element;
+	void* data = NULL;
+	lvm_atom_p atom = lvm_gc_alloc(lvm, LVM_T_ENV, size, &data);
+	atom->parent = lvm->nil_atom;
+	atom->bindings = NULL;
+	
+	// Regions from the pool still contain garbage
+	memset(data, 0, size);
+	*(lvm_atom_p*)data = atom;
+	return data + sizeof(lvm_atom_p);
 }
 
-void  lvm_gc_free(void* ptr) {
-	// Nothing to do... data will be freed on next collect
-	return;
+void  lvm_gc_free(lvm_p lvm, void* ptr) {
+	// The slots are garbage now and freed by the next collection. Their atom
+	// forgets the dict, it no longer knows the size of the slots.
+	if (ptr != NULL)
+		((lvm_atom_p*)ptr)[-1]->bindings = NULL;
 }
 
 
@@ -322,8 +3368,21 @@ void  lvm_gc_free(void* ptr) {
 
 
 void lvm_gc_pair_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child) {
+#	ifdef LVM_COMPRESSED_REFS
+	// Collectors patch full pointers, so give them decompressed copies
+	lvm_atom_p first = lvm_pair_first(atom), rest = lvm_pair_rest(atom);
+	collect_child(lvm, &first);
+	collect_child(lvm, &rest);
+	// Unchanged references aren't written back, the pair might be a tenured
+	// one in a page we share with a forked parent (see lvm_gc_tenure())
+	if (first != lvm_pair_first(atom))
+		lvm_pair_set_first(atom, first);
+	if (rest != lvm_pair_rest(atom))
+		lvm_pair_set_rest(atom, rest);
+#	else
 	collect_child(lvm, &atom->first);
 	collect_child(lvm, &atom->rest);
+#	endif
 }
 
 size_t lvm_gc_get_str_data(lvm_p lvm, lvm_atom_p atom, void** data_ptr) {
@@ -331,17 +3390,34 @@ size_t lvm_gc_get_str_data(lvm_p lvm, lvm_atom_p atom, void** data_ptr) {
 	return strlen(atom->str) + 1;
 }
 
+void lvm_gc_set_str_data(lvm_p lvm, lvm_atom_p atom, void* data_ptr) {
+	atom->str = data_ptr;
+}
+
 void lvm_gc_env_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child) {
 	collect_child(lvm, &atom->parent);
 }
 
 size_t lvm_gc_get_env_data(lvm_p lvm, lvm_atom_p atom, void** data_ptr) {
-	*data_ptr = atom->bindings->slots;
-	return atom->bindings->capacity * sizeof(atom->bindings->slots[0]);
+	// Slots that were replaced by lvm_gc_free()
+	if (atom->bindings == NULL)
+		return 0;
+	*data_ptr = (void*)atom->bindings->slots - sizeof(lvm_atom_p);
+	return sizeof(lvm_atom_p) + lvm_dict_storage_size(atom->bindings->capacity);
+}
+
+// The first word of the data points back to the atom, see lvm_gc_calloc()
+void lvm_gc_set_env_data(lvm_p lvm, lvm_atom_p atom, void* data_ptr) {
+	*(lvm_atom_p*)data_ptr = atom;
+	atom->bindings->slots = data_ptr + sizeof(lvm_atom_p);
 }
 
+// The env is malloc()ed and not an atom, so it never goes to collect_child.
+// Its slots and bindings are traced by the env_collector of the running
+// collection instead.
 void lvm_gc_lambda_child_collector(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child) {
 	collect_child(lvm, &atom->args);
 	collect_child(lvm, &atom->body);
-	collect_child(lvm, &atom->env);
+	if (lvm->gc.collection != NULL && lvm->gc.collection->env_collector != NULL)
+		lvm->gc.collection->env_collector(lvm, atom->env);
 }
@@ -1,12 +1,9 @@
 #pragma once
+#include <pthread.h>
 #include "slim_hash.h"
 #include "lvm.h"
 
 
-// A hashtable from string to atom
-SH_GEN_DECL(lvm_dict, const char*, lvm_atom_p);
-
-
 //
 // Garbage collector stuff
 //
@@ -15,18 +12,235 @@ typedef struct lvm_gc_s        lvm_gc_t,        *lvm_gc_p;
 typedef struct lvm_gc_space_s  lvm_gc_space_t,  *lvm_gc_space_p;
 typedef struct lvm_gc_region_s lvm_gc_region_t, *lvm_gc_region_p;
 
+// Atoms and data are allocated from the last region. With LVM_BIBOP headerless
+// atoms are allocated from the current page of their type instead. Pages are
+// put at the start of the region list so they never become the last region.
 struct lvm_gc_space_s {
 	lvm_gc_region_p first;
 	lvm_gc_region_p last;
+#	ifdef LVM_BIBOP
+	lvm_gc_region_p pages[LVM_T_MAX];
+#	endif
 };
 
+struct lvm_gc_region_s {
+	// Type of all atoms in the region if it's a BiBoP page, LVM_T_MAX for
+	// normal regions. Has to be the first field, see lvm_atom_type().
+	lvm_atom_type_t atom_type;
+	uint16_t size_in_64k_chunks;
+	uint16_t flags;
+	lvm_gc_region_p next;
+	// Space the region currently belongs to, see lvm_gc_space_contains()
+	lvm_gc_space_p space;
+	uint32_t free_offset;
+	uint32_t free_bytes;
+};
+
+// All regions are carved out of one address range reserved when the
+// interpreter is created, see lvm_gc_reserve_heap() in gc.c. The range is
+// divided into 2 MiByte chunks, each region starts at a chunk boundary and
+// covers one or more chunks.
+#define LVM_GC_HEAP_CHUNK_SHIFT 21
+typedef struct {
+	// Free chunks at the start and the end of the chunks below a node of the
+	// free chunk tree and its longest run of free chunks
+	uint32_t prefix, suffix, longest;
+} lvm_gc_heap_node_t;
+
+typedef struct {
+	void* base;
+	size_t size;
+	// For each chunk the index of the first chunk of its region plus one, 0
+	// for unused chunks
+	uint32_t* chunk_regions;
+	size_t chunk_count;
+	// Segment tree over the chunks, finds the first free run that is large
+	// enough in O(log n), see lvm_gc_heap_find_free_chunks() in gc.c. Node 1 is
+	// the root, the children of node i are 2i and 2i+1 and the tree_leaves
+	// leaves (a power of two) start at index tree_leaves.
+	lvm_gc_heap_node_t* free_tree;
+	size_t tree_leaves;
+} lvm_gc_heap_t, *lvm_gc_heap_p;
+
+// Survival statistics of one allocation site, see lvm_gc_update_alloc_sites()
+// in gc.c
+#define LVM_GC_MAX_ALLOC_SITES 1024
+// Atoms allocated at this site go into the uncollected space and live forever
+#define LVM_GC_IMMORTAL_SITE   1
+typedef struct {
+	size_t allocated_bytes, survived_bytes;
+	bool pretenure, immortal;
+	// Type of the function that owns the site (builtin, syntax or lambda),
+	// used to name unbound functions in profiles
+	lvm_atom_type_t func_type;
+} lvm_gc_alloc_site_t, *lvm_gc_alloc_site_p;
+
+// Sampling allocation profiler, see lvm_profile_start(). One entry per distinct
+// call stack, its sites are stored in lvm_gc_profile_t.sites_ptr.
+#define LVM_GC_MAX_CALL_DEPTH           256
+#define LVM_GC_DEFAULT_SAMPLE_INTERVAL  (512 * 1024)
+typedef struct {
+	uint64_t hash;
+	size_t sites_offset, depth;
+	size_t bytes, samples;
+} lvm_gc_profile_stack_t, *lvm_gc_profile_stack_p;
+
+typedef struct {
+	// Allocation sites of the functions currently running, outermost first.
+	// Only maintained by lvm_gc_enter_alloc_site() while the profiler is on,
+	// it only sees the functions called after lvm_profile_start(). Frames
+	// deeper than LVM_GC_MAX_CALL_DEPTH are counted but not recorded.
+	uint16_t call_stack[LVM_GC_MAX_CALL_DEPTH];
+	size_t call_depth;
+	
+	// SIZE_MAX while the profiler is off, this way the allocation fast path
+	// only needs one compare to check for a sample
+	size_t next_sample, sample_interval;
+	lvm_gc_profile_stack_p stacks_ptr;
+	size_t stacks_length, stacks_capacity;
+	uint16_t* sites_ptr;
+	size_t sites_length, sites_capacity;
+} lvm_gc_profile_t;
+
+typedef struct {
+	lvm_atom_p atom;
+	lvm_finalizer_t finalizer;
+	void* data;
+} lvm_gc_finalizer_entry_t;
+
+// Index of the finalization table entry of an atom
+SH_GEN_DECL(lvm_gc_finalizer_index, void*, size_t);
+
+// State of the running collection, defined in gc.c
+typedef struct lvm_gc_collection_s lvm_gc_collection_t, *lvm_gc_collection_p;
+
 struct lvm_gc_s {
+	lvm_gc_heap_t heap;
 	lvm_gc_space_t uncollected;
 	lvm_gc_space_t new_space;
 	lvm_gc_space_t old_space;
+	lvm_gc_space_t large_space;
+	lvm_gc_space_t old_large_space;
+	lvm_gc_space_t region_pool;
+	// Atoms of pretenured allocation sites, scanned for references into the
+	// new space on each collection. Only a major collection moves or frees
+	// them, see lvm_gc_collect() in gc.c. During a major the regions to
+	// evacuate are in the old tenured space.
+	lvm_gc_space_t tenured_space;
+	lvm_gc_space_t old_tenured_space;
+	// Bytes allocated into the tenured space since the last major collection,
+	// the next one is due once they reach the budget
+	size_t tenured_bytes_allocated, tenured_budget;
+	size_t region_pool_length, region_pool_low_watermark, region_pool_high_watermark;
 	bool collect_on_next_possibility;
+	size_t region_size;
+	uint16_t region_flags;
+	// Compact the new space in place instead of copying it into the old space
+	bool mark_compact;
+	bool string_dedup;
+	
+	// Background sweeper, see lvm_gc_sweeper_main() in gc.c. Evacuated regions
+	// are put into sweeper_dirty, the thread cleans them and moves them into
+	// sweeper_clean. The mutex protects both spaces and the counter.
+	bool background_sweep, sweeper_stop;
+	pthread_t sweeper_thread;
+	pthread_mutex_t sweeper_mutex;
+	pthread_cond_t sweeper_cond;
+	lvm_gc_space_t sweeper_dirty, sweeper_clean;
+	size_t swept_regions;
+	
+	// Heap sizing policy, see lvm_gc_adapt_heap_size() in gc.c
+	lvm_gc_policy_t policy;
+	size_t allocation_budget, bytes_allocated_at_last_collect;
+	
+	// cgroup memory limits, see lvm_gc_read_cgroup() in gc.c. The limit and
+	// headroom are SIZE_MAX if there is no limit.
+	char cgroup_path[256];
+	size_t cgroup_memory_max, cgroup_headroom, bytes_allocated_at_cgroup_read;
+	double cgroup_pressure;
+	
+	// Allocation sites, index 0 is the unknown site and never pretenured,
+	// index 1 the immortal site
+	lvm_gc_alloc_site_t alloc_sites[LVM_GC_MAX_ALLOC_SITES];
+	size_t alloc_sites_length;
+	uint16_t current_alloc_site;
+	
+	lvm_gc_profile_t profile;
+	
+	// Atoms pinned with lvm_pin(), an atom is listed once per lvm_pin() call
+	lvm_atom_p* pinned_ptr;
+	size_t pinned_length, pinned_capacity;
+	
+	// Finalization table, see lvm_finalize(). The index is rebuilt after each
+	// collection since the atoms move.
+	lvm_gc_finalizer_entry_t* finalizers_ptr;
+	size_t finalizers_length, finalizers_capacity;
+	lvm_gc_finalizer_index_t finalizers_index;
+	
+	// Set while a collection or heap dump runs, see lvm_gc_collection_t in gc.c
+	lvm_gc_collection_p collection;
+	
+	// Regions are counted when lvm_gc_stats() is called, the rest is updated
+	// by the allocation functions and the collector
+	lvm_gc_stats_t stats;
+	size_t bytes_collected;
 };
 
+typedef void   (*lvm_gc_collect_child_t)(lvm_p lvm, lvm_atom_p* child_atom);
+typedef void   (*lvm_gc_child_collector_t)(lvm_p lvm, lvm_atom_p atom, lvm_gc_collect_child_t collect_child);
+typedef size_t (*lvm_gc_get_data_t)(lvm_p lvm, lvm_atom_p atom, void** data_ptr);
+typedef void   (*lvm_gc_set_data_t)(lvm_p lvm, lvm_atom_p atom, void* data_ptr);
+typedef struct {
+	uint32_t size;
+	// Offset of the first byte the atom occupies, LVM_ATOM_HEADER_SIZE for
+	// headerless atoms (see LVM_BIBOP in lvm.h) and 0 for all others
+	uint32_t offset;
+	lvm_gc_child_collector_t child_collector;
+	// Types with data need both, set_data patches the data pointer once the
+	// collector moved the data
+	lvm_gc_get_data_t        get_data;
+	lvm_gc_set_data_t        set_data;
+} lvm_gc_atom_info_t, *lvm_gc_atom_info_p;
+
+// Exact (8 byte aligned) size and GC functions of each atom type, defined in gc.c
+extern lvm_gc_atom_info_t lvm_gc_atom_infos[];
+
+/**
+ * Returns the region ptr points into or NULL if it's not a pointer into the GC
+ * heap (e.g. malloc()ed memory). Just a subtraction, a shift and a table
+ * lookup.
+ */
+static inline lvm_gc_region_p lvm_gc_region_of(lvm_gc_heap_p heap, const void* ptr) {
+	size_t offset = (size_t)ptr - (size_t)heap->base;
+	if (offset >= heap->size)
+		return NULL;
+	
+	uint32_t start_chunk = heap->chunk_regions[offset >> LVM_GC_HEAP_CHUNK_SHIFT];
+	if (start_chunk == 0)
+		return NULL;
+	return (void*)( (char*)heap->base + ((size_t)(start_chunk - 1) << LVM_GC_HEAP_CHUNK_SHIFT) );
+}
+
+/**
+ * Returns the region atoms of that type are allocated from in a space: The last
+ * region or for headerless atoms the current page of their type. NULL if the
+ * space doesn't have one yet.
+ */
+static inline lvm_gc_region_p lvm_gc_allocation_region(lvm_gc_space_p space, lvm_atom_type_t type) {
+#	ifdef LVM_BIBOP
+	if (lvm_gc_atom_infos[type].offset != 0)
+		return space->pages[type];
+#	endif
+	return space->last;
+}
+
+lvm_p      lvm_gc_init(lvm_options_p options);
+void       lvm_gc_cleanup(lvm_p lvm);
+lvm_atom_p lvm_gc_alloc_atom(lvm_p lvm, lvm_atom_type_t type);
+void       lvm_gc_profile_sample(lvm_p lvm);
+void*      lvm_gc_calloc(lvm_p lvm, size_t length, size_t size_per_element);
+void       lvm_gc_free(lvm_p lvm, void* ptr);
+
 
 //
 // General interpreter stuff
@@ -42,6 +256,10 @@ struct lvm_s {
 	lvm_atom_p* arg_stack_ptr;
 	size_t arg_stack_length, arg_stack_capacity;
 	
+	// Addresses of C variables registered as roots with lvm_handle()
+	lvm_atom_p** handle_stack_ptr;
+	size_t handle_stack_length, handle_stack_capacity;
+	
 	size_t alloced_atoms;
 	lvm_gc_t gc;
 };
@@ -61,6 +279,81 @@ void lvm_mem_free(lvm_p lvm);
 void lvm_arg_stack_push(lvm_p lvm, lvm_atom_p atom);
 void lvm_arg_stack_drop(lvm_p lvm, size_t count);
 
+/**
+ * Fast path to allocate an atom in the new space. Just bumps the free pointer
+ * of the current region by the exact size of the atom type. Only when the
+ * region is full (or the profiler wants a sample) we call into gc.c.
+ */
+static inline lvm_atom_p lvm_gc_alloc_atom_inline(lvm_p lvm, lvm_atom_type_t type) {
+	lvm_gc_atom_info_p info = &lvm_gc_atom_infos[type];
+	lvm_gc_region_p region = lvm_gc_allocation_region(&lvm->gc.new_space, type);
+	lvm_gc_alloc_site_p site = &lvm->gc.alloc_sites[lvm->gc.current_alloc_site];
+	if ( region == NULL || region->free_bytes < info->size || site->pretenure || lvm->gc.stats.bytes_allocated >= lvm->gc.profile.next_sample )
+		return lvm_gc_alloc_atom(lvm, type);
+	
+	lvm_atom_p atom = (void*)region + region->free_offset - info->offset;
+	region->free_offset += info->size;
+	region->free_bytes  -= info->size;
+	lvm->gc.stats.bytes_allocated += info->size;
+	// Headerless atoms can't remember their allocation site, so they don't
+	// count for it
+	if (info->offset == 0) {
+		atom->type = type;
+		atom->alloc_site = lvm->gc.current_alloc_site;
+		site->allocated_bytes += info->size;
+	}
+	
+	return atom;
+}
+
+// Records the site on the call stack the profiler samples, see lvm_gc_profile_t
+static inline void lvm_gc_push_call_site(lvm_p lvm, uint16_t site) {
+	lvm_gc_profile_t* profile = &lvm->gc.profile;
+	if (profile->next_sample == SIZE_MAX)
+		return;
+	if (profile->call_depth < LVM_GC_MAX_CALL_DEPTH)
+		profile->call_stack[profile->call_depth] = site;
+	profile->call_depth++;
+}
+
+/**
+ * Makes func (a builtin, syntax or lambda atom) the current allocation site.
+ * Each function gets its own site on its first call. Returns the previous site,
+ * restore it with lvm_gc_leave_alloc_site() once the function returns.
+ */
+static inline uint16_t lvm_gc_enter_alloc_site(lvm_p lvm, lvm_atom_p func) {
+	if (func->call_site == 0 && lvm->gc.alloc_sites_length < LVM_GC_MAX_ALLOC_SITES) {
+		func->call_site = lvm->gc.alloc_sites_length++;
+		lvm->gc.alloc_sites[func->call_site].func_type = lvm_atom_type(func);
+	}
+	
+	uint16_t prev_site = lvm->gc.current_alloc_site;
+	lvm->gc.current_alloc_site = func->call_site;
+	lvm_gc_push_call_site(lvm, func->call_site);
+	return prev_site;
+}
+
+/**
+ * Makes the immortal site the current allocation site. Used for atoms that
+ * have to stay where they are forever (symbols, builtins, quoted literals).
+ * Everything such an atom references has to be immortal as well since the
+ * collector never looks into the uncollected space.
+ */
+static inline uint16_t lvm_gc_enter_immortal_site(lvm_p lvm) {
+	uint16_t prev_site = lvm->gc.current_alloc_site;
+	lvm->gc.current_alloc_site = LVM_GC_IMMORTAL_SITE;
+	lvm_gc_push_call_site(lvm, LVM_GC_IMMORTAL_SITE);
+	return prev_site;
+}
+
+static inline void lvm_gc_leave_alloc_site(lvm_p lvm, uint16_t prev_site) {
+	lvm->gc.current_alloc_site = prev_site;
+	// Functions entered before lvm_profile_start() never pushed their site
+	lvm_gc_profile_t* profile = &lvm->gc.profile;
+	if (profile->next_sample != SIZE_MAX && profile->call_depth > 0)
+		profile->call_depth--;
+}
+
 
 //
 // Environment stuff
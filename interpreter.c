@@ -1,8 +1,8 @@
 #include "internals.h"
 
-lvm_p lvm_new() {
+lvm_p lvm_new(lvm_options_p options) {
 #	ifdef GC_REGION_BAKER
-	lvm_p lvm = lvm_gc_init();
+	lvm_p lvm = lvm_gc_init(options);
 #	else
 	lvm_p lvm = malloc(sizeof(lvm_t));
 #	endif
@@ -20,7 +20,12 @@ void lvm_destroy(lvm_p lvm) {
 	lvm_env_destroy(lvm, lvm->base_env);
 	lvm->base_env = NULL;
 	lvm_mem_free(lvm);
+#	ifdef GC_REGION_BAKER
+	// The interpreter itself lives in the GC heap
+	lvm_gc_cleanup(lvm);
+#	else
 	free(lvm);
+#	endif
 }
 
 lvm_env_p lvm_base_env(lvm_p lvm) {
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include "slim_hash.h"
 
 
 //
@@ -12,7 +14,54 @@ typedef struct lvm_s *lvm_p;
 typedef struct lvm_atom_s *lvm_atom_p;
 typedef struct lvm_env_s *lvm_env_p;
 
-lvm_p lvm_new();
+typedef enum {
+	// Collect whenever a new region was added to the new space
+	LVM_GC_POLICY_FIXED = 0,
+	// Adaptive heap sizing tuned for a low GC overhead: Large allocation
+	// budgets between collections, fewer but longer pauses.
+	LVM_GC_POLICY_THROUGHPUT,
+	// Adaptive heap sizing tuned for short pauses and a small heap: Small
+	// allocation budgets, frequent collections.
+	LVM_GC_POLICY_LATENCY
+} lvm_gc_policy_t;
+
+typedef struct {
+	// Size of the memory regions the GC allocates atoms from. It's rounded up
+	// to a multiple of 2 MiByte. 0 uses the default (16 MiByte).
+	size_t gc_region_size;
+	// Ask the kernel to back GC regions with transparent huge pages
+	// (madvise(MADV_HUGEPAGE)). Fewer TLB misses when the GC walks the heap.
+	bool gc_huge_pages;
+	// Size of the address range reserved for the GC heap (MAP_NORESERVE, only
+	// pages that are actually used take up memory). All regions are carved
+	// out of it. 0 uses the default (64 GiByte).
+	size_t gc_heap_size;
+	// Preferred address of the heap, only a hint for mmap(). NULL lets the
+	// kernel choose. lvm_image_load() uses the address of the saved heap.
+	void* gc_heap_address;
+	// Collect with a sliding mark-compact collector instead of copying. Needs
+	// only a mark bitmap and a forwarding table instead of a second half space
+	// but takes more passes over the heap.
+	bool gc_mark_compact;
+	// When to collect and how many regions to keep around, see lvm_gc_policy_t
+	lvm_gc_policy_t gc_policy;
+	// Let equal strings share one copy of their characters when the copying
+	// collector evacuates them. Costs hashing each surviving string.
+	bool gc_string_dedup;
+	// Clean evacuated regions (give their pages back to the kernel) in a
+	// background thread instead of reusing them dirty. Keeps the resident set
+	// small without adding madvise() calls to the collection pause.
+	bool gc_background_sweep;
+	// Directory with the cgroup v2 memory files (memory.max, memory.current
+	// and memory.pressure). The GC collects more often when it gets close to
+	// the memory limit and returns pooled regions under memory pressure. NULL
+	// uses /sys/fs/cgroup (our own cgroup within a container), an empty string
+	// ignores cgroups.
+	const char* gc_cgroup_path;
+} lvm_options_t, *lvm_options_p;
+
+// options can be NULL to use the default options
+lvm_p lvm_new(lvm_options_p options);
 void  lvm_destroy(lvm_p lvm);
 
 lvm_env_p  lvm_base_env(lvm_p lvm);
@@ -21,6 +70,136 @@ lvm_atom_p lvm_eval(lvm_p lvm, lvm_atom_p atom, lvm_env_p env);
 void       lvm_print(lvm_p lvm, FILE* output, lvm_atom_p atom);
 
 
+//
+// GC statistics
+//
+
+#define LVM_GC_PAUSE_HISTOGRAM_BUCKETS 16
+
+typedef struct {
+	size_t collections;
+	double total_pause_ms, max_pause_ms;
+	// Bucket 0 counts pauses below 1ms, bucket i pauses below 2^i ms. The last
+	// bucket counts all longer pauses.
+	size_t pause_histogram[LVM_GC_PAUSE_HISTOGRAM_BUCKETS];
+	
+	size_t bytes_allocated, bytes_copied;
+	// Copied bytes divided by the bytes in the collected space. For the last
+	// collection and averaged over all collections.
+	double last_survival_rate, average_survival_rate;
+	
+	// Number of regions in each space
+	size_t uncollected_regions, new_space_regions, large_space_regions, pooled_regions, tenured_regions;
+	// Regions of the new space kept in place because they contain pinned atoms
+	size_t pinned_regions;
+	
+	// Weak references and weak table entries cleared because their target or
+	// key was collected
+	size_t weak_refs_cleared;
+	
+	// Finalizers called because their atom was collected
+	size_t finalized_atoms;
+	
+	// String data not copied because an equal string was copied before
+	size_t string_dedup_bytes;
+	
+	// Regions the background sweeper cleaned and regions waiting for it
+	size_t swept_regions, regions_to_sweep;
+	
+	// Allocation sites that allocate directly into the tenured space and
+	// pretenured sites that went back to the new space because most of their
+	// atoms died after all
+	size_t pretenured_sites, demoted_sites;
+	// Collections that also evacuated the tenured space
+	size_t major_collections;
+	
+	// Bytes the program can allocate until the next collection is triggered.
+	// Adapted after each collection unless the policy is LVM_GC_POLICY_FIXED.
+	size_t allocation_budget;
+	
+	// memory.max of our cgroup (0 if there is no limit) and the "some avg10"
+	// value of memory.pressure in percent
+	size_t memory_limit;
+	double memory_pressure;
+} lvm_gc_stats_t, *lvm_gc_stats_p;
+
+// Only available when built with GC_REGION_BAKER
+void lvm_gc_stats(lvm_p lvm, lvm_gc_stats_p stats);
+
+//
+// Handle scopes
+// 
+// Atoms can move during a collection. C code that keeps atoms in local
+// variables across allocations registers those variables as handles. The
+// collector treats them as roots and patches them when it moves an atom.
+// Handles are released in bulk by closing the scope they were created in:
+// 
+//	lvm_handle_scope_t scope = lvm_handle_scope_open(lvm);
+//	lvm_atom_p list = lvm_nil_atom(lvm);
+//	lvm_handle(lvm, &list);
+//	for(size_t i = 0; i < 10; i++)
+//		list = lvm_pair_atom(lvm, lvm_num_atom(lvm, i), list);
+//	lvm_handle_scope_close(lvm, scope);
+// 
+// The variables have to stay valid until the scope is closed.
+//
+
+typedef size_t lvm_handle_scope_t;
+
+lvm_handle_scope_t lvm_handle_scope_open(lvm_p lvm);
+void               lvm_handle(lvm_p lvm, lvm_atom_p* atom_var);
+void               lvm_handle_scope_close(lvm_p lvm, lvm_handle_scope_t scope);
+
+// Pinned atoms (and their data, e.g. the characters of a string) keep their
+// address until they're unpinned. That way their data can be handed directly
+// to read(), write() or C libraries. Pinned atoms are kept alive. Pins nest,
+// each lvm_pin() needs its own lvm_unpin(). Only available with GC_REGION_BAKER.
+void lvm_pin(lvm_p lvm, lvm_atom_p atom);
+void lvm_unpin(lvm_p lvm, lvm_atom_p atom);
+
+// Registers a finalizer that is called once the collector finds the atom
+// unreachable (or when the interpreter is destroyed), e.g. to close a file
+// handle the atom owns. The finalizer runs during the collection: It can read
+// the atom but must not allocate atoms or store the atom anywhere. A NULL
+// finalizer removes the finalizer of the atom. Only available with
+// GC_REGION_BAKER.
+typedef void (*lvm_finalizer_t)(lvm_p lvm, lvm_atom_p atom, void* data);
+void lvm_finalize(lvm_p lvm, lvm_atom_p atom, lvm_finalizer_t finalizer, void* data);
+
+
+// Writes a census of all atoms reachable from the base env and the arg stack
+// to output. graph_output can be NULL, otherwise the object graph is written
+// there (see tools/heap_analyzer.c). Only available with GC_REGION_BAKER.
+void lvm_heap_dump(lvm_p lvm, FILE* output, FILE* graph_output);
+
+// Sampling allocation profiler: Every sample_interval allocated bytes (0 for
+// 512 KiByte) the stack of running builtins, syntax and lambdas is recorded.
+// Starting discards the previous profile. lvm_profile_write() writes the
+// sampled bytes per call stack in the collapsed format of flamegraph.pl.
+// Functions are named after their bindings in env (and its parents). Only
+// available with GC_REGION_BAKER.
+void lvm_profile_start(lvm_p lvm, size_t sample_interval);
+void lvm_profile_stop(lvm_p lvm);
+void lvm_profile_write(lvm_p lvm, FILE* output, lvm_env_p env);
+
+// Heap images: lvm_image_save() writes the base env, the symbol table and all
+// atoms reachable from them to a file. lvm_image_load() creates an interpreter
+// from that file instead of building the base env and mmap()s the atoms back.
+// If it gets the heap at the same address (same build and options) the atoms
+// are used as they are, otherwise their pointers are fixed up. Weak references
+// and weak tables can't be saved. Both print an error to stderr and return
+// false or NULL if something goes wrong. Only available with GC_REGION_BAKER.
+bool  lvm_image_save(lvm_p lvm, const char* path);
+lvm_p lvm_image_load(const char* path, lvm_options_p options);
+
+// Collects with env (and its parents) as root and moves all surviving atoms
+// into the tenured space where they're never moved again, not even by major
+// collections. Call it before fork()ing workers from a warmed up interpreter:
+// Collections in the children then don't write to the pages they share with
+// the parent. Only available with GC_REGION_BAKER.
+void lvm_gc_tenure(lvm_p lvm, lvm_env_p env);
+
+
 //
 // Atom types and allocation functions
 //
@@ -38,24 +217,72 @@ typedef enum {
 	LVM_T_SYNTAX,
 	LVM_T_ERROR,
 	LVM_T_ENV,
+	LVM_T_WEAK,
+	LVM_T_WEAK_TABLE,
 	LVM_T_FORWARD_PTR,
 	LVM_T_MAX
 } lvm_atom_type_t;
 
+// A hashtable from string to atom, probed a group of slots at a time
+SH_GEN_GROUP_DECL(lvm_dict, const char*, lvm_atom_p);
+
+// One entry of a weak table. Empty entries have a NULL key.
+typedef struct {
+	lvm_atom_p key, value;
+} lvm_ephemeron_t, *lvm_ephemeron_p;
+
 typedef lvm_atom_p (*lvm_builtin_func_t)(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env);
 typedef lvm_atom_p (*lvm_syntax_func_t)(lvm_p lvm, lvm_atom_p args, lvm_env_p env);
 
+// Compressed references (build with LVM_COMPRESSED_REFS, needs GC_REGION_BAKER):
+// Pairs store first and rest as 32 bit offsets into the GC heap instead of
+// pointers, a pair takes 16 instead of 24 bytes. The heap is reserved at a 32
+// GiByte boundary and is at most 32 GiByte large. So the heap base is the
+// address of the pair with the lower bits masked off and no interpreter
+// context is needed to decompress a reference. Atoms are 8 byte aligned,
+// offsets count in units of 8 bytes.
+// 
+// Always use lvm_pair_first() and friends to access pairs, they work with
+// both layouts. Pairs never contain NULL.
+#ifdef LVM_COMPRESSED_REFS
+typedef uint32_t lvm_ref_t;
+#define LVM_COMPRESSED_HEAP_SIZE  ((uintptr_t)32*1024*1024*1024)
+#else
+typedef lvm_atom_p lvm_ref_t;
+#endif
+
+// BiBoP pages (build with LVM_BIBOP, needs GC_REGION_BAKER): Numbers and pairs
+// are allocated in 2 MiByte pages that only contain atoms of one type. The type
+// is stored once at the start of the page instead of in each atom, so these
+// atoms have no header. Numbers take 8 instead of 16 bytes and pairs 16 instead
+// of 24 (8 instead of 16 with compressed references). A pointer to a headerless
+// atom points LVM_ATOM_HEADER_SIZE bytes in front of its payload, that way the
+// payload fields are at their usual offsets. Never touch type, alloc_site or
+// call_site of such an atom. Use lvm_atom_type() to get the type of any atom.
+#define LVM_ATOM_HEADER_SIZE  8
+#ifdef LVM_BIBOP
+#define LVM_BIBOP_PAGE_SHIFT  21
+#define LVM_BIBOP_PAGE_SIZE   ((uintptr_t)1 << LVM_BIBOP_PAGE_SHIFT)
+#endif
+
 struct lvm_atom_s {
+	// Use lvm_atom_type() to read it, headerless atoms don't have it
 	lvm_atom_type_t type;
+	// Both fit into the padding after type and are only used by the GC. The
+	// allocation site the atom was allocated from (0 for unknown or after it
+	// survived a collection) and for builtins, syntax and lambdas the site of
+	// the atoms allocated while they run (0 until they're called the first time).
+	uint16_t alloc_site;
+	uint16_t call_site;
 	union {
 		// Used by LVM_T_NUM
 		int64_t num;
 		// Used by LVM_T_SYM, LVM_T_STR, LVM_T_ERROR
 		char* str;
-		// Used by LVM_T_PAIR
+		// Used by LVM_T_PAIR, access with lvm_pair_first() and friends
 		struct {
-			lvm_atom_p first;
-			lvm_atom_p rest;
+			lvm_ref_t first;
+			lvm_ref_t rest;
 		};
 		// Used by LVM_T_BUILTIN
 		lvm_builtin_func_t builtin;
@@ -72,11 +299,65 @@ struct lvm_atom_s {
 		// Used by LVM_T_ENV
 		struct {
 			lvm_atom_p parent;
-			lvm_dict_t bindings;
+			lvm_dict_p bindings;
+		};
+		// Used by LVM_T_WEAK
+		lvm_atom_p target;
+		// Used by LVM_T_WEAK_TABLE, open addressing hash of the key addresses.
+		// When a collection moves keys or removes entries it sets needs_rehash
+		// and the table is rehashed on the next access.
+		struct {
+			lvm_ephemeron_p entries;
+			uint32_t length, capacity;
+			bool needs_rehash;
 		};
 	};
 };
 
+static inline lvm_atom_type_t lvm_atom_type(lvm_atom_p atom) {
+#	ifdef LVM_BIBOP
+	// The first field of every page header is the type of all atoms in the
+	// page or LVM_T_MAX if the atoms have their own header
+	lvm_atom_type_t page_type = *(const lvm_atom_type_t*)( (uintptr_t)atom & ~(LVM_BIBOP_PAGE_SIZE - 1) );
+	if (page_type != LVM_T_MAX)
+		return page_type;
+#	endif
+	return atom->type;
+}
+
+static inline lvm_ref_t lvm_compress_ref(lvm_atom_p atom) {
+#	ifdef LVM_COMPRESSED_REFS
+	return ((uintptr_t)atom & (LVM_COMPRESSED_HEAP_SIZE - 1)) >> 3;
+#	else
+	return atom;
+#	endif
+}
+
+// holder is the atom that contains the reference, it tells us the heap base
+static inline lvm_atom_p lvm_decompress_ref(const void* holder, lvm_ref_t ref) {
+#	ifdef LVM_COMPRESSED_REFS
+	return (lvm_atom_p)( ((uintptr_t)holder & ~(LVM_COMPRESSED_HEAP_SIZE - 1)) | ((uintptr_t)ref << 3) );
+#	else
+	return ref;
+#	endif
+}
+
+static inline lvm_atom_p lvm_pair_first(lvm_atom_p pair) {
+	return lvm_decompress_ref(pair, pair->first);
+}
+
+static inline lvm_atom_p lvm_pair_rest(lvm_atom_p pair) {
+	return lvm_decompress_ref(pair, pair->rest);
+}
+
+static inline void lvm_pair_set_first(lvm_atom_p pair, lvm_atom_p atom) {
+	pair->first = lvm_compress_ref(atom);
+}
+
+static inline void lvm_pair_set_rest(lvm_atom_p pair, lvm_atom_p atom) {
+	pair->rest = lvm_compress_ref(atom);
+}
+
 lvm_atom_p lvm_nil_atom(lvm_p lvm);
 lvm_atom_p lvm_true_atom(lvm_p lvm);
 lvm_atom_p lvm_false_atom(lvm_p lvm);
@@ -89,6 +370,15 @@ lvm_atom_p lvm_builtin_atom(lvm_p lvm, lvm_builtin_func_t func);
 lvm_atom_p lvm_syntax_atom(lvm_p lvm, lvm_syntax_func_t func);
 lvm_atom_p lvm_error_atom(lvm_p lvm, const char* format, ...);
 
+// Weak references don't keep their target alive. When the target is collected
+// the reference points to nil. Weak tables are ephemeron tables: A value is
+// kept alive as long as its key is reachable from somewhere else, entries with
+// unreachable keys are removed. Keys are compared by identity.
+lvm_atom_p lvm_weak_atom(lvm_p lvm, lvm_atom_p target);
+lvm_atom_p lvm_weak_table_atom(lvm_p lvm);
+lvm_atom_p lvm_weak_table_get(lvm_p lvm, lvm_atom_p table, lvm_atom_p key);
+void       lvm_weak_table_put(lvm_p lvm, lvm_atom_p table, lvm_atom_p key, lvm_atom_p value);
+
 
 //
 // Environment functions
@@ -1,5 +1,16 @@
+// For fdopen(), sigaction() and the socket functions
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include "lvm.h"
 
 //lvm_atom_p lvm_c_read(lvm_p lvm, FILE* input);
@@ -9,14 +20,223 @@ lvm_atom_p print(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
 	return lvm_nil_atom(lvm);
 }
 
-int main() {
-	lvm_p lvm = lvm_new();
+/**
+ * Evaluates everything in input until EOF. Results are printed to output (one
+ * per line) unless it's NULL, errors always go to stderr.
+ */
+static void eval_all(lvm_p lvm, FILE* input, lvm_env_p env, FILE* output) {
+	lvm_atom_p ast;
+	while ( (ast = lvm_read(lvm, input)) != NULL ) {
+		lvm_atom_p result = lvm_eval(lvm, ast, env);
+		if (lvm_atom_type(result) == LVM_T_ERROR) {
+			// Keep the order when both end up in the same place
+			fflush(output);
+			fprintf(stderr, "%s\n", result->str);
+		} else if (output != NULL) {
+			lvm_print(lvm, output, result);
+			fprintf(output, "\n");
+		}
+	}
+}
+
+
+//
+// Fork server
+//
+// Startup (base env, prelude) is paid once. Then the server forks a few
+// workers that accept connections on a Unix socket. Each worker forks a child
+// for every connection so every job starts with the same warmed up
+// interpreter. A job is the script the client sends until it shuts down its
+// side of the connection. The child evaluates it and sends back stdout and
+// stderr until it closes the connection, e.g.:
+//
+//   socat - UNIX-CONNECT:lvm.sock < script.lvm
+//
+// The children share the pages of the warmed up heap with the server (copy on
+// write). Before forking the server moves all atoms into the tenured space so
+// collections in the children don't write into them. There must not be a
+// background sweeper thread, it wouldn't survive fork().
+//
+// A worker kills jobs that run longer than the job timeout, otherwise one
+// endless loop would block it forever.
+//
+
+static void run_job(lvm_p lvm, int connection, lvm_env_p env) {
+	dup2(connection, STDOUT_FILENO);
+	dup2(connection, STDERR_FILENO);
+	FILE* input = fdopen(connection, "r");
+	if (input != NULL)
+		eval_all(lvm, input, env, stdout);
+	fflush(stdout);
+	fflush(stderr);
+	_exit(0);
+}
+
+static volatile sig_atomic_t job_timed_out = false;
+
+static void on_job_timeout(int signum) {
+	job_timed_out = true;
+}
+
+/**
+ * Waits until a job is done. Jobs that take longer than timeout seconds (0 for
+ * no limit) are killed.
+ */
+static void wait_for_job(pid_t job, unsigned int timeout) {
+	job_timed_out = false;
+	alarm(timeout);
+	while (waitpid(job, NULL, 0) == -1) {
+		if (errno != EINTR)
+			break;
+		if (job_timed_out) {
+			fprintf(stderr, "job %d took longer than %u seconds, killing it\n", (int)job, timeout);
+			kill(job, SIGKILL);
+			job_timed_out = false;
+		}
+	}
+	alarm(0);
+}
+
+static void worker_main(lvm_p lvm, int server, lvm_env_p env, unsigned int job_timeout) {
+	// Without SA_RESTART the alarm interrupts waitpid()
+	struct sigaction action = { .sa_handler = on_job_timeout };
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGALRM, &action, NULL);
+	
+	while (true) {
+		int connection = accept(server, NULL, NULL);
+		if (connection == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept()");
+			_exit(1);
+		}
+		
+		pid_t job = fork();
+		if (job == 0) {
+			close(server);
+			run_job(lvm, connection, env);
+		} else if (job == -1) {
+			perror("fork()");
+		}
+		
+		close(connection);
+		if (job > 0)
+			wait_for_job(job, job_timeout);
+	}
+}
+
+static bool start_worker(lvm_p lvm, int server, lvm_env_p env, unsigned int job_timeout) {
+	pid_t worker = fork();
+	if (worker == 0)
+		worker_main(lvm, server, env, job_timeout);
+	if (worker == -1) {
+		perror("fork()");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Serves jobs on a Unix socket at path until the server is killed. Workers
+ * that die are replaced. Only returns if something goes wrong.
+ */
+static int fork_server(lvm_p lvm, lvm_env_p env, const char* path, size_t workers, unsigned int job_timeout) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "fork_server(): socket path %s is too long\n", path);
+		return 1;
+	}
+	strcpy(address.sun_path, path);
+	
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server == -1) {
+		perror("socket()");
+		return 1;
+	}
+	
+	// Remove the socket of a previous run, but nothing else that happens to be
+	// at path
+	struct stat path_stat;
+	if ( lstat(path, &path_stat) == 0 ) {
+		if ( !S_ISSOCK(path_stat.st_mode) ) {
+			fprintf(stderr, "fork_server(): %s exists and isn't a socket\n", path);
+			close(server);
+			return 1;
+		}
+		unlink(path);
+	}
+	
+	if ( bind(server, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(server, 64) == -1 ) {
+		perror("fork_server(): bind() or listen()");
+		close(server);
+		return 1;
+	}
+	
+#	ifdef GC_REGION_BAKER
+	lvm_gc_tenure(lvm, env);
+#	endif
+	// Otherwise buffered output would be written once by each child
+	fflush(NULL);
+	
+	for(size_t i = 0; i < workers; i++) {
+		if ( !start_worker(lvm, server, env, job_timeout) )
+			return 1;
+	}
+	
+	while (true) {
+		if (wait(NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("wait()");
+			return 1;
+		}
+		if ( !start_worker(lvm, server, env, job_timeout) )
+			return 1;
+	}
+}
+
+
+int main(int argc, char** argv) {
+	const char* prelude_path = NULL;
+	const char* socket_path = NULL;
+	size_t workers = 4;
+	unsigned int job_timeout = 60;
+	for(int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--prelude") == 0 && i + 1 < argc) {
+			prelude_path = argv[++i];
+		} else if (strcmp(argv[i], "--fork-server") == 0 && i + 1 < argc) {
+			socket_path = argv[++i];
+		} else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i+1]) > 0) {
+			workers = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--job-timeout") == 0 && i + 1 < argc && atoi(argv[i+1]) >= 0) {
+			job_timeout = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--prelude file] [--fork-server socket-path [--workers n] [--job-timeout seconds]]\n", argv[0]);
+			return 1;
+		}
+	}
+	
+	lvm_p lvm = lvm_new(NULL);
 	
 	lvm_env_p local_env = lvm_env_new(lvm, lvm_base_env(lvm));
 	lvm_env_put(lvm, local_env, "a", lvm_str_atom(lvm, "hello"));
 	lvm_env_put(lvm, local_env, "b", lvm_str_atom(lvm, "world"));
 	lvm_env_put(lvm, local_env, "print", lvm_builtin_atom(lvm, print));
 	
+	if (prelude_path != NULL) {
+		FILE* prelude = fopen(prelude_path, "r");
+		if (prelude == NULL) {
+			perror(prelude_path);
+			return 1;
+		}
+		eval_all(lvm, prelude, local_env, NULL);
+		fclose(prelude);
+	}
+	
+	if (socket_path != NULL)
+		return fork_server(lvm, local_env, socket_path, workers, job_timeout);
+	
 	while (true) {
 		printf("> ");
 		fflush(stdout);
@@ -25,7 +245,7 @@ int main() {
 		if (ast == NULL)  // exit loop if lvm_read() gets an EOF
 			break;
 		lvm_atom_p result = lvm_eval(lvm, ast, local_env);
-		if (result->type != LVM_T_ERROR)
+		if (lvm_atom_type(result) != LVM_T_ERROR)
 			lvm_print(lvm, stdout, result);
 		else
 			fprintf(stderr, "%s", result->str);
@@ -37,4 +257,4 @@ int main() {
 	lvm_destroy(lvm);
 	
 	return 0;
-}
\ No newline at end of file
+}
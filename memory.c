@@ -7,6 +7,7 @@
 typedef struct lvm_atom_s lvm_atom_t;
 
 static lvm_atom_p lvm_alloc_atom(lvm_p lvm, lvm_atom_t content);
+static lvm_atom_p lvm_alloc_immortal_atom(lvm_p lvm, lvm_atom_t content);
 
 
 //
@@ -14,7 +15,7 @@ static lvm_atom_p lvm_alloc_atom(lvm_p lvm, lvm_atom_t content);
 //
 
 void lvm_mem_init(lvm_p lvm) {
-	lvm_dict_new(&lvm->symbol_table);
+	lvm_dict_new_with_context(&lvm->symbol_table, lvm);
 	
 #	ifdef GC_REGION_BAKER
 #	else
@@ -27,11 +28,16 @@ void lvm_mem_init(lvm_p lvm) {
 	lvm->arg_stack_capacity = 16;
 	lvm->arg_stack_ptr = malloc(lvm->arg_stack_capacity * sizeof(lvm->arg_stack_ptr[0]));
 	
+	lvm->handle_stack_length = 0;
+	lvm->handle_stack_capacity = 16;
+	lvm->handle_stack_ptr = malloc(lvm->handle_stack_capacity * sizeof(lvm->handle_stack_ptr[0]));
+	
 	lvm->alloced_atoms = 0;
 }
 
 void lvm_mem_free(lvm_p lvm) {
 	free(lvm->arg_stack_ptr);
+	free(lvm->handle_stack_ptr);
 }
 
 
@@ -40,12 +46,44 @@ void lvm_mem_free(lvm_p lvm) {
 //
 
 static lvm_atom_p lvm_alloc_atom(lvm_p lvm, lvm_atom_t content) {
+#	ifdef GC_REGION_BAKER
+	// Atoms only take the size their type needs, so only copy that part of
+	// the content. Headerless atoms just get their payload.
+	lvm_gc_atom_info_p info = &lvm_gc_atom_infos[content.type];
+	lvm_atom_p atom = lvm_gc_alloc_atom_inline(lvm, content.type);
+	if (info->offset == 0)
+		content.alloc_site = atom->alloc_site;
+	memcpy((void*)atom + info->offset, (void*)&content + info->offset, info->size);
+#	else
+#		ifdef LVM_COMPRESSED_REFS
+#		error "Compressed references need atoms in the GC heap, build with GC_REGION_BAKER"
+#		endif
+#		ifdef LVM_BIBOP
+#		error "BiBoP pages need atoms in the GC heap, build with GC_REGION_BAKER"
+#		endif
 	lvm_atom_p atom = malloc(sizeof(lvm_atom_t));
 	*atom = content;
+#	endif
 	lvm->alloced_atoms++;
 	return atom;
 }
 
+/**
+ * Allocates an atom that is never collected or moved. Used for symbols and
+ * builtins so they stay pointer-equal forever and don't need to be scanned by
+ * the collector.
+ */
+static lvm_atom_p lvm_alloc_immortal_atom(lvm_p lvm, lvm_atom_t content) {
+#	ifdef GC_REGION_BAKER
+	uint16_t prev_site = lvm_gc_enter_immortal_site(lvm);
+	lvm_atom_p atom = lvm_alloc_atom(lvm, content);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	return atom;
+#	else
+	return lvm_alloc_atom(lvm, content);
+#	endif
+}
+
 lvm_atom_p lvm_nil_atom(lvm_p lvm) {
 	return lvm->nil_atom;
 }
@@ -65,7 +103,7 @@ lvm_atom_p lvm_num_atom(lvm_p lvm, int64_t value) {
 lvm_atom_p lvm_sym_atom(lvm_p lvm, char* value) {
 	lvm_atom_p symbol = lvm_dict_get(&lvm->symbol_table, value, NULL);
 	if (!symbol) {
-		symbol = lvm_alloc_atom(lvm, (lvm_atom_t){ .type = LVM_T_SYM, .str = value });
+		symbol = lvm_alloc_immortal_atom(lvm, (lvm_atom_t){ .type = LVM_T_SYM, .str = value });
 		lvm_dict_put(&lvm->symbol_table, value, symbol);
 	}
 	return symbol;
@@ -77,8 +115,8 @@ lvm_atom_p lvm_str_atom(lvm_p lvm, char* value) {
 
 lvm_atom_p lvm_pair_atom(lvm_p lvm, lvm_atom_p first, lvm_atom_p rest) {
 	lvm_atom_t pair = { .type = LVM_T_PAIR };
-	pair.first = first;
-	pair.rest = rest;
+	pair.first = lvm_compress_ref(first);
+	pair.rest = lvm_compress_ref(rest);
 	return lvm_alloc_atom(lvm, pair);
 }
 
@@ -91,11 +129,11 @@ lvm_atom_p lvm_lambda_atom(lvm_p lvm, lvm_atom_p args, lvm_atom_p body, lvm_env_
 }
 
 lvm_atom_p lvm_builtin_atom(lvm_p lvm, lvm_builtin_func_t func) {
-	return lvm_alloc_atom(lvm, (lvm_atom_t){ .type = LVM_T_BUILTIN, .builtin = func });
+	return lvm_alloc_immortal_atom(lvm, (lvm_atom_t){ .type = LVM_T_BUILTIN, .builtin = func });
 }
 
 lvm_atom_p lvm_syntax_atom(lvm_p lvm, lvm_syntax_func_t func) {
-	return lvm_alloc_atom(lvm, (lvm_atom_t){ .type = LVM_T_SYNTAX, .syntax = func });
+	return lvm_alloc_immortal_atom(lvm, (lvm_atom_t){ .type = LVM_T_SYNTAX, .syntax = func });
 }
 
 lvm_atom_p lvm_error_atom(lvm_p lvm, const char* format, ...) {
@@ -109,22 +147,108 @@ lvm_atom_p lvm_error_atom(lvm_p lvm, const char* format, ...) {
 }
 
 
+//
+// Weak references and weak tables
+//
+
+lvm_atom_p lvm_weak_atom(lvm_p lvm, lvm_atom_p target) {
+	lvm_atom_t weak = { .type = LVM_T_WEAK };
+	weak.target = target;
+	return lvm_alloc_atom(lvm, weak);
+}
+
+#ifdef GC_REGION_BAKER
+// The entries are malloc()ed, they go away with the table
+static void lvm_weak_table_finalizer(lvm_p lvm, lvm_atom_p table, void* data) {
+	free(table->entries);
+}
+#endif
+
+lvm_atom_p lvm_weak_table_atom(lvm_p lvm) {
+	lvm_atom_t table = { .type = LVM_T_WEAK_TABLE };
+	table.entries = NULL;
+	table.length = 0;
+	table.capacity = 0;
+	table.needs_rehash = false;
+	lvm_atom_p atom = lvm_alloc_atom(lvm, table);
+#	ifdef GC_REGION_BAKER
+	lvm_finalize(lvm, atom, lvm_weak_table_finalizer, NULL);
+#	endif
+	return atom;
+}
+
+/**
+ * Returns the entry of key or the empty entry where it would be inserted. The
+ * table is never completely full so there always is an empty entry.
+ */
+static lvm_ephemeron_p lvm_weak_table_find(lvm_atom_p table, lvm_atom_p key) {
+	uint32_t mask = table->capacity - 1;
+	uint32_t index = (uint32_t)(((uintptr_t)key >> 3) * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+	while (table->entries[index].key != NULL && table->entries[index].key != key)
+		index = (index + 1) & mask;
+	return &table->entries[index];
+}
+
+static void lvm_weak_table_rehash(lvm_p lvm, lvm_atom_p table, uint32_t capacity) {
+	lvm_ephemeron_p old_entries = table->entries;
+	uint32_t old_capacity = table->capacity;
+	
+	table->entries = calloc(capacity, sizeof(table->entries[0]));
+	table->capacity = capacity;
+	for(uint32_t i = 0; i < old_capacity; i++) {
+		if (old_entries[i].key != NULL)
+			*lvm_weak_table_find(table, old_entries[i].key) = old_entries[i];
+	}
+	table->needs_rehash = false;
+	
+	free(old_entries);
+}
+
+lvm_atom_p lvm_weak_table_get(lvm_p lvm, lvm_atom_p table, lvm_atom_p key) {
+	if (table->length == 0)
+		return NULL;
+	if (table->needs_rehash)
+		lvm_weak_table_rehash(lvm, table, table->capacity);
+	return lvm_weak_table_find(table, key)->value;
+}
+
+void lvm_weak_table_put(lvm_p lvm, lvm_atom_p table, lvm_atom_p key, lvm_atom_p value) {
+	// Grow when the table would become more than 3/4 full
+	if ( (table->length + 1) * 4 > table->capacity * 3 )
+		lvm_weak_table_rehash(lvm, table, (table->capacity > 0) ? table->capacity * 2 : 8);
+	else if (table->needs_rehash)
+		lvm_weak_table_rehash(lvm, table, table->capacity);
+	
+	lvm_ephemeron_p entry = lvm_weak_table_find(table, key);
+	if (entry->key == NULL) {
+		entry->key = key;
+		table->length++;
+	}
+	entry->value = value;
+}
+
+
 //
 // Environment stuff
 //
 
+// Bindings and the symbol table keep their slots in the GC heap, the context
+// of those dicts is the interpreter (see lvm_gc_calloc())
+#ifdef GC_REGION_BAKER
+#define SLIM_HASH_CALLOC(context, length, size)  lvm_gc_calloc(context, length, size)
+#define SLIM_HASH_FREE(context, ptr)             lvm_gc_free(context, ptr)
+#endif
+
 #define SLIM_HASH_IMPLEMENTATION
 #include "slim_hash.h"
 
-#define SLIM_HASH_CALLOC lvm_gc_calloc
-#define SLIM_HASH_FREE   lvm_gc_free
-SH_GEN_DICT_DEF(lvm_dict, const char*, lvm_atom_p);
+SH_GEN_GROUP_DICT_DEF(lvm_dict, const char*, lvm_atom_p);
 
 
 lvm_env_p lvm_env_new(lvm_p lvm, lvm_env_p parent) {
 	lvm_env_p env = malloc(sizeof(lvm_env_t));
 	env->parent = parent;
-	lvm_dict_new(&env->bindings);
+	lvm_dict_new_with_context(&env->bindings, lvm);
 	return env;
 }
 
@@ -170,4 +294,31 @@ void lvm_arg_stack_drop(lvm_p lvm, size_t count) {
 	}
 	
 	lvm->arg_stack_length -= count;
-}
\ No newline at end of file
+}
+
+
+//
+// Handle scopes
+//
+
+lvm_handle_scope_t lvm_handle_scope_open(lvm_p lvm) {
+	return lvm->handle_stack_length;
+}
+
+void lvm_handle(lvm_p lvm, lvm_atom_p* atom_var) {
+	if (lvm->handle_stack_length >= lvm->handle_stack_capacity) {
+		lvm->handle_stack_capacity = (lvm->handle_stack_capacity > 0) ? lvm->handle_stack_capacity * 2 : 16;
+		lvm->handle_stack_ptr = realloc(lvm->handle_stack_ptr, lvm->handle_stack_capacity * sizeof(lvm->handle_stack_ptr[0]));
+	}
+	
+	lvm->handle_stack_ptr[lvm->handle_stack_length++] = atom_var;
+}
+
+void lvm_handle_scope_close(lvm_p lvm, lvm_handle_scope_t scope) {
+	if (scope > lvm->handle_stack_length) {
+		fprintf(stderr, "trying to close a handle scope that was already closed! scopes have to be closed in reverse order!\n");
+		abort();
+	}
+	
+	lvm->handle_stack_length = scope;
+}
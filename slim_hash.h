@@ -5,11 +5,14 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
 
 bool sh_del(hash, key);  // ture if value was found and deleted, false if not found
 
+void sh_new_with_context(hash, context);  // context is passed to SLIM_HASH_CALLOC() and SLIM_HASH_FREE()
+
 for(sh_it_p it = sh_start(hash); it != NULL; it = sh_next(it)) {
     int64_t key = sh_key(it);
     int value = sh_value(it);
@@ -23,6 +26,16 @@ sh_it_p sh_start(sh_hash_p hash);  // iterator
 sh_it_p sh_next(sh_hash_p hash, sh_it_p it);  // it of next set elem
 void    sh_remove(sh_hash_p hash, sh_it_p it);  // removes current elem from hash (during iteration!)
 
+size_t sh_storage_size(uint32_t capacity);  // bytes SLIM_HASH_CALLOC() allocates for a capacity
+
+Group layout (SH_GEN_GROUP_DECL, SH_GEN_GROUP_DEF, ...): Same functions but the
+slots only hold key and value. A separate array of control bytes (after the
+slots, in the same allocation) holds 7 bits of the hash of each slot (or marks
+it empty or deleted). Lookups compare the control bytes of a group of 16 slots
+at once (with SSE2 if available and SLIM_HASH_NO_SSE2 isn't defined) and only
+look at slots whose control byte matches. The capacity is a power of two and at
+least one group.
+
 
 **/
 
@@ -54,19 +67,52 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
 #define SH_SLOT_DELETED  0x00000001
 #define SH_SLOT_FILLED   0x80000000
 
-#define SH_GEN_DECL(prefix, key_t, value_t)                                     \
-    typedef struct {                                                            \
-        uint32_t hash_and_flags;                                                \
-        key_t key;                                                              \
-        value_t value;                                                          \
-    } prefix##_slot_t, *prefix##_slot_p, *prefix##_it_p;                        \
-                                                                                \
+// Control bytes of the group layout: Filled slots have the lower 7 bits of
+// their hash, empty and deleted slots have the highest bit set.
+#define SH_GROUP_WIDTH   16
+#define SH_CTRL_EMPTY    0x80
+#define SH_CTRL_DELETED  0xFE
+
+// Define SLIM_HASH_NO_SSE2 to use the scalar loops even if SSE2 is available
+#if defined(__SSE2__) && !defined(SLIM_HASH_NO_SSE2)
+#define SH_GROUP_SSE2
+#include <emmintrin.h>
+#endif
+
+// Bit i is set if control byte i of the group is value
+static inline uint32_t sh_group_match(const uint8_t* group, uint8_t value) {
+#ifdef SH_GROUP_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)value)));
+#else
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < SH_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] == value) << i;
+    return mask;
+#endif
+}
+
+// Bit i is set if slot i of the group is empty or deleted
+static inline uint32_t sh_group_match_free(const uint8_t* group) {
+#ifdef SH_GROUP_SSE2
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < SH_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+#define SH_GEN_TABLE_DECL(prefix, key_t, value_t)                               \
     typedef struct {                                                            \
         uint32_t length, capacity, deleted;                                     \
         prefix##_slot_p slots;                                                  \
+        void* context;                                                          \
     } prefix##_t, *prefix##_p;                                                  \
                                                                                 \
     void     prefix##_new(prefix##_p hash);                                     \
+    void     prefix##_new_with_context(prefix##_p hash, void* context);         \
     void     prefix##_destroy(prefix##_p hash);                                 \
     void     prefix##_optimize(prefix##_p hash);                                \
                                                                                 \
@@ -81,7 +127,23 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
     prefix##_it_p  prefix##_start(prefix##_p hash);                             \
     prefix##_it_p  prefix##_next(prefix##_p hash, prefix##_it_p it);            \
     void           prefix##_remove(prefix##_p hash, prefix##_it_p it);          \
+                                                                                \
+    size_t         prefix##_storage_size(uint32_t capacity);
 
+#define SH_GEN_DECL(prefix, key_t, value_t)                                     \
+    typedef struct {                                                            \
+        uint32_t hash_and_flags;                                                \
+        key_t key;                                                              \
+        value_t value;                                                          \
+    } prefix##_slot_t, *prefix##_slot_p, *prefix##_it_p;                        \
+    SH_GEN_TABLE_DECL(prefix, key_t, value_t)
+
+#define SH_GEN_GROUP_DECL(prefix, key_t, value_t)                               \
+    typedef struct {                                                            \
+        key_t key;                                                              \
+        value_t value;                                                          \
+    } prefix##_slot_t, *prefix##_slot_p, *prefix##_it_p;                        \
+    SH_GEN_TABLE_DECL(prefix, key_t, value_t)
 
 
 #endif // SLIM_HASH_HEADER
@@ -90,15 +152,17 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
 
 #ifdef SLIM_HASH_IMPLEMENTATION
     
+// Both get the context of the hash (see sh_new_with_context()), e.g. to
+// allocate the slots from a specific heap
 #ifndef SLIM_HASH_CALLOC
-#define SLIM_HASH_CALLOC calloc
+#define SLIM_HASH_CALLOC(context, length, size) calloc(length, size)
 #endif
 
 #ifndef SLIM_HASH_FREE
-#define SLIM_HASH_FREE free
+#define SLIM_HASH_FREE(context, ptr) free(ptr)
 #endif
 
-#define SH_GEN_DEF(prefix, key_t, value_t, hash_expr, key_cmp_expr, key_put_expr, key_del_expr)  \
+#define SH_GEN_MURMUR3_DEF(prefix)                                                \
     /**                                                                          \
      * Get 32-bit Murmur3 hash of a memory block. Taken from                     \
      * https://github.com/wolkykim/qlibc/blob/master/src/utilities/qhash.c       \
@@ -160,8 +224,11 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
         h ^= h >> 16;                                                            \
                                                                                  \
         return h;                                                                \
-    }                                                                            \
-                                                                                 \
+    }
+
+#define SH_GEN_DEF(prefix, key_t, value_t, hash_expr, key_cmp_expr, key_put_expr, key_del_expr)  \
+    SH_GEN_MURMUR3_DEF(prefix)                                                                          \
+                                                                                                        \
     bool prefix##_resize(prefix##_p hashmap, uint32_t new_capacity) {                                   \
         /* on filling empty slot: if exceeding load factor, double capacity                             \
         // on deleting slot: if to empty, half capacity                                                 \
@@ -174,7 +241,8 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
         new_hashmap.length = 0;                                                                         \
         new_hashmap.capacity = new_capacity;                                                            \
         new_hashmap.deleted = 0;                                                                        \
-        new_hashmap.slots = SLIM_HASH_CALLOC(new_hashmap.capacity, sizeof(new_hashmap.slots[0]));       \
+        new_hashmap.context = hashmap->context;                                                         \
+        new_hashmap.slots = SLIM_HASH_CALLOC(new_hashmap.context, new_hashmap.capacity, sizeof(new_hashmap.slots[0]));  \
                                                                                                         \
         /* Failed to allocate memory for new hash map, leave the original untouched */                  \
         if (new_hashmap.slots == NULL)                                                                  \
@@ -184,26 +252,31 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
             prefix##_put(&new_hashmap, it->key, it->value);                                             \
         }                                                                                               \
                                                                                                         \
-        SLIM_HASH_FREE(hashmap->slots);                                                                 \
+        SLIM_HASH_FREE(hashmap->context, hashmap->slots);                                               \
         *hashmap = new_hashmap;                                                                         \
         return true;                                                                                    \
     }                                                                                                   \
                                                                                                         \
-    void prefix##_new(prefix##_p hashmap) {      \
-        hashmap->length = 0;                     \
-        hashmap->capacity = 0;                   \
-        hashmap->deleted = 0;                    \
-        hashmap->slots = NULL;                   \
-        prefix##_resize(hashmap, 8);             \
-    }                                            \
-                                                 \
-    void prefix##_destroy(prefix##_p hashmap) {  \
-        hashmap->length = 0;                     \
-        hashmap->capacity = 0;                   \
-        hashmap->deleted = 0;                    \
-        SLIM_HASH_FREE(hashmap->slots);          \
-        hashmap->slots = NULL;                   \
-    }                                            \
+    void prefix##_new_with_context(prefix##_p hashmap, void* context) {  \
+        hashmap->length = 0;                                             \
+        hashmap->capacity = 0;                                           \
+        hashmap->deleted = 0;                                            \
+        hashmap->slots = NULL;                                           \
+        hashmap->context = context;                                      \
+        prefix##_resize(hashmap, 8);                                     \
+    }                                                                    \
+                                                                         \
+    void prefix##_new(prefix##_p hashmap) {                              \
+        prefix##_new_with_context(hashmap, NULL);                        \
+    }                                                                    \
+                                                                         \
+    void prefix##_destroy(prefix##_p hashmap) {                          \
+        hashmap->length = 0;                                             \
+        hashmap->capacity = 0;                                           \
+        hashmap->deleted = 0;                                            \
+        SLIM_HASH_FREE(hashmap->context, hashmap->slots);                \
+        hashmap->slots = NULL;                                           \
+    }                                                                    \
                                                  \
     value_t* prefix##_put_ptr(prefix##_p hashmap, key_t key) {                                                                          \
         /* add the +1 to the capacity doubling to avoid beeing stuck on a capacity of 0 */                                              \
@@ -325,6 +398,10 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
     void prefix##_optimize(prefix##_p hashmap) {      \
         prefix##_resize(hashmap, hashmap->capacity);  \
     }                                                 \
+                                                      \
+    size_t prefix##_storage_size(uint32_t capacity) { \
+        return capacity * sizeof(prefix##_slot_t);    \
+    }                                                 \
 
 
 #define SH_GEN_HASH_DEF(prefix, key_t, value_t)  \
@@ -333,4 +410,218 @@ SH_GEN_HASH_DEF(con_list, int32_t, void*)
              SH_GEN_DEF(prefix, key_t, value_t, prefix##_murmur3_32(key, strlen(key)), (strcmp(a, b) == 0), strdup(key), (free((void*)key), NULL))
 
 
+/* Group layout with control bytes, see the top of the file */
+#define SH_GEN_GROUP_DEF(prefix, key_t, value_t, hash_expr, key_cmp_expr, key_put_expr, key_del_expr)           \
+    SH_GEN_MURMUR3_DEF(prefix)                                                                                  \
+                                                                                                                \
+    /* The control bytes follow the slots */                                                                    \
+    static inline uint8_t* prefix##_ctrl(prefix##_p hashmap) {                                                  \
+        return (uint8_t*)(hashmap->slots + hashmap->capacity);                                                  \
+    }                                                                                                           \
+                                                                                                                \
+    /* Groups are probed in triangular steps. With a power of two groups                                        \
+    // that visits each group once. Returns NULL if the key isn't there. */                                     \
+    static inline prefix##_slot_p prefix##_find_slot(prefix##_p hashmap, key_t key, uint32_t hash) {            \
+        uint32_t mask = hashmap->capacity - 1;                                                                  \
+        uint32_t group = (hash >> 7) & mask & ~(SH_GROUP_WIDTH - 1);                                            \
+        uint8_t* ctrl = prefix##_ctrl(hashmap);                                                                 \
+        for(uint32_t probed = 0; probed < hashmap->capacity; probed += SH_GROUP_WIDTH) {                        \
+            uint32_t matches = sh_group_match(ctrl + group, hash & 0x7F);                                       \
+            while (matches != 0) {                                                                              \
+                uint32_t index = group + __builtin_ctz(matches);                                                \
+                key_t a = hashmap->slots[index].key;                                                            \
+                key_t b = key;                                                                                  \
+                if (key_cmp_expr)                                                                               \
+                    return &hashmap->slots[index];                                                              \
+                matches &= matches - 1;                                                                         \
+            }                                                                                                   \
+                                                                                                                \
+            /* An empty slot ends the probe sequence, the key would be there */                                 \
+            if (sh_group_match(ctrl + group, SH_CTRL_EMPTY) != 0)                                               \
+                return NULL;                                                                                    \
+            group = (group + probed + SH_GROUP_WIDTH) & mask;                                                   \
+        }                                                                                                       \
+        return NULL;                                                                                            \
+    }                                                                                                           \
+                                                                                                                \
+    /* First empty or deleted slot in the probe sequence of the hash. Takes                                     \
+    // the slot and returns it. */                                                                              \
+    static inline prefix##_slot_p prefix##_take_slot(prefix##_p hashmap, uint32_t hash) {                       \
+        uint32_t mask = hashmap->capacity - 1;                                                                  \
+        uint32_t group = (hash >> 7) & mask & ~(SH_GROUP_WIDTH - 1);                                            \
+        uint8_t* ctrl = prefix##_ctrl(hashmap);                                                                 \
+        for(uint32_t probed = 0; probed < hashmap->capacity; probed += SH_GROUP_WIDTH) {                        \
+            uint32_t free_slots = sh_group_match_free(ctrl + group);                                            \
+            if (free_slots != 0) {                                                                              \
+                uint32_t index = group + __builtin_ctz(free_slots);                                             \
+                if (ctrl[index] == SH_CTRL_DELETED)                                                             \
+                    hashmap->deleted--;                                                                         \
+                ctrl[index] = hash & 0x7F;                                                                      \
+                hashmap->length++;                                                                              \
+                return &hashmap->slots[index];                                                                  \
+            }                                                                                                   \
+            group = (group + probed + SH_GROUP_WIDTH) & mask;                                                   \
+        }                                                                                                       \
+        return NULL;                                                                                            \
+    }                                                                                                           \
+                                                                                                                \
+    bool prefix##_resize(prefix##_p hashmap, uint32_t new_capacity) {                                           \
+        uint32_t capacity = SH_GROUP_WIDTH;                                                                     \
+        while (capacity < new_capacity)                                                                         \
+            capacity *= 2;                                                                                      \
+                                                                                                                \
+        /* Can't make hashmap smaller than it needs to be */                                                    \
+        if ((uint64_t)hashmap->length * 8 > (uint64_t)capacity * 7)                                             \
+            return false;                                                                                       \
+                                                                                                                \
+        prefix##_t new_hashmap;                                                                                 \
+        new_hashmap.length = 0;                                                                                 \
+        new_hashmap.capacity = capacity;                                                                        \
+        new_hashmap.deleted = 0;                                                                                \
+        new_hashmap.context = hashmap->context;                                                                 \
+        new_hashmap.slots = SLIM_HASH_CALLOC(new_hashmap.context, capacity, sizeof(new_hashmap.slots[0]) + 1);  \
+                                                                                                                \
+        /* Failed to allocate memory for new hash map, leave the original untouched */                          \
+        if (new_hashmap.slots == NULL)                                                                          \
+            return false;                                                                                       \
+        memset(prefix##_ctrl(&new_hashmap), SH_CTRL_EMPTY, capacity);                                           \
+                                                                                                                \
+        /* Keys are moved over as they are, key_put_expr was already applied */                                 \
+        for(prefix##_it_p it = prefix##_start(hashmap); it != NULL; it = prefix##_next(hashmap, it)) {          \
+            key_t key = it->key;                                                                                \
+            *prefix##_take_slot(&new_hashmap, (hash_expr)) = *it;                                               \
+        }                                                                                                       \
+                                                                                                                \
+        SLIM_HASH_FREE(hashmap->context, hashmap->slots);                                                       \
+        *hashmap = new_hashmap;                                                                                 \
+        return true;                                                                                            \
+    }                                                                                                           \
+                                                                                                                \
+    void prefix##_new_with_context(prefix##_p hashmap, void* context) {                                         \
+        hashmap->length = 0;                                                                                    \
+        hashmap->capacity = 0;                                                                                  \
+        hashmap->deleted = 0;                                                                                   \
+        hashmap->slots = NULL;                                                                                  \
+        hashmap->context = context;                                                                             \
+        prefix##_resize(hashmap, SH_GROUP_WIDTH);                                                               \
+    }                                                                                                           \
+                                                                                                                \
+    void prefix##_new(prefix##_p hashmap) {                                                                     \
+        prefix##_new_with_context(hashmap, NULL);                                                               \
+    }                                                                                                           \
+                                                                                                                \
+    void prefix##_destroy(prefix##_p hashmap) {                                                                 \
+        for(prefix##_it_p it = prefix##_start(hashmap); it != NULL; it = prefix##_next(hashmap, it)) {          \
+            key_t key = it->key;                                                                                \
+            key = key; /* avoid unused variable warning */                                                      \
+            it->key = (key_del_expr);                                                                           \
+        }                                                                                                       \
+        hashmap->length = 0;                                                                                    \
+        hashmap->capacity = 0;                                                                                  \
+        hashmap->deleted = 0;                                                                                   \
+        SLIM_HASH_FREE(hashmap->context, hashmap->slots);                                                       \
+        hashmap->slots = NULL;                                                                                  \
+    }                                                                                                           \
+                                                                                                                \
+    value_t* prefix##_put_ptr(prefix##_p hashmap, key_t key) {                                                  \
+        uint32_t hash = (hash_expr);                                                                            \
+        if (hashmap->capacity > 0) {                                                                            \
+            prefix##_slot_p slot = prefix##_find_slot(hashmap, key, hash);                                      \
+            if (slot != NULL)                                                                                   \
+                return &slot->value;                                                                            \
+        }                                                                                                       \
+                                                                                                                \
+        /* Keep at least 1/8 of the slots empty. Rehash in place if deleted                                     \
+        // slots take up most of the room. */                                                                   \
+        if ((uint64_t)(hashmap->length + hashmap->deleted + 1) * 8 > (uint64_t)hashmap->capacity * 7) {         \
+            if ((uint64_t)(hashmap->length + 1) * 32 > (uint64_t)hashmap->capacity * 25)                        \
+                prefix##_resize(hashmap, hashmap->capacity * 2);                                                \
+            else                                                                                                \
+                prefix##_resize(hashmap, hashmap->capacity);                                                    \
+        }                                                                                                       \
+                                                                                                                \
+        prefix##_slot_p slot = prefix##_take_slot(hashmap, hash);                                               \
+        slot->key = (key_put_expr);                                                                             \
+        return &slot->value;                                                                                    \
+    }                                                                                                           \
+                                                                                                                \
+    value_t* prefix##_get_ptr(prefix##_p hashmap, key_t key) {                                                  \
+        if (hashmap->capacity == 0)                                                                             \
+            return NULL;                                                                                        \
+        prefix##_slot_p slot = prefix##_find_slot(hashmap, key, (hash_expr));                                   \
+        return (slot != NULL) ? &slot->value : NULL;                                                            \
+    }                                                                                                           \
+                                                                                                                \
+    void prefix##_remove(prefix##_p hashmap, prefix##_it_p it) {                                                \
+        if (it != NULL && it >= hashmap->slots && it - hashmap->slots < hashmap->capacity) {                    \
+            key_t key = it->key;                                                                                \
+            key = key; /* avoid unused variable warning */                                                      \
+            it->key = (key_del_expr);                                                                           \
+            prefix##_ctrl(hashmap)[it - hashmap->slots] = SH_CTRL_DELETED;                                      \
+                                                                                                                \
+            hashmap->length--;                                                                                  \
+            hashmap->deleted++;                                                                                 \
+        }                                                                                                       \
+    }                                                                                                           \
+                                                                                                                \
+    bool prefix##_del(prefix##_p hashmap, key_t key) {                                                          \
+        if (hashmap->capacity == 0)                                                                             \
+            return false;                                                                                       \
+        prefix##_slot_p slot = prefix##_find_slot(hashmap, key, (hash_expr));                                   \
+        if (slot == NULL)                                                                                       \
+            return false;                                                                                       \
+                                                                                                                \
+        prefix##_remove(hashmap, slot);                                                                         \
+        if (hashmap->capacity > SH_GROUP_WIDTH && hashmap->length < hashmap->capacity * 0.2)                    \
+            prefix##_resize(hashmap, hashmap->capacity / 2);                                                    \
+        return true;                                                                                            \
+    }                                                                                                           \
+                                                                                                                \
+    void prefix##_put(prefix##_p hashmap, key_t key, value_t value) {                                           \
+        *prefix##_put_ptr(hashmap, key) = value;                                                                \
+    }                                                                                                           \
+                                                                                                                \
+    value_t prefix##_get(prefix##_p hashmap, key_t key, value_t default_value) {                                \
+        value_t* value_ptr = prefix##_get_ptr(hashmap, key);                                                    \
+        return (value_ptr) ? *value_ptr : default_value;                                                        \
+    }                                                                                                           \
+                                                                                                                \
+    bool prefix##_contains(prefix##_p hashmap, key_t key) {                                                     \
+        return (prefix##_get_ptr(hashmap, key) != NULL);                                                        \
+    }                                                                                                           \
+                                                                                                                \
+    prefix##_it_p prefix##_start(prefix##_p hashmap) {                                                          \
+        /* We need to start at an invalid slot address since sh_next() increments it                            \
+        // before it looks at it (so it's safe). */                                                             \
+        if (hashmap->slots == NULL)                                                                             \
+            return NULL;                                                                                        \
+        return prefix##_next(hashmap, hashmap->slots - 1);                                                      \
+    }                                                                                                           \
+                                                                                                                \
+    prefix##_it_p prefix##_next(prefix##_p hashmap, prefix##_it_p it) {                                         \
+        if (it == NULL)                                                                                         \
+            return NULL;                                                                                        \
+                                                                                                                \
+        uint8_t* ctrl = prefix##_ctrl(hashmap);                                                                 \
+        for(uint32_t index = it - hashmap->slots + 1; index < hashmap->capacity; index++) {                     \
+            if ( !(ctrl[index] & SH_CTRL_EMPTY) )                                                               \
+                return &hashmap->slots[index];                                                                  \
+        }                                                                                                       \
+        return NULL;                                                                                            \
+    }                                                                                                           \
+                                                                                                                \
+    void prefix##_optimize(prefix##_p hashmap) {                                                                \
+        prefix##_resize(hashmap, hashmap->capacity);                                                            \
+    }                                                                                                           \
+                                                                                                                \
+    size_t prefix##_storage_size(uint32_t capacity) {                                                           \
+        return capacity * (sizeof(prefix##_slot_t) + 1);                                                        \
+    }
+
+#define SH_GEN_GROUP_HASH_DEF(prefix, key_t, value_t)  \
+             SH_GEN_GROUP_DEF(prefix, key_t, value_t, prefix##_murmur3_32(&key, sizeof(key)), (a == b), key, 0)
+#define SH_GEN_GROUP_DICT_DEF(prefix, key_t, value_t)  \
+             SH_GEN_GROUP_DEF(prefix, key_t, value_t, prefix##_murmur3_32(key, strlen(key)), (strcmp(a, b) == 0), strdup(key), (free((void*)key), NULL))
+
+
 #endif // SLIM_HASH_IMPLEMENTATION
\ No newline at end of file
@@ -30,14 +30,24 @@ lvm_atom_p lvm_read(lvm_p lvm, FILE* input) {
 			return lvm_str_atom(lvm, str);
 		case '(':
 			return lvm_read_list(lvm, input);
-		case '\'':
-			return lvm_pair_atom(lvm,
+		case '\'': {
+			// Quoted literals are constants, put them into the immortal space
+			// so the collector never has to look at them again
+#			ifdef GC_REGION_BAKER
+			uint16_t prev_site = lvm_gc_enter_immortal_site(lvm);
+#			endif
+			lvm_atom_p quote = lvm_pair_atom(lvm,
 				lvm_sym_atom(lvm, "quote"),
 				lvm_pair_atom(lvm,
 					lvm_read(lvm, input),
 					lvm_nil_atom(lvm)
 				)
 			);
+#			ifdef GC_REGION_BAKER
+			lvm_gc_leave_alloc_site(lvm, prev_site);
+#			endif
+			return quote;
+		}
 		default:
 			ungetc(c, input);
 			break;
@@ -90,7 +100,7 @@ static int lvm_next_char_after_whitespaces(FILE* input) {
 
 
 void lvm_print(lvm_p lvm, FILE* output, lvm_atom_p atom) {
-	switch(atom->type) {
+	switch(lvm_atom_type(atom)) {
 		case LVM_T_NIL:
 			fprintf(output, "nil");
 			break;
@@ -111,15 +121,15 @@ void lvm_print(lvm_p lvm, FILE* output, lvm_atom_p atom) {
 			break;
 		case LVM_T_PAIR:
 			fprintf(output, "(");
-			while(atom->type == LVM_T_PAIR) {
-				lvm_print(lvm, output, atom->first);
-				if (atom->rest->type != LVM_T_NIL && atom->rest->type != LVM_T_PAIR) {
+			while(lvm_atom_type(atom) == LVM_T_PAIR) {
+				lvm_print(lvm, output, lvm_pair_first(atom));
+				if (lvm_atom_type(lvm_pair_rest(atom)) != LVM_T_NIL && lvm_atom_type(lvm_pair_rest(atom)) != LVM_T_PAIR) {
 					fprintf(output, " . ");
-					lvm_print(lvm, output, atom->rest);
-				} else if (atom->rest->type == LVM_T_PAIR) {
+					lvm_print(lvm, output, lvm_pair_rest(atom));
+				} else if (lvm_atom_type(lvm_pair_rest(atom)) == LVM_T_PAIR) {
 					fprintf(output, " ");
 				}
-				atom = atom->rest;
+				atom = lvm_pair_rest(atom);
 			}
 			fprintf(output, ")");
 			break;
@@ -133,9 +143,9 @@ void lvm_print(lvm_p lvm, FILE* output, lvm_atom_p atom) {
 			fprintf(output, "(lambda ");
 			lvm_print(lvm, output, atom->args);
 			fprintf(output, " ");
-			for(lvm_atom_p expr = atom->body; expr->type == LVM_T_PAIR; expr = expr->rest) {
-				lvm_print(lvm, output, expr->first);
-				if (expr->rest->type == LVM_T_PAIR)
+			for(lvm_atom_p expr = atom->body; lvm_atom_type(expr) == LVM_T_PAIR; expr = lvm_pair_rest(expr)) {
+				lvm_print(lvm, output, lvm_pair_first(expr));
+				if (lvm_atom_type(lvm_pair_rest(expr)) == LVM_T_PAIR)
 					fprintf(output, " ");
 			}
 			fprintf(output, ")");
@@ -143,9 +153,17 @@ void lvm_print(lvm_p lvm, FILE* output, lvm_atom_p atom) {
 		case LVM_T_ERROR:
 			fprintf(output, "error(%s)\n", atom->str);
 			break;
+		case LVM_T_WEAK:
+			fprintf(output, "weak(");
+			lvm_print(lvm, output, atom->target);
+			fprintf(output, ")");
+			break;
+		case LVM_T_WEAK_TABLE:
+			fprintf(output, "weak-table(%u)", atom->length);
+			break;
 		
 		default:
-			fprintf(output, "unknown(%d)\n", atom->type);
+			fprintf(output, "unknown(%d)\n", lvm_atom_type(atom));
 			break;
 	}
 }
\ No newline at end of file
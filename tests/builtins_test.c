@@ -75,10 +75,18 @@ void test_builtins() {
 		{ "(define make_adder (lambda (n) (lambda (m) (+ n m)) ))", "(lambda (n) (lambda (m) (+ n m)))" },
 		{ "(define add10 (make_adder 10))", "(lambda (m) (+ n m))" },
 		{ "(add10 3)", "13" },
+		
+		// Weak references and weak tables
+		{ "(weak-get (weak 1))", "1" },
+		{ "(define t (weak-table))", "weak-table(0)" },
+		{ "(weak-table-put t (quote k) 5)", "5" },
+		{ "(weak-table-get t (quote k))", "5" },
+		{ "(weak-table-get t (quote j))", "nil" },
+		{ "t", "weak-table(1)" },
 	};
 	
 	
-	lvm_p lvm = lvm_new();
+	lvm_p lvm = lvm_new(NULL);
 	lvm_env_p env = lvm_base_env(lvm);
 	
 	char* out_stream_ptr = NULL;
@@ -108,7 +116,7 @@ void test_builtins() {
 			out_stream_size = 0;
 		} else {
 			// We expect an error atom with an error message
-			st_check_int(result->type, LVM_T_ERROR);
+			st_check_int(lvm_atom_type(result), LVM_T_ERROR);
 			st_check_not_null(result->str);
 		}
 	}
@@ -6,6 +6,9 @@
 #include "slim_test.h"
 
 #include "../lvm.h"
+#ifdef GC_REGION_BAKER
+#	include "../internals.h"
+#endif
 
 lvm_atom_p lvm_c_read(lvm_p lvm, FILE* input);
 void lvm_c_print(lvm_p lvm, FILE* output, lvm_atom_p atom);
@@ -85,7 +88,7 @@ void test_syntax() {
 	
 	char* out_stream_ptr = NULL;
 	size_t out_stream_size = 0;
-	lvm_p lvm = lvm_new();
+	lvm_p lvm = lvm_new(NULL);
 	
 	for(size_t i = 0; i < (sizeof(test_cases) / sizeof(test_cases[0])); i++) {
 		char* in = test_cases[i].in;
@@ -113,8 +116,40 @@ void test_syntax() {
 	lvm_destroy(lvm);
 }
 
+#ifdef GC_REGION_BAKER
+static bool is_immortal(lvm_p lvm, lvm_atom_p atom) {
+	lvm_gc_region_p region = lvm_gc_region_of(&lvm->gc.heap, atom);
+	return region != NULL && region->space == &lvm->gc.uncollected;
+}
+#endif
+
+// Quoted lists are constants, the reader puts all of them into the immortal
+// space. Only checked when memory.c was built with GC_REGION_BAKER.
+void test_quoted_lists_are_immortal() {
+#	ifdef GC_REGION_BAKER
+	lvm_p lvm = lvm_new(NULL);
+	
+	char* in = "[a, [b], \"c\"]";
+	FILE* in_stream = fmemopen(in, strlen(in), "r");
+		lvm_atom_p quote = lvm_c_read(lvm, in_stream);
+	fclose(in_stream);
+	
+	st_check_not_null(quote);
+	lvm_atom_p list = lvm_pair_first(lvm_pair_rest(quote));
+	st_check(is_immortal(lvm, quote));
+	st_check(is_immortal(lvm, lvm_pair_rest(quote)));
+	for(lvm_atom_p pair = list; lvm_atom_type(pair) == LVM_T_PAIR; pair = lvm_pair_rest(pair)) {
+		st_check(is_immortal(lvm, pair));
+		st_check(is_immortal(lvm, lvm_pair_first(pair)));
+	}
+	
+	lvm_destroy(lvm);
+#	endif
+}
+
 
 int main() {
 	st_run(test_syntax);
+	st_run(test_quoted_lists_are_immortal);
 	return st_show_report();
 }
\ No newline at end of file
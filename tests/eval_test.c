@@ -33,7 +33,7 @@ void test_eval_rules() {
 	};
 	
 	
-	lvm_p lvm = lvm_new();
+	lvm_p lvm = lvm_new(NULL);
 	lvm_env_p env = lvm_env_new(lvm, NULL);
 	lvm_env_put(lvm, env, "a", lvm_num_atom(lvm, 17));
 	lvm_atom_p builtin_atom = lvm_builtin_atom(lvm, builtin_test_func);
@@ -69,18 +69,18 @@ void test_eval_rules() {
 }
 
 void test_error_cases() {
-	lvm_p lvm = lvm_new();
+	lvm_p lvm = lvm_new(NULL);
 	lvm_env_p env = lvm_env_new(lvm, NULL);
 	lvm_atom_p builtin_atom = lvm_builtin_atom(lvm, builtin_test_func);
 	lvm_env_put(lvm, env, "builtin", builtin_atom);
 	
 	// Symbols without binding eval to an error atom
 	lvm_atom_p result = lvm_eval(lvm, lvm_sym_atom(lvm, "x"), env);
-	st_check_int(result->type, LVM_T_ERROR);
+	st_check_int(lvm_atom_type(result), LVM_T_ERROR);
 	
 	// Builtins eval to an error atom
 	result = lvm_eval(lvm, builtin_atom, env);
-	st_check_int(result->type, LVM_T_ERROR);
+	st_check_int(lvm_atom_type(result), LVM_T_ERROR);
 	
 	// Lists eval to calls to builtins
 	size_t old_builtin_call_count = builtin_call_count;
@@ -98,7 +98,7 @@ void test_error_cases() {
 	
 	old_builtin_call_count = builtin_call_count;
 		result = lvm_eval(lvm, ast, env);
-	st_check_int(result->type, LVM_T_ERROR);
+	st_check_int(lvm_atom_type(result), LVM_T_ERROR);
 	st_check_int(builtin_call_count, old_builtin_call_count);
 	
 	lvm_env_destroy(lvm, env);
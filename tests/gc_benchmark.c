@@ -0,0 +1,95 @@
+/**
+
+Measures how fast the GC copies a heap where atoms point all over the place.
+Following those pointers touches pages in random order which makes the copy
+phase sensitive to TLB misses. Each configuration is run with normal pages and
+with transparent huge pages.
+
+**/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+
+#include "../gc.c"
+
+
+static double ms_since(struct timespec start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+/**
+ * Builds a balanced binary tree of pairs with number atoms as leaves. The pairs
+ * are linked in shuffled order so neighbors in the tree are usually far apart in
+ * memory. A tree keeps the recursion depth of the collector small.
+ */
+static lvm_atom_p build_shuffled_tree(lvm_p lvm, size_t pair_count) {
+	lvm_atom_p* pairs = malloc(pair_count * sizeof(pairs[0]));
+	for(size_t i = 0; i < pair_count; i++)
+		pairs[i] = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	
+	for(size_t i = pair_count - 1; i > 0; i--) {
+		size_t j = rand() % (i + 1);
+		lvm_atom_p temp = pairs[i];
+		pairs[i] = pairs[j];
+		pairs[j] = temp;
+	}
+	
+	for(size_t i = 0; i < pair_count; i++) {
+		lvm_atom_p children[2];
+		for(size_t c = 0; c < 2; c++) {
+			size_t child_index = 2 * i + 1 + c;
+			if (child_index < pair_count) {
+				children[c] = pairs[child_index];
+			} else {
+				children[c] = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+				children[c]->num = child_index;
+			}
+		}
+		lvm_pair_set_first(pairs[i], children[0]);
+		lvm_pair_set_rest(pairs[i], children[1]);
+	}
+	
+	lvm_atom_p root = pairs[0];
+	free(pairs);
+	return root;
+}
+
+static void run_benchmark(const char* name, size_t region_size, bool huge_pages, size_t pair_count, size_t rounds) {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_region_size = region_size, .gc_huge_pages = huge_pages });
+	
+	size_t live_bytes = pair_count * lvm_gc_atom_infos[LVM_T_PAIR].size + (pair_count + 1) * lvm_gc_atom_infos[LVM_T_NUM].size;
+	double total_ms = 0;
+	
+	srand(42);
+	for(size_t i = 0; i < rounds; i++) {
+		lvm_atom_p root = build_shuffled_tree(lvm, pair_count);
+		
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ &root, NULL }, (lvm_env_p[]){ NULL });
+		total_ms += ms_since(start);
+	}
+	
+	bool got_huge_pages = (lvm->gc.new_space.first != NULL && (lvm->gc.new_space.first->flags & LVM_GC_HUGE_PAGES));
+	double ms_per_collect = total_ms / rounds;
+	printf("%-28s %4zu MiByte regions, huge pages %-3s: %8.2lfms per collect, %8.2lf MiByte/s copied\n",
+		name, lvm->gc.region_size / (1024*1024), got_huge_pages ? "yes" : "no",
+		ms_per_collect, (live_bytes / (1024.0*1024.0)) / (ms_per_collect / 1000.0));
+	
+	lvm_gc_cleanup(lvm);
+}
+
+
+int main() {
+	size_t pair_count = 1024 * 1024;
+	size_t rounds = 5;
+	
+	run_benchmark("shuffled tree, 2 MiByte", 2*1024*1024, false, pair_count, rounds);
+	run_benchmark("shuffled tree, 2 MiByte", 2*1024*1024, true,  pair_count, rounds);
+	run_benchmark("shuffled tree, default", 0, false, pair_count, rounds);
+	run_benchmark("shuffled tree, default", 0, true,  pair_count, rounds);
+	
+	return 0;
+}
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <unistd.h>
 
 #define SLIM_TEST_IMPLEMENTATION
 #include "slim_test.h"
@@ -8,7 +9,7 @@
 
 
 void test_gc_init_and_cleanup() {
-	lvm_p lvm = lvm_gc_init();
+	lvm_p lvm = lvm_gc_init(NULL);
 	
 	st_check_not_null(lvm);
 	st_check_not_null(lvm->nil_atom);
@@ -19,24 +20,27 @@ void test_gc_init_and_cleanup() {
 }
 
 void test_gc_alloc() {
-	lvm_p lvm = lvm_gc_init();
+	lvm_p lvm = lvm_gc_init(NULL);
 	
 	// Allo atom without data
 	lvm_atom_p num_atom = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
 	st_check_not_null(num_atom);
-	st_check_msg(num_atom == (void*)lvm->gc.new_space.last + sizeof(lvm_gc_region_t), "num atom wasn't allocated where it should be");
-	st_check_int(num_atom->type, LVM_T_NUM);
+	st_check_int(lvm_atom_type(num_atom), LVM_T_NUM);
 	
-	st_check_not_null(lvm->gc.new_space.last);
-	st_check(lvm->gc.new_space.first == lvm->gc.new_space.last);
-	
-	// Alloc atom with data
-	size_t data_size = 13;
+	// Alloc atom with data (data sizes are rounded up to 8 bytes)
+	size_t data_size = 16;
 	lvm_atom_p str_atom = lvm_gc_alloc_atom(lvm, LVM_T_STR);
 	st_check_not_null(str_atom);
-	st_check_msg(str_atom == (void*)num_atom + lvm_gc_atom_infos[LVM_T_NUM].size, "str atom wasn't allocated where it should be");
 	str_atom->str = lvm_gc_alloc_data(lvm, data_size);
+	st_check_not_null(lvm->gc.new_space.last);
+	
+	// With LVM_BIBOP numbers are in a page of their own instead
+#	ifndef LVM_BIBOP
+	st_check_msg(num_atom == (void*)lvm->gc.new_space.last + sizeof(lvm_gc_region_t), "num atom wasn't allocated where it should be");
+	st_check(lvm->gc.new_space.first == lvm->gc.new_space.last);
+	st_check_msg(str_atom == (void*)num_atom + lvm_gc_atom_infos[LVM_T_NUM].size, "str atom wasn't allocated where it should be");
 	st_check_msg(str_atom->str == (void*)lvm->gc.new_space.last + LVM_GC_REGION_SIZE - data_size, "str data wasn't allocated where it should be");
+#	endif
 	
 	// Fill up one space to force allocation in a new region
 	while ( lvm->gc.new_space.last->free_bytes > 4*1024 ) {
@@ -55,13 +59,15 @@ void test_gc_alloc() {
 	st_check_int(lvm->gc.collect_on_next_possibility, true);
 	st_check_not_null(lvm->gc.new_space.last);
 	st_check(lvm->gc.new_space.first != lvm->gc.new_space.last);
+#	ifndef LVM_BIBOP
 	st_check(lvm->gc.new_space.first->next == lvm->gc.new_space.last);
+#	endif
 	
 	lvm_gc_cleanup(lvm);
 }
 
 void test_gc_collect() {
-	lvm_p lvm = lvm_gc_init();
+	lvm_p lvm = lvm_gc_init(NULL);
 	
 	// Allocate some atoms we want to survive
 	lvm_atom_p atom_a = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
@@ -77,8 +83,8 @@ void test_gc_collect() {
 	
 	lvm_atom_p atom_c = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
 	st_check_not_null(atom_c);
-	atom_c->first = atom_a;
-	atom_c->rest = atom_b;
+	lvm_pair_set_first(atom_c, atom_a);
+	lvm_pair_set_rest(atom_c, atom_b);
 	
 	// Allocate about 32 MiByte of garbage
 	for(size_t i = 0; i < 1024 * 8; i++) {
@@ -97,23 +103,1451 @@ void test_gc_collect() {
 		NULL
 	});
 	
-	st_check_int(atom_a->type, LVM_T_NUM);
+	st_check_int(lvm_atom_type(atom_a), LVM_T_NUM);
 	st_check_int(atom_a->num, 13);
 	
-	st_check_int(atom_b->type, LVM_T_STR);
+	st_check_int(lvm_atom_type(atom_b), LVM_T_STR);
 	st_check_str(atom_b->str, str_b);
 	
-	st_check_int(atom_c->type, LVM_T_PAIR);
-	st_check(atom_c->first == atom_a);
-	st_check(atom_c->rest == atom_b);
+	st_check_int(lvm_atom_type(atom_c), LVM_T_PAIR);
+	st_check(lvm_pair_first(atom_c) == atom_a);
+	st_check(lvm_pair_rest(atom_c) == atom_b);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_large_atoms() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	
+	// Allocate a string large enough to get its own region
+	size_t data_size = 4*1024*1024;
+	char* data = NULL;
+	lvm_atom_p large_atom = lvm_gc_alloc(lvm, LVM_T_STR, data_size, (void**)&data);
+	st_check_not_null(large_atom);
+	st_check_not_null(data);
+	memset(data, 'x', data_size - 1);
+	data[data_size - 1] = '\0';
+	large_atom->str = data;
+	
+	st_check_null(lvm->gc.new_space.first);
+	st_check_not_null(lvm->gc.large_space.first);
+	st_check(lvm->gc.large_space.first == lvm->gc.large_space.last);
+	st_check_msg(large_atom == (void*)lvm->gc.large_space.first + sizeof(lvm_gc_region_t), "large atom wasn't allocated where it should be");
+	st_check(lvm->gc.large_space.first->flags & LVM_GC_DONT_MOVE);
+	
+	// A pair pointing to the large atom, it should be moved while the large atom stays
+	lvm_atom_p pair_atom = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(pair_atom, large_atom);
+	lvm_pair_set_rest(pair_atom, large_atom);
+	
+	lvm_atom_p large_garbage = lvm_gc_alloc(lvm, LVM_T_STR, data_size, (void**)&data);
+	st_check_not_null(large_garbage);
+	st_check(lvm->gc.large_space.first->next == lvm->gc.large_space.last);
+	
+	lvm_atom_p old_large_atom = large_atom;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){
+		&large_atom,
+		&pair_atom,
+		NULL
+	}, (lvm_env_p[]){
+		NULL
+	});
+	
+	st_check(large_atom == old_large_atom);
+	st_check(large_atom->str == (void*)lvm->gc.large_space.first + lvm->gc.large_space.first->size_in_64k_chunks * LVM_GC_64K - data_size);
+	st_check_int(lvm_atom_type(large_atom), LVM_T_STR);
+	st_check_int(strlen(large_atom->str), data_size - 1);
+	st_check(lvm_pair_first(pair_atom) == large_atom);
+	st_check(lvm_pair_rest(pair_atom) == large_atom);
+	
+	// Only the reached large atom should be left in the large space
+	st_check_not_null(lvm->gc.large_space.first);
+	st_check(lvm->gc.large_space.first == lvm->gc.large_space.last);
+	st_check_null(lvm->gc.old_large_space.first);
+	
+	// Without any roots the large atom is garbage, too
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	st_check_null(lvm->gc.large_space.first);
+	st_check_null(lvm->gc.large_space.last);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_large_atoms_promoted_on_collect() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	
+	// A string built from an atom and separate data ends up in the new space
+	// even when it's large
+	size_t data_size = lvm->gc.region_size / 8;
+	lvm_atom_p str = lvm_gc_alloc_atom(lvm, LVM_T_STR);
+	char* data = lvm_gc_alloc_data(lvm, data_size);
+	memset(data, 'x', data_size - 1);
+	data[data_size - 1] = '\0';
+	str->str = data;
+	st_check_null(lvm->gc.large_space.first);
+	
+	// The first collection moves it into the large space
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &str, NULL }, (lvm_env_p[]){ NULL });
+	st_check_not_null(lvm->gc.large_space.first);
+	st_check(lvm->gc.large_space.first == lvm->gc.large_space.last);
+	st_check(str == (void*)lvm->gc.large_space.first + sizeof(lvm_gc_region_t));
+	st_check_int(lvm_atom_type(str), LVM_T_STR);
+	st_check_int(strlen(str->str), data_size - 1);
+	
+	// After that it stays where it is and isn't copied again
+	lvm_atom_p promoted_str = str;
+	size_t bytes_copied = lvm->gc.stats.bytes_copied;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &str, NULL }, (lvm_env_p[]){ NULL });
+	st_check(str == promoted_str);
+	st_check_int(lvm->gc.stats.bytes_copied, bytes_copied);
+	st_check_int(strlen(str->str), data_size - 1);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_region_pool() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	lvm->gc.region_pool_low_watermark = 1;
+	lvm->gc.region_pool_high_watermark = 2;
+	
+	// Allocate about 32 MiByte of garbage, that should fill 2 regions and start a third one
+	for(size_t i = 0; i < 1024 * 8; i++) {
+		lvm_atom_p garbage_atom = lvm_gc_alloc_atom(lvm, LVM_T_STR);
+		garbage_atom->str = lvm_gc_alloc_data(lvm, 4*1024);
+	}
+	lvm_gc_region_p first_region = lvm->gc.new_space.first;
+	st_check(first_region->next != NULL && first_region->next->next != NULL);
+	
+	// All 3 regions end up in the pool. Since that's above the high watermark
+	// the pool is trimmed down to the low watermark.
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	st_check_null(lvm->gc.new_space.first);
+	st_check_null(lvm->gc.old_space.first);
+	st_check_int(lvm->gc.region_pool_length, 1);
+	st_check(lvm->gc.region_pool.first == lvm->gc.region_pool.last);
+	
+	// The next allocation should reuse the pooled region
+	lvm_gc_region_p pooled_region = lvm->gc.region_pool.first;
+	lvm_atom_p num_atom = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	st_check(lvm->gc.new_space.first == pooled_region);
+#	ifndef LVM_BIBOP
+	st_check_msg(num_atom == (void*)pooled_region + sizeof(lvm_gc_region_t), "num atom wasn't allocated at the start of the pooled region");
+	st_check_int(pooled_region->free_bytes, LVM_GC_REGION_SIZE - sizeof(lvm_gc_region_t) - lvm_gc_atom_infos[LVM_T_NUM].size);
+#	endif
+	st_check_int(lvm->gc.region_pool_length, 0);
+	st_check_null(lvm->gc.region_pool.first);
+	st_check_null(lvm->gc.region_pool.last);
+	
+	// Survivors are copied into pooled regions as well, within the high
+	// watermark nothing is given back to the OS
+	num_atom->num = 7;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &num_atom, NULL }, (lvm_env_p[]){ NULL });
+	st_check_int(num_atom->num, 7);
+	st_check_int(lvm->gc.region_pool_length, 1);
+	st_check(lvm->gc.region_pool.first == pooled_region);
 	
 	lvm_gc_cleanup(lvm);
 }
 
+void test_gc_region_options() {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_region_size = 3*1024*1024, .gc_huge_pages = true });
+	
+	// Region sizes are rounded up to the next 2 MiByte boundary. LVM_BIBOP
+	// always uses regions of one page.
+#	ifdef LVM_BIBOP
+	size_t region_size = LVM_BIBOP_PAGE_SIZE;
+#	else
+	size_t region_size = 4*1024*1024;
+#	endif
+	st_check_int(lvm->gc.region_size, region_size);
+	st_check_int(lvm->gc.uncollected.first->size_in_64k_chunks * LVM_GC_64K, region_size);
+	
+	lvm_atom_p num_atom = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	st_check_not_null(num_atom);
+	st_check_int(lvm->gc.new_space.first->size_in_64k_chunks * LVM_GC_64K, region_size);
+	
+	// All regions start at a 2 MiByte boundary
+	st_check_int((size_t)lvm->gc.uncollected.first % LVM_GC_REGION_ALIGNMENT, 0);
+	st_check_int((size_t)lvm->gc.new_space.first % LVM_GC_REGION_ALIGNMENT, 0);
+	
+	// The large atom threshold follows the region size
+	void* data = NULL;
+	lvm_atom_p large_atom = lvm_gc_alloc(lvm, LVM_T_STR, 512*1024, &data);
+	st_check(large_atom == (void*)lvm->gc.large_space.first + sizeof(lvm_gc_region_t));
+	st_check_int((size_t)lvm->gc.large_space.first % LVM_GC_REGION_ALIGNMENT, 0);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_reserved_heap() {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_heap_size = 64*1024*1024, .gc_region_size = 2*1024*1024 });
+	lvm_gc_heap_p heap = &lvm->gc.heap;
+	st_check_int(heap->size, 64*1024*1024);
+	st_check_int(heap->chunk_count, 32);
+	
+	// Regions are carved out of the heap one after the other
+	lvm_atom_p num_atom = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	void* data = NULL;
+	lvm_atom_p large_atom = lvm_gc_alloc(lvm, LVM_T_STR, 3*1024*1024, &data);
+	st_check(lvm->gc.uncollected.first == heap->base);
+	st_check((void*)lvm->gc.new_space.first == heap->base + 2*1024*1024);
+	st_check((void*)lvm->gc.large_space.first == heap->base + 4*1024*1024);
+	st_check_int(lvm_gc_heap_find_free_chunks(heap, 1), 4);
+	
+	// Any pointer into the heap leads to its region and space
+	st_check(lvm_gc_region_of(heap, lvm) == lvm->gc.uncollected.first);
+	st_check(lvm_gc_region_of(heap, num_atom) == lvm->gc.new_space.first);
+	st_check(lvm_gc_region_of(heap, data + 3*1024*1024 - 1) == lvm->gc.large_space.first);
+	st_check_null(lvm_gc_region_of(heap, heap->base + 8*1024*1024));
+	st_check_null(lvm_gc_region_of(heap, &heap));
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.new_space, num_atom));
+	st_check(!lvm_gc_space_contains(lvm, &lvm->gc.old_space, num_atom));
+	st_check(lvm_gc_find_large_atom_region(lvm, &lvm->gc.large_space, large_atom) == lvm->gc.large_space.first);
+	
+	// The survivor got copied into a fresh region after the large atom. Then
+	// the evacuated region went into the pool and the garbage large atom gave
+	// its chunks back to the heap.
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &num_atom, NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.new_space, num_atom));
+	st_check(lvm_gc_region_of(heap, num_atom) == heap->base + 8*1024*1024);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.region_pool, heap->base + 2*1024*1024));
+	st_check_int(lvm_gc_heap_find_free_chunks(heap, 1), 2);
+	st_check_null(lvm_gc_region_of(heap, data));
+	
+	// Runs of free chunks are found even if they start in the gap the large
+	// atom left behind
+	st_check_int(lvm_gc_heap_find_free_chunks(heap, 2), 2);
+	st_check_int(lvm_gc_heap_find_free_chunks(heap, 3), 5);
+	st_check_int(lvm_gc_heap_find_free_chunks(heap, 27), 5);
+	st_check_int(lvm_gc_heap_find_free_chunks(heap, 28), SIZE_MAX);
+	
+	// An exhausted heap is left to the caller
+	st_check_null(lvm_gc_allocate_region(heap, 64*1024*1024, 0));
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_exact_atom_sizes() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	
+	st_check_int(lvm_gc_atom_infos[LVM_T_NIL].size, 8);
+	
+	// With LVM_BIBOP numbers and pairs are headerless and go into pages of
+	// their own, see test_gc_bibop_pages()
+#	ifndef LVM_BIBOP
+	st_check_int(lvm_gc_atom_infos[LVM_T_NUM].size, 16);
+	// Compressed references halve the first and rest fields of pairs
+#	ifdef LVM_COMPRESSED_REFS
+	size_t pair_size = 16;
+#	else
+	size_t pair_size = 24;
+#	endif
+	st_check_int(lvm_gc_atom_infos[LVM_T_PAIR].size, pair_size);
+	
+	// The inline fast path bumps the free pointer by the exact size of each type
+	lvm_atom_p num_atom = lvm_gc_alloc_atom_inline(lvm, LVM_T_NUM);
+	lvm_atom_p pair_atom = lvm_gc_alloc_atom_inline(lvm, LVM_T_PAIR);
+	lvm_atom_p sym_atom = lvm_gc_alloc_atom_inline(lvm, LVM_T_SYM);
+	st_check_int(lvm_atom_type(num_atom), LVM_T_NUM);
+	st_check_int(lvm_atom_type(pair_atom), LVM_T_PAIR);
+	st_check_int(lvm_atom_type(sym_atom), LVM_T_SYM);
+	st_check(pair_atom == (void*)num_atom + 16);
+	st_check(sym_atom == (void*)pair_atom + pair_size);
+	st_check_int(lvm->gc.new_space.last->free_offset, sizeof(lvm_gc_region_t) + 16 + pair_size + 16);
+#	endif
+	
+	// Data is allocated in multiples of 8 bytes so atoms and data stay aligned
+	void* data = lvm_gc_alloc_data(lvm, 3);
+	st_check_int((size_t)data % 8, 0);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_stats() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	lvm_gc_stats_t stats;
+	
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.collections, 0);
+	st_check_int(stats.bytes_allocated, 0);
+	st_check_int(stats.uncollected_regions, 1);
+	st_check_int(stats.new_space_regions, 0);
+	
+	// One atom that survives and 3 that don't
+	lvm_atom_p survivor = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	survivor->num = 1;
+	for(size_t i = 0; i < 3; i++)
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = 0;
+	
+	lvm_gc_stats(lvm, &stats);
+	size_t num_size = lvm_gc_atom_infos[LVM_T_NUM].size;
+	st_check_int(stats.bytes_allocated, 4 * num_size);
+	st_check_int(stats.new_space_regions, 1);
+	
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &survivor, NULL }, (lvm_env_p[]){ NULL });
+	
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.collections, 1);
+	st_check_int(stats.bytes_copied, num_size);
+	st_check_float(stats.last_survival_rate, 0.25, 0.001);
+	st_check_float(stats.average_survival_rate, 0.25, 0.001);
+	st_check(stats.max_pause_ms > 0);
+	st_check(stats.total_pause_ms >= stats.max_pause_ms);
+	
+	size_t pauses_in_histogram = 0;
+	for(size_t i = 0; i < LVM_GC_PAUSE_HISTOGRAM_BUCKETS; i++)
+		pauses_in_histogram += stats.pause_histogram[i];
+	st_check_int(pauses_in_histogram, 1);
+	
+	// The old region went into the pool
+	st_check_int(stats.new_space_regions, 1);
+	st_check_int(stats.pooled_regions, 1);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+
+void test_gc_heap_dump() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	
+	// A list of two numbers bound in an env and one surviving string
+	lvm_atom_p list = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(list, lvm_gc_alloc_atom(lvm, LVM_T_NUM));
+	lvm_pair_set_rest(list, lvm_gc_alloc_atom(lvm, LVM_T_PAIR));
+	lvm_pair_set_first(lvm_pair_rest(list), lvm_gc_alloc_atom(lvm, LVM_T_NUM));
+	lvm_pair_set_rest(lvm_pair_rest(list), lvm->nil_atom);
+	lvm_env_p env = lvm_env_new(lvm, NULL);
+	lvm_env_put(lvm, env, "list", list);
+	
+	lvm_atom_p str = lvm_gc_alloc_atom(lvm, LVM_T_STR);
+	str->str = lvm_gc_alloc_data(lvm, 8);
+	strcpy(str->str, "1234567");
+	
+	char *census = NULL, *graph = NULL;
+	size_t census_size = 0, graph_size = 0;
+	FILE* census_file = open_memstream(&census, &census_size);
+	FILE* graph_file = open_memstream(&graph, &graph_size);
+	lvm_gc_heap_dump(lvm, census_file, graph_file, (lvm_atom_p*[]){ &str, NULL }, (lvm_env_p[]){ env, NULL });
+	fclose(census_file);
+	fclose(graph_file);
+	
+	size_t pair_size = lvm_gc_atom_infos[LVM_T_PAIR].size, num_size = lvm_gc_atom_infos[LVM_T_NUM].size;
+	size_t nil_size = lvm_gc_atom_infos[LVM_T_NIL].size, str_size = lvm_gc_atom_infos[LVM_T_STR].size + 8;
+	
+	char line[128];
+	snprintf(line, sizeof(line), "%-24s %10zu bytes\n", "list", 2 * pair_size + 2 * num_size + nil_size);
+	st_check_not_null(strstr(census, line));
+	snprintf(line, sizeof(line), "%-24s %10d atoms %10zu bytes\n", "pair", 2, 2 * pair_size);
+	st_check_not_null(strstr(census, line));
+	snprintf(line, sizeof(line), "%-24s %10d atoms %10zu bytes\n", "str", 1, str_size);
+	st_check_not_null(strstr(census, line));
+	snprintf(line, sizeof(line), "%-24s %10d atoms %10zu bytes\n", "total", 6, 2 * pair_size + 2 * num_size + nil_size + str_size);
+	st_check_not_null(strstr(census, line));
+	
+	snprintf(line, sizeof(line), "root binding list %p\n", (void*)list);
+	st_check_not_null(strstr(graph, line));
+	snprintf(line, sizeof(line), "atom %p pair %zu %p %p\n", (void*)list, pair_size, (void*)lvm_pair_first(list), (void*)lvm_pair_rest(list));
+	st_check_not_null(strstr(graph, line));
+	snprintf(line, sizeof(line), "root surviver 0 %p\n", (void*)str);
+	st_check_not_null(strstr(graph, line));
+	
+	free(census);
+	free(graph);
+	lvm_env_destroy(lvm, env);
+	lvm_gc_cleanup(lvm);
+}
+
+
+void test_gc_handle_scopes() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	
+	lvm_handle_scope_t outer_scope = lvm_handle_scope_open(lvm);
+	lvm_atom_p kept = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	kept->num = 17;
+	lvm_handle(lvm, &kept);
+	
+	lvm_handle_scope_t inner_scope = lvm_handle_scope_open(lvm);
+	lvm_atom_p temp = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	temp->num = 42;
+	lvm_handle(lvm, &temp);
+	
+	// Both variables are roots and get patched to the copied atoms
+	lvm_atom_p kept_before = kept, temp_before = temp;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	st_check(kept != kept_before);
+	st_check(temp != temp_before);
+	st_check_int(kept->num, 17);
+	st_check_int(temp->num, 42);
+	
+	// Closing the inner scope releases only its handle
+	lvm_handle_scope_close(lvm, inner_scope);
+	st_check_int(lvm->handle_stack_length, 1);
+	size_t bytes_copied_before = lvm->gc.stats.bytes_copied;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	st_check_int(lvm->gc.stats.bytes_copied - bytes_copied_before, lvm_gc_atom_infos[LVM_T_NUM].size);
+	st_check_int(kept->num, 17);
+	
+	lvm_handle_scope_close(lvm, outer_scope);
+	st_check_int(lvm->handle_stack_length, 0);
+	
+	free(lvm->handle_stack_ptr);
+	lvm_gc_cleanup(lvm);
+}
+
+
+void test_gc_mark_compact() {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_region_size = 2*1024*1024, .gc_mark_compact = true });
+	
+	// A list of strings spread over several regions with garbage in between.
+	// Every 4th string allocates its data separately so it may end up in the
+	// next region.
+	size_t length = 100000;
+	lvm_atom_p list = lvm->nil_atom;
+	for(size_t i = 0; i < length; i++) {
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = i;
+		
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "string %zu", i);
+		lvm_atom_p str = NULL;
+		if (i % 4 == 0) {
+			str = lvm_gc_alloc_atom(lvm, LVM_T_STR);
+			str->str = lvm_gc_alloc_data(lvm, strlen(buffer) + 1);
+		} else {
+			void* data_ptr = NULL;
+			str = lvm_gc_alloc(lvm, LVM_T_STR, strlen(buffer) + 1, &data_ptr);
+			str->str = data_ptr;
+		}
+		strcpy(str->str, buffer);
+		
+		lvm_atom_p garbage_str = NULL;
+		void* garbage_data = NULL;
+		garbage_str = lvm_gc_alloc(lvm, LVM_T_STR, 64, &garbage_data);
+		garbage_str->str = garbage_data;
+		strcpy(garbage_str->str, "garbage");
+		
+		lvm_atom_p pair = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+		lvm_pair_set_first(pair, str);
+		lvm_pair_set_rest(pair, list);
+		list = pair;
+	}
+	
+	size_t regions_before = lvm_gc_count_regions_of_space(&lvm->gc.new_space);
+	size_t used_before = lvm_gc_used_bytes_of_space(&lvm->gc.new_space);
+	lvm_atom_p list_before = list;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, NULL }, (lvm_env_p[]){ NULL });
+	
+	// No old space was needed and the garbage is gone
+	st_check_null(lvm->gc.old_space.first);
+	st_check(lvm_gc_count_regions_of_space(&lvm->gc.new_space) < regions_before);
+	size_t live_bytes = length * (lvm_gc_atom_infos[LVM_T_PAIR].size + lvm_gc_atom_infos[LVM_T_STR].size);
+	for(size_t i = 0; i < length; i++) {
+		char buffer[32];
+		live_bytes += LVM_GC_ALIGN(snprintf(buffer, sizeof(buffer), "string %zu", i) + 1);
+	}
+	st_check_int(lvm_gc_used_bytes_of_space(&lvm->gc.new_space), live_bytes);
+	st_check(lvm_gc_used_bytes_of_space(&lvm->gc.new_space) < used_before);
+	st_check(list != list_before);
+	
+	size_t i = length;
+	for(lvm_atom_p pair = list; pair != lvm->nil_atom; pair = lvm_pair_rest(pair)) {
+		i--;
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "string %zu", i);
+		if ( lvm_atom_type(pair) != LVM_T_PAIR || lvm_atom_type(lvm_pair_first(pair)) != LVM_T_STR || strcmp(lvm_pair_first(pair)->str, buffer) != 0 ) {
+			st_check_msg(false, "element %zu is broken", i);
+			break;
+		}
+	}
+	st_check_int(i, 0);
+	
+	// New atoms are allocated after the compacted ones and a second collection
+	// doesn't move anything
+	lvm_atom_p num = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	num->num = 42;
+	size_t bytes_copied_before = lvm->gc.stats.bytes_copied;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, &num, NULL }, (lvm_env_p[]){ NULL });
+	st_check_int(lvm->gc.stats.bytes_copied, bytes_copied_before);
+	st_check_int(num->num, 42);
+	st_check_int(lvm->gc.stats.collections, 2);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+
+static lvm_atom_p build_num_list(lvm_p lvm, size_t length) {
+	lvm_atom_p list = lvm->nil_atom;
+	for(size_t i = 0; i < length; i++) {
+		lvm_atom_p pair = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+		lvm_pair_set_first(pair, lvm_gc_alloc_atom(lvm, LVM_T_NUM));
+		lvm_pair_first(pair)->num = i;
+		lvm_pair_set_rest(pair, list);
+		list = pair;
+	}
+	return list;
+}
+
+#ifdef LVM_BIBOP
+void test_gc_bibop_pages() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	st_check_int(lvm->gc.region_size, LVM_BIBOP_PAGE_SIZE);
+	st_check_int(lvm_gc_atom_infos[LVM_T_NUM].size, 8);
+	
+	// Numbers and pairs go into pages of their type, everything else into the
+	// last region of the space
+	lvm_atom_p num = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	num->num = 42;
+	lvm_atom_p other_num = lvm_gc_alloc_atom_inline(lvm, LVM_T_NUM);
+	other_num->num = 43;
+	void* data_ptr = NULL;
+	lvm_atom_p str = lvm_gc_alloc(lvm, LVM_T_STR, 6, &data_ptr);
+	str->str = data_ptr;
+	strcpy(str->str, "hello");
+	lvm_atom_p pair = lvm_gc_alloc_atom_inline(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(pair, num);
+	lvm_pair_set_rest(pair, lvm_pair_atom(lvm, str, lvm_pair_atom(lvm, num, lvm->nil_atom)));
+	
+	lvm_gc_region_p num_page = lvm->gc.new_space.pages[LVM_T_NUM];
+	st_check_not_null(num_page);
+	st_check_int(num_page->atom_type, LVM_T_NUM);
+	st_check(lvm_gc_page_of(num) == num_page);
+	st_check(lvm_gc_page_of(pair) == lvm->gc.new_space.pages[LVM_T_PAIR]);
+	st_check(lvm_gc_page_of(str) == lvm->gc.new_space.last);
+	st_check_int(lvm->gc.new_space.last->atom_type, LVM_T_MAX);
+	st_check_int(lvm_atom_type(num), LVM_T_NUM);
+	st_check_int(lvm_atom_type(pair), LVM_T_PAIR);
+	st_check_int(lvm_atom_type(str), LVM_T_STR);
+	st_check_int(lvm_atom_type(lvm->nil_atom), LVM_T_NIL);
+	
+	// Headerless atoms are packed right after each other
+	st_check((void*)num + LVM_ATOM_HEADER_SIZE == (void*)num_page + lvm_gc_page_atoms_offset(8));
+	st_check(other_num == (void*)num + 8);
+	st_check_int(other_num->num, 43);
+	st_check_int(num->num, 42);
+	
+	// The collector copies them into pages of the new space. The number shared
+	// by two pairs is only copied once.
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &pair, NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm_gc_page_of(pair) != num_page && lvm_gc_page_of(lvm_pair_first(pair)) != num_page);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.new_space, pair));
+	st_check_int(lvm_atom_type(pair), LVM_T_PAIR);
+	st_check_int(lvm_atom_type(lvm_pair_first(pair)), LVM_T_NUM);
+	st_check_int(lvm_pair_first(pair)->num, 42);
+	st_check_str(lvm_pair_first(lvm_pair_rest(pair))->str, "hello");
+	st_check(lvm_pair_first(lvm_pair_rest(lvm_pair_rest(pair))) == lvm_pair_first(pair));
+	st_check(lvm_pair_rest(lvm_pair_rest(lvm_pair_rest(pair))) == lvm->nil_atom);
+	size_t pair_size = lvm_gc_atom_infos[LVM_T_PAIR].size;
+	st_check_int(lvm_gc_used_bytes_of_space(&lvm->gc.new_space), 3 * pair_size + 8 + lvm_gc_atom_infos[LVM_T_STR].size + 8);
+	
+	// Numbers that don't fit into one page spread over several pages of the
+	// new space and survive intact
+	size_t count = LVM_BIBOP_PAGE_SIZE / 8 + 1000;
+	lvm_atom_p* nums = malloc(count * sizeof(nums[0]));
+	lvm_atom_p** roots = malloc((count + 1) * sizeof(roots[0]));
+	for(size_t i = 0; i < count; i++) {
+		nums[i] = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+		nums[i]->num = i;
+		roots[i] = &nums[i];
+	}
+	roots[count] = NULL;
+	lvm_gc_collect(lvm, roots, (lvm_env_p[]){ NULL });
+	st_check_int(lvm_gc_count_regions_of_space(&lvm->gc.new_space), 2);
+	st_check_int(lvm_gc_used_bytes_of_space(&lvm->gc.new_space), count * 8);
+	size_t intact = 0;
+	for(size_t i = 0; i < count; i++) {
+		if (lvm_atom_type(nums[i]) == LVM_T_NUM && nums[i]->num == (int64_t)i)
+			intact++;
+	}
+	st_check_int(intact, count);
+	free(roots);
+	free(nums);
+	
+	lvm_gc_cleanup(lvm);
+}
+#endif
+
+void test_gc_adaptive_heap_sizing() {
+	size_t region_size = 2*1024*1024;
+	size_t list_length = 40000;
+	lvm_gc_stats_t stats;
+	
+	// The throughput policy starts with a budget of 2 regions, adding the
+	// second region doesn't trigger a collection yet
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_region_size = region_size, .gc_policy = LVM_GC_POLICY_THROUGHPUT });
+	while ( lvm_gc_count_regions_of_space(&lvm->gc.new_space) < 2 )
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = 0;
+	st_check_int(lvm->gc.collect_on_next_possibility, false);
+	while ( lvm_gc_count_regions_of_space(&lvm->gc.new_space) < 3 )
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = 0;
+	st_check_int(lvm->gc.collect_on_next_possibility, true);
+	
+	// With a 5% overhead target we can allocate 19 times the live bytes
+	lvm_atom_p list = build_num_list(lvm, list_length);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, NULL }, (lvm_env_p[]){ NULL });
+	lvm_gc_stats(lvm, &stats);
+	size_t live_bytes = lvm_gc_used_bytes_of_space(&lvm->gc.new_space);
+	st_check(live_bytes >= list_length * (lvm_gc_atom_infos[LVM_T_PAIR].size + lvm_gc_atom_infos[LVM_T_NUM].size));
+	st_check_int(lvm->gc.collect_on_next_possibility, false);
+	st_check(stats.allocation_budget >= live_bytes * 19 - 1 && stats.allocation_budget <= live_bytes * 19);
+	size_t budget_regions = (stats.allocation_budget + region_size - 1) / region_size;
+	st_check_int(lvm->gc.region_pool_low_watermark, budget_regions);
+	st_check_int(lvm->gc.region_pool_high_watermark, 2 * budget_regions);
+	size_t throughput_budget = stats.allocation_budget;
+	lvm_gc_cleanup(lvm);
+	
+	// The latency policy aims for 25% overhead, a budget of 3 times the live
+	// bytes but at least one region (the list is smaller than that with
+	// LVM_BIBOP and compressed references)
+	lvm = lvm_gc_init(&(lvm_options_t){ .gc_region_size = region_size, .gc_policy = LVM_GC_POLICY_LATENCY });
+	list = build_num_list(lvm, list_length);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, NULL }, (lvm_env_p[]){ NULL });
+	lvm_gc_stats(lvm, &stats);
+	live_bytes = lvm_gc_used_bytes_of_space(&lvm->gc.new_space);
+	size_t latency_budget = (live_bytes * 3 > region_size) ? live_bytes * 3 : region_size;
+	st_check(stats.allocation_budget >= latency_budget - 1 && stats.allocation_budget <= latency_budget);
+	st_check(stats.allocation_budget < throughput_budget);
+	
+	// Without survivors the budget drops to its minimum of one region
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.allocation_budget, region_size);
+	st_check_int(lvm->gc.region_pool_low_watermark, 1);
+	lvm_gc_cleanup(lvm);
+}
+
+
+static void write_file(const char* dir, const char* name, const char* content) {
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE* file = fopen(path, "w");
+	fputs(content, file);
+	fclose(file);
+}
+
+void test_gc_cgroup_limits() {
+	char cgroup_dir[] = "/tmp/lvm_gc_test_cgroup_XXXXXX";
+	st_check_not_null(mkdtemp(cgroup_dir));
+	size_t region_size = 2*1024*1024;
+	lvm_gc_stats_t stats;
+	
+	// No limit
+	write_file(cgroup_dir, "memory.max", "max\n");
+	write_file(cgroup_dir, "memory.current", "41943040\n");
+	write_file(cgroup_dir, "memory.pressure", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_region_size = region_size, .gc_policy = LVM_GC_POLICY_THROUGHPUT, .gc_cgroup_path = cgroup_dir });
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.memory_limit, 0);
+	st_check_int(lvm->gc.cgroup_headroom, SIZE_MAX);
+	
+	// 24 MiByte headroom, enough for the initial budget of 2 regions
+	write_file(cgroup_dir, "memory.max", "67108864\n");
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.memory_limit, 64*1024*1024);
+	st_check_int(lvm->gc.cgroup_headroom, 24*1024*1024);
+	lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = 0;
+	st_check_int(lvm->gc.collect_on_next_possibility, false);
+	
+	// The files aren't read again for every new region, only after
+	// LVM_GC_CGROUP_READ_INTERVAL allocated bytes
+	write_file(cgroup_dir, "memory.current", "64000000\n");
+	while ( lvm_gc_count_regions_of_space(&lvm->gc.new_space) < 2 )
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = 0;
+	st_check_int(lvm->gc.cgroup_headroom, 24*1024*1024);
+	
+	// Close to the limit every new region triggers a collection
+	while (lvm->gc.stats.bytes_allocated - lvm->gc.bytes_allocated_at_last_collect < 2 * LVM_GC_CGROUP_READ_INTERVAL)
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = 0;
+	st_check_int(lvm->gc.cgroup_headroom, 67108864 - 64000000);
+	st_check_int(lvm->gc.collect_on_next_possibility, true);
+	
+	// Under memory pressure the pool is emptied
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm->gc.region_pool_length > 0);
+	write_file(cgroup_dir, "memory.pressure", "some avg10=25.00 avg60=5.00 avg300=1.00 total=12345\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+	lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = 0;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	lvm_gc_stats(lvm, &stats);
+	st_check_float(stats.memory_pressure, 25.0, 0.001);
+	st_check_int(lvm->gc.region_pool_length, 0);
+	st_check_null(lvm->gc.region_pool.first);
+	
+	lvm_gc_cleanup(lvm);
+	
+	const char* names[] = { "memory.max", "memory.current", "memory.pressure" };
+	for(size_t i = 0; i < 3; i++) {
+		char path[256];
+		snprintf(path, sizeof(path), "%s/%s", cgroup_dir, names[i]);
+		unlink(path);
+	}
+	rmdir(cgroup_dir);
+}
+
+
+void test_gc_pretenuring() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	lvm_gc_stats_t stats;
+	
+	// Everything the builtin allocates survives while the unknown site only
+	// allocates garbage
+	struct lvm_atom_s builtin = { .type = LVM_T_BUILTIN };
+	uint16_t prev_site = lvm_gc_enter_alloc_site(lvm, &builtin);
+	st_check_int(builtin.call_site, 2);
+	lvm_atom_p list = build_num_list(lvm, 20000);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	st_check_int(list->alloc_site, 2);
+	for(size_t i = 0; i < 20000; i++)
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = i;
+	
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, NULL }, (lvm_env_p[]){ NULL });
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.pretenured_sites, 1);
+	st_check_int(lvm->gc.alloc_sites[2].pretenure, true);
+	st_check_int(lvm->gc.alloc_sites[0].pretenure, false);
+	st_check_int(list->alloc_site, 0);
+	
+	// Now the builtin allocates into the tenured space
+	prev_site = lvm_gc_enter_alloc_site(lvm, &builtin);
+	lvm_atom_p tenured_pair = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, tenured_pair));
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.tenured_regions, 1);
+	
+	// Tenured atoms never move but keep the atoms they reference alive
+	lvm_pair_set_first(tenured_pair, lvm_gc_alloc_atom(lvm, LVM_T_NUM));
+	lvm_pair_first(tenured_pair)->num = 42;
+	lvm_pair_set_rest(tenured_pair, list);
+	lvm_atom_p num_before = lvm_pair_first(tenured_pair);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm_pair_first(tenured_pair) != num_before);
+	st_check_int(lvm_pair_first(tenured_pair)->num, 42);
+	st_check_int(lvm_atom_type(lvm_pair_first(lvm_pair_rest(tenured_pair))), LVM_T_NUM);
+	st_check_int(lvm_pair_first(lvm_pair_rest(tenured_pair))->num, 19999);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_major_collections() {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_region_size = 2*1024*1024 });
+	lvm_gc_stats_t stats;
+	
+	// Pretenure the builtin as in test_gc_pretenuring()
+	struct lvm_atom_s builtin = { .type = LVM_T_BUILTIN };
+	uint16_t prev_site = lvm_gc_enter_alloc_site(lvm, &builtin);
+	lvm_atom_p list = build_num_list(lvm, 20000);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm->gc.alloc_sites[2].pretenure);
+	
+	// Tenured atoms: A pinned one, a list we keep and a dead pair that
+	// references a new atom. The garbage in between puts the pinned pair into
+	// another region than the others.
+	prev_site = lvm_gc_enter_alloc_site(lvm, &builtin);
+	lvm_atom_p pinned = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	build_num_list(lvm, 100000);
+	lvm_atom_p kept = build_num_list(lvm, 100);
+	lvm_atom_p dead = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, pinned));
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, kept));
+	st_check(lvm_gc_region_of(&lvm->gc.heap, pinned) != lvm_gc_region_of(&lvm->gc.heap, dead));
+	
+	lvm_pair_set_first(pinned, lvm->nil_atom);
+	lvm_pair_set_rest(pinned, lvm->nil_atom);
+	lvm_pin(lvm, pinned);
+	lvm_atom_p weak = lvm_gc_alloc_atom(lvm, LVM_T_WEAK);
+	weak->target = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	weak->target->num = 42;
+	lvm_pair_set_first(dead, weak->target);
+	lvm_pair_set_rest(dead, lvm->nil_atom);
+	
+	// Now the site only allocates garbage. A major collection reclaims the
+	// tenured space once it grew by its budget and demotes the site, so the
+	// tenured space stays bounded.
+	size_t max_tenured_regions = 0;
+	for(size_t i = 0; i < 30; i++) {
+		prev_site = lvm_gc_enter_alloc_site(lvm, &builtin);
+		build_num_list(lvm, 20000);
+		lvm_gc_leave_alloc_site(lvm, prev_site);
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, &kept, &weak, NULL }, (lvm_env_p[]){ NULL });
+		lvm_gc_stats(lvm, &stats);
+		if (stats.tenured_regions > max_tenured_regions)
+			max_tenured_regions = stats.tenured_regions;
+	}
+	st_check_int(stats.major_collections, 1);
+	st_check_int(stats.demoted_sites, 1);
+	st_check_int(stats.pretenured_sites, 0);
+	st_check(!lvm->gc.alloc_sites[2].pretenure);
+	st_check(max_tenured_regions <= LVM_GC_MAJOR_MIN_BUDGET_REGIONS + 2);
+	st_check(stats.tenured_regions <= 2);
+	
+	// The dead pair no longer keeps its new atom alive, the live atoms survived
+	// and the pinned one stayed where it was
+	st_check(weak->target == lvm->nil_atom);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, kept));
+	st_check_int(lvm_pair_first(kept)->num, 99);
+	st_check_int(lvm_pair_first(lvm_pair_rest(kept))->num, 98);
+	st_check_int(lvm_pair_first(list)->num, 19999);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, pinned));
+	st_check(lvm_pair_first(pinned) == lvm->nil_atom);
+	
+	// The site allocates into the new space again
+	prev_site = lvm_gc_enter_alloc_site(lvm, &builtin);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.new_space, lvm_gc_alloc_atom(lvm, LVM_T_PAIR)));
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	
+	lvm_unpin(lvm, pinned);
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_tenure() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	lvm_env_p env = lvm_env_new(lvm, NULL);
+	lvm_env_put(lvm, env, "list", build_num_list(lvm, 1000));
+	char* data = NULL;
+	lvm_atom_p large = lvm_gc_alloc_large(lvm, LVM_T_STR, 16, (void**)&data);
+	strcpy(data, "large");
+	large->str = data;
+	lvm_env_put(lvm, env, "large", large);
+	for(size_t i = 0; i < 1000; i++)
+		lvm_gc_alloc_atom(lvm, LVM_T_NUM)->num = i;
+	
+	// Everything reachable from env ends up in the tenured space
+	lvm_gc_tenure(lvm, env);
+	lvm_atom_p list = lvm_env_get(lvm, env, "list");
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, list));
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, lvm_pair_first(list)));
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, large));
+	st_check_null(lvm->gc.new_space.first);
+	st_check_null(lvm->gc.large_space.first);
+	
+	// New atoms referenced by tenured ones are still collected, the tenured
+	// ones stay where they are with both collectors
+	lvm_atom_p num = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	num->num = 42;
+	lvm_pair_set_first(list, num);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ env, NULL });
+	lvm->gc.mark_compact = true;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ env, NULL });
+	st_check(lvm_env_get(lvm, env, "list") == list);
+	st_check(lvm_env_get(lvm, env, "large") == large);
+	st_check_str(large->str, "large");
+	st_check(lvm_pair_first(list) != num);
+	st_check_int(lvm_pair_first(list)->num, 42);
+	st_check_int(lvm_pair_first(lvm_pair_rest(list))->num, 998);
+	
+	lvm_env_destroy(lvm, env);
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_allocation_profiler() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	// In the heap, with LVM_BIBOP lvm_atom_type() only works for atoms there
+	lvm_atom_p outer = lvm_gc_alloc_atom(lvm, LVM_T_LAMBDA), cons = lvm_gc_alloc_atom(lvm, LVM_T_BUILTIN), anonymous = lvm_gc_alloc_atom(lvm, LVM_T_LAMBDA);
+	lvm_env_p env = lvm_env_new(lvm, NULL);
+	lvm_env_put(lvm, env, "outer", outer);
+	lvm_env_put(lvm, env, "cons", cons);
+	
+	// Without the profiler the call stack isn't maintained. A function
+	// entered before lvm_profile_start() can be left afterwards.
+	uint16_t outer_prev_site = lvm_gc_enter_alloc_site(lvm, outer);
+	st_check_int(lvm->gc.profile.call_depth, 0);
+	lvm_profile_start(lvm, 1024);
+	lvm_gc_leave_alloc_site(lvm, outer_prev_site);
+	st_check_int(lvm->gc.profile.call_depth, 0);
+	
+	// Every allocated KiByte is one sample, a larger allocation covers several
+	lvm_gc_alloc_data(lvm, 1024);
+	outer_prev_site = lvm_gc_enter_alloc_site(lvm, outer);
+	lvm_gc_alloc_data(lvm, 2048);
+	uint16_t prev_site = lvm_gc_enter_alloc_site(lvm, cons);
+	for(size_t i = 0; i < 3; i++)
+		lvm_gc_alloc_data(lvm, 1024);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	prev_site = lvm_gc_enter_alloc_site(lvm, anonymous);
+	lvm_gc_alloc_data(lvm, 1024);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	lvm_gc_leave_alloc_site(lvm, outer_prev_site);
+	st_check_int(lvm->gc.profile.call_depth, 0);
+	
+	// The fast path takes a sample on the first allocation after an interval
+	// is full
+	size_t num_size = lvm_gc_atom_infos[LVM_T_NUM].size;
+	for(size_t i = 0; i < 4096 / num_size + 1; i++)
+		lvm_gc_alloc_atom_inline(lvm, LVM_T_NUM);
+	
+	lvm_profile_stop(lvm);
+	lvm_gc_alloc_data(lvm, 4096);
+	
+	char* profile = NULL;
+	size_t profile_size = 0;
+	FILE* profile_file = open_memstream(&profile, &profile_size);
+	lvm_profile_write(lvm, profile_file, env);
+	fclose(profile_file);
+	
+	char line[128];
+	st_check_not_null(strstr(profile, "toplevel 5120\n"));
+	st_check_not_null(strstr(profile, "outer 2048\n"));
+	st_check_not_null(strstr(profile, "outer;cons 3072\n"));
+	snprintf(line, sizeof(line), "outer;lambda#%u 1024\n", anonymous->call_site);
+	st_check_not_null(strstr(profile, line));
+	st_check_int(lvm->gc.profile.stacks_length, 4);
+	
+	free(profile);
+	lvm_env_destroy(lvm, env);
+	lvm_gc_cleanup(lvm);
+}
+
+// Gives an env slots in the heap, lvm_env_new() only does that when memory.c
+// was built with GC_REGION_BAKER. Otherwise the calloc()ed slots are moved.
+static void init_heap_env(lvm_p lvm, lvm_env_p env, lvm_env_p parent) {
+	*env = (lvm_env_t){ .parent = parent };
+	lvm_dict_new_with_context(&env->bindings, lvm);
+	if ( lvm_gc_region_of(&lvm->gc.heap, env->bindings.slots) == NULL ) {
+		size_t size = lvm_dict_storage_size(env->bindings.capacity);
+		void* slots = lvm_gc_calloc(lvm, 1, size);
+		memcpy(slots, env->bindings.slots, size);
+		free(env->bindings.slots);
+		env->bindings.slots = slots;
+	}
+}
+
+static void free_heap_env_keys(lvm_env_p env) {
+	for(lvm_dict_it_p it = lvm_dict_start(&env->bindings); it != NULL; it = lvm_dict_next(&env->bindings, it))
+		free((void*)it->key);
+}
+
+void test_gc_env_slots() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	
+	// Slots are the data of an env atom that points back to it
+	lvm_env_t env, closure_env;
+	init_heap_env(lvm, &env, NULL);
+	init_heap_env(lvm, &closure_env, &env);
+	lvm_atom_p storage = ((lvm_atom_p*)env.bindings.slots)[-1];
+	st_check_int(lvm_atom_type(storage), LVM_T_ENV);
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.new_space, storage));
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.new_space, env.bindings.slots));
+	
+	lvm_dict_put(&env.bindings, "list", build_num_list(lvm, 100));
+	lvm_dict_put(&closure_env.bindings, "x", build_num_list(lvm, 1));
+	lvm_atom_p lambda = lvm_gc_alloc_atom(lvm, LVM_T_LAMBDA);
+	lambda->args = lvm->nil_atom;
+	lambda->body = lvm->nil_atom;
+	lambda->env = &closure_env;
+	lvm_dict_put(&env.bindings, "f", lambda);
+	
+	// The slots move with their atom, closure_env is only reachable through
+	// the lambda. Mark-compact might leave them in place, so only check their
+	// contents there.
+	for(size_t i = 0; i < 2; i++) {
+		void* slots_before = env.bindings.slots;
+		void* closure_slots_before = closure_env.bindings.slots;
+		lvm->gc.mark_compact = (i == 1);
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ &env, NULL });
+		
+		if (!lvm->gc.mark_compact) {
+			st_check(env.bindings.slots != slots_before);
+			st_check(closure_env.bindings.slots != closure_slots_before);
+		}
+		storage = ((lvm_atom_p*)env.bindings.slots)[-1];
+		st_check_int(lvm_atom_type(storage), LVM_T_ENV);
+		st_check(storage->bindings == &env.bindings);
+		st_check(lvm_gc_space_contains(lvm, &lvm->gc.new_space, env.bindings.slots));
+		
+		lvm_atom_p list = lvm_dict_get(&env.bindings, "list", NULL);
+		st_check_not_null(list);
+		st_check_int(lvm_pair_first(list)->num, 99);
+		lambda = lvm_dict_get(&env.bindings, "f", NULL);
+		st_check(lambda->env == &closure_env);
+		lvm_atom_p x = lvm_dict_get(&closure_env.bindings, "x", NULL);
+		st_check_not_null(x);
+		st_check_int(lvm_atom_type(x), LVM_T_PAIR);
+		st_check_int(lvm_pair_first(x)->num, 0);
+	}
+	
+	free_heap_env_keys(&closure_env);
+	free_heap_env_keys(&env);
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_immortal_atoms() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	
+	// A quoted list like '(foo 7), all of it allocated at the immortal site
+	uint16_t prev_site = lvm_gc_enter_immortal_site(lvm);
+	char* sym_data = NULL;
+	lvm_atom_p sym = lvm_gc_alloc(lvm, LVM_T_SYM, 4, (void**)&sym_data);
+	strcpy(sym_data, "foo");
+	sym->str = sym_data;
+	lvm_atom_p num = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	num->num = 7;
+	lvm_atom_p quoted = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(quoted, sym);
+	lvm_pair_set_rest(quoted, lvm_gc_alloc_atom(lvm, LVM_T_PAIR));
+	lvm_pair_set_first(lvm_pair_rest(quoted), num);
+	lvm_pair_set_rest(lvm_pair_rest(quoted), lvm->nil_atom);
+	lvm_gc_leave_alloc_site(lvm, prev_site);
+	
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.uncollected, sym));
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.uncollected, sym_data));
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.uncollected, lvm_pair_rest(quoted)));
+	st_check_int(lvm_gc_used_bytes_of_space(&lvm->gc.new_space), 0);
+	
+	// Only the pair referencing the immortal atoms and nil is copied, the
+	// immortal atoms themselves stay where they are
+	lvm_atom_p pair = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(pair, quoted);
+	lvm_pair_set_rest(pair, lvm->nil_atom);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &pair, NULL }, (lvm_env_p[]){ NULL });
+	st_check_int(lvm_gc_used_bytes_of_space(&lvm->gc.new_space), lvm_gc_atom_infos[LVM_T_PAIR].size);
+	st_check(lvm_pair_first(pair) == quoted);
+	st_check(lvm_pair_rest(pair) == lvm->nil_atom);
+	st_check_int(lvm_atom_type(lvm->nil_atom), LVM_T_NIL);
+	st_check(lvm_pair_first(quoted) == sym);
+	st_check_str(sym->str, "foo");
+	st_check_int(lvm_pair_first(lvm_pair_rest(quoted))->num, 7);
+	
+	// Same for the mark-compact collector
+	lvm->gc.mark_compact = true;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &pair, NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm_pair_first(pair) == quoted);
+	st_check(lvm_pair_rest(pair) == lvm->nil_atom);
+	st_check_int(lvm_pair_first(lvm_pair_rest(quoted))->num, 7);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_pinning() {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_mark_compact = true });
+	lvm_gc_stats_t stats;
+	
+	char* buffer = NULL;
+	lvm_atom_p str = lvm_gc_alloc(lvm, LVM_T_STR, 16, (void**)&buffer);
+	strcpy(buffer, "pinned buffer");
+	str->str = buffer;
+	lvm_atom_p pair = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(pair, str);
+	lvm_pair_set_rest(pair, lvm->nil_atom);
+	lvm_atom_p pair_before = pair;
+	
+	// The pinned string stays in place (even without other references), the
+	// pair next to it is moved. Pins force the copying collector.
+	lvm_pin(lvm, str);
+	lvm_pin(lvm, str);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &pair, NULL }, (lvm_env_p[]){ NULL });
+	st_check(pair != pair_before);
+	st_check(lvm_pair_first(pair) == str);
+	st_check(str->str == buffer);
+	st_check_str(buffer, "pinned buffer");
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.pinned_regions, 1);
+	st_check_int(stats.new_space_regions, 2);
+	
+	// Pins nest, after the first unpin the string still stays where it is
+	lvm_unpin(lvm, str);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &pair, NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm_pair_first(pair) == str);
+	st_check(str->str == buffer);
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.pinned_regions, 1);
+	
+	// Once unpinned the copying collector moves the string and releases the
+	// pinned region
+	lvm->gc.mark_compact = false;
+	lvm_unpin(lvm, str);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &pair, NULL }, (lvm_env_p[]){ NULL });
+	st_check(lvm_pair_first(pair) != str);
+	st_check(lvm_pair_first(pair)->str != buffer);
+	st_check_str(lvm_pair_first(pair)->str, "pinned buffer");
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.pinned_regions, 0);
+	// With LVM_BIBOP the pair is in a page of its own
+#	ifndef LVM_BIBOP
+	st_check_int(stats.new_space_regions, 1);
+#	endif
+	
+	lvm_gc_cleanup(lvm);
+}
+
+static lvm_atom_p alloc_num(lvm_p lvm, int64_t value) {
+	lvm_atom_p num = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	num->num = value;
+	return num;
+}
+
+static lvm_atom_p alloc_weak_table(lvm_p lvm) {
+	lvm_atom_p table = lvm_gc_alloc_atom(lvm, LVM_T_WEAK_TABLE);
+	table->entries = NULL;
+	table->length = table->capacity = 0;
+	table->needs_rehash = false;
+	return table;
+}
+
+void test_gc_weak_refs() {
+	for(size_t mark_compact = 0; mark_compact <= 1; mark_compact++) {
+		lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_mark_compact = mark_compact });
+		
+		lvm_atom_p kept = alloc_num(lvm, 1);
+		lvm_atom_p weak_to_garbage = lvm_gc_alloc_atom(lvm, LVM_T_WEAK);
+		weak_to_garbage->target = alloc_num(lvm, 2);
+		lvm_atom_p weak_to_kept = lvm_gc_alloc_atom(lvm, LVM_T_WEAK);
+		weak_to_kept->target = kept;
+		
+		// Values are kept as long as their key is reachable, the value of the
+		// kept key reaches another key
+		lvm_atom_p table = alloc_weak_table(lvm);
+		lvm_atom_p key_reached_by_value = alloc_num(lvm, 3);
+		lvm_atom_p value = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+		lvm_pair_set_first(value, key_reached_by_value);
+		lvm_pair_set_rest(value, lvm->nil_atom);
+		lvm_weak_table_put(lvm, table, kept, value);
+		lvm_weak_table_put(lvm, table, key_reached_by_value, alloc_num(lvm, 4));
+		lvm_weak_table_put(lvm, table, alloc_num(lvm, 5), alloc_num(lvm, 6));
+		st_check_int(table->length, 3);
+		
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ &kept, &weak_to_garbage, &weak_to_kept, &table, NULL }, (lvm_env_p[]){ NULL });
+		st_check(weak_to_garbage->target == lvm->nil_atom);
+		st_check(weak_to_kept->target == kept);
+		st_check_int(kept->num, 1);
+		
+		st_check_int(table->length, 2);
+		lvm_atom_p kept_value = lvm_weak_table_get(lvm, table, kept);
+		st_check_int(lvm_atom_type(kept_value), LVM_T_PAIR);
+		st_check_int(lvm_pair_first(kept_value)->num, 3);
+		st_check_int(lvm_weak_table_get(lvm, table, lvm_pair_first(kept_value))->num, 4);
+		
+		lvm_gc_stats_t stats;
+		lvm_gc_stats(lvm, &stats);
+		st_check_int(stats.weak_refs_cleared, 2);
+		st_check(!table->needs_rehash);
+		
+		// Each value reaches the key of the next entry, all of them are kept
+		lvm_atom_p chain = alloc_weak_table(lvm);
+		lvm_atom_p chain_keys[10];
+		for(size_t i = 0; i < 10; i++)
+			chain_keys[i] = alloc_num(lvm, i);
+		for(size_t i = 10; i > 0; i--)
+			lvm_weak_table_put(lvm, chain, chain_keys[i - 1], (i < 10) ? chain_keys[i] : alloc_num(lvm, 10));
+		lvm_atom_p chain_start = chain_keys[0];
+		
+		// Keys that don't move don't need a rehash
+		lvm_atom_p immortal_keys = alloc_weak_table(lvm);
+		lvm_weak_table_put(lvm, immortal_keys, lvm->true_atom, lvm->false_atom);
+		
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ &chain, &chain_start, &immortal_keys, NULL }, (lvm_env_p[]){ NULL });
+		st_check_int(chain->length, 10);
+		lvm_atom_p key = chain_start;
+		for(size_t i = 1; i <= 10; i++) {
+			key = lvm_weak_table_get(lvm, chain, key);
+			st_check_not_null(key);
+			if (key == NULL)
+				break;
+			st_check_int(key->num, (int64_t)i);
+		}
+		st_check_int(immortal_keys->length, 1);
+		st_check(!immortal_keys->needs_rehash);
+		
+		// Weak tables free their entries once they're gone, lvm_weak_table_atom()
+		// only registers a finalizer when memory.c was built with GC_REGION_BAKER
+#		ifdef GC_REGION_BAKER
+		lvm_atom_p unreachable_table = lvm_weak_table_atom(lvm);
+		lvm_weak_table_put(lvm, unreachable_table, lvm->true_atom, lvm->false_atom);
+		lvm_gc_stats(lvm, &stats);
+		size_t finalized_atoms = stats.finalized_atoms;
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+		lvm_gc_stats(lvm, &stats);
+		st_check_int(stats.finalized_atoms, finalized_atoms + 1);
+#		endif
+		
+		lvm_gc_cleanup(lvm);
+	}
+}
+
+static void count_finalized_num(lvm_p lvm, lvm_atom_p atom, void* data) {
+	int64_t* sum = data;
+	*sum += atom->num;
+}
+
+void test_gc_finalization() {
+	for(size_t mark_compact = 0; mark_compact <= 1; mark_compact++) {
+		lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_mark_compact = mark_compact });
+		int64_t sum = 0;
+		
+		lvm_atom_p kept = alloc_num(lvm, 1);
+		lvm_finalize(lvm, kept, count_finalized_num, &sum);
+		lvm_finalize(lvm, alloc_num(lvm, 10), count_finalized_num, &sum);
+		lvm_finalize(lvm, alloc_num(lvm, 100), count_finalized_num, &sum);
+		lvm_atom_p unregistered = alloc_num(lvm, 1000);
+		lvm_finalize(lvm, unregistered, count_finalized_num, &sum);
+		lvm_finalize(lvm, unregistered, NULL, NULL);
+		st_check_int(lvm->gc.finalizers_length, 3);
+		
+		// Unreached atoms are finalized while they are still intact, reached
+		// ones stay in the table
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ &kept, NULL }, (lvm_env_p[]){ NULL });
+		st_check_int(sum, 110);
+		st_check_int(lvm->gc.finalizers_length, 1);
+		st_check(lvm->gc.finalizers_ptr[0].atom == kept);
+		lvm_gc_stats_t stats;
+		lvm_gc_stats(lvm, &stats);
+		st_check_int(stats.finalized_atoms, 2);
+		
+		lvm_gc_collect(lvm, (lvm_atom_p*[]){ &kept, NULL }, (lvm_env_p[]){ NULL });
+		st_check_int(sum, 110);
+		
+		// The entry of a moved atom is still found
+		lvm_finalize(lvm, kept, NULL, NULL);
+		st_check_int(lvm->gc.finalizers_length, 0);
+		lvm_finalize(lvm, kept, count_finalized_num, &sum);
+		st_check_int(lvm->gc.finalizers_length, 1);
+		
+		// Removing entries moves the last one into the gap
+		lvm_atom_p nums[100];
+		for(size_t i = 0; i < 100; i++) {
+			nums[i] = alloc_num(lvm, 0);
+			lvm_finalize(lvm, nums[i], count_finalized_num, &sum);
+		}
+		for(size_t i = 0; i < 100; i += 2)
+			lvm_finalize(lvm, nums[i], NULL, NULL);
+		st_check_int(lvm->gc.finalizers_length, 51);
+		for(size_t i = 1; i < 100; i += 2)
+			lvm_finalize(lvm, nums[i], NULL, NULL);
+		st_check_int(lvm->gc.finalizers_length, 1);
+		st_check(lvm->gc.finalizers_ptr[0].atom == kept);
+		
+		// Remaining finalizers run on cleanup
+		lvm_gc_cleanup(lvm);
+		st_check_int(sum, 111);
+	}
+}
+
+static lvm_atom_p alloc_str(lvm_p lvm, const char* value) {
+	char* data = NULL;
+	lvm_atom_p str = lvm_gc_alloc(lvm, LVM_T_STR, strlen(value) + 1, (void**)&data);
+	strcpy(data, value);
+	str->str = data;
+	return str;
+}
+
+void test_gc_string_dedup() {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_string_dedup = true });
+	lvm_gc_stats_t stats;
+	
+	lvm_atom_p list = lvm->nil_atom;
+	for(size_t i = 0; i < 10; i++) {
+		lvm_atom_p pair = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+		lvm_pair_set_first(pair, alloc_str(lvm, (i % 2 == 0) ? "record" : "other record"));
+		lvm_pair_set_rest(pair, list);
+		list = pair;
+	}
+	
+	// Equal strings share the data of the first copy
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, NULL }, (lvm_env_p[]){ NULL });
+	lvm_gc_stats(lvm, &stats);
+	st_check_int(stats.string_dedup_bytes, 4 * LVM_GC_ALIGN(sizeof("other record")) + 4 * LVM_GC_ALIGN(sizeof("record")));
+	for(lvm_atom_p it = list; lvm_pair_rest(it) != lvm->nil_atom && lvm_pair_rest(lvm_pair_rest(it)) != lvm->nil_atom; it = lvm_pair_rest(it)) {
+		st_check(lvm_pair_first(it)->str != lvm_pair_first(lvm_pair_rest(it))->str);
+		st_check(lvm_pair_first(it)->str == lvm_pair_first(lvm_pair_rest(lvm_pair_rest(it)))->str);
+	}
+	
+	// The mark-compact collector keeps the data shared
+	lvm->gc.mark_compact = true;
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ &list, NULL }, (lvm_env_p[]){ NULL });
+	for(lvm_atom_p it = list; lvm_pair_rest(it) != lvm->nil_atom && lvm_pair_rest(lvm_pair_rest(it)) != lvm->nil_atom; it = lvm_pair_rest(it)) {
+		st_check(lvm_pair_first(it)->str == lvm_pair_first(lvm_pair_rest(lvm_pair_rest(it)))->str);
+		st_check_str(lvm_pair_first(lvm_pair_rest(lvm_pair_rest(it)))->str, lvm_pair_first(it)->str);
+	}
+	st_check_str(lvm_pair_first(list)->str, "other record");
+	st_check_str(lvm_pair_first(lvm_pair_rest(list))->str, "record");
+	
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_background_sweep() {
+	lvm_p lvm = lvm_gc_init(&(lvm_options_t){ .gc_background_sweep = true });
+	lvm_gc_stats_t stats;
+	
+	// Fill more than the header page of the first region with garbage
+	lvm_gc_region_p region = lvm->gc.new_space.first;
+	lvm_atom_p garbage = NULL;
+	for(size_t i = 0; i < 1000; i++)
+		garbage = alloc_num(lvm, 0xdeadbeef);
+	st_check((char*)garbage - (char*)region > 4096);
+	
+	// The evacuated region goes to the sweeper. It can only get into the pool
+	// once it was swept.
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ NULL });
+	
+	for(size_t i = 0; i < 2000; i++) {
+		lvm_gc_stats(lvm, &stats);
+		if (stats.swept_regions > 0 && stats.regions_to_sweep == 0)
+			break;
+		usleep(1000);
+	}
+	st_check(stats.swept_regions > 0);
+	st_check_int(stats.regions_to_sweep, 0);
+	
+	// Swept regions got their pages released and are back in the pool on demand
+	st_check_int(garbage->num, 0);
+	lvm_gc_take_swept_regions(lvm);
+	st_check(lvm->gc.region_pool_length > 0);
+	
+	lvm_gc_cleanup(lvm);
+}
+
+#ifndef LVM_BIBOP
+static lvm_atom_p image_test_builtin(lvm_p lvm, size_t argc, lvm_atom_p argv[], lvm_env_p env) {
+	return lvm->true_atom;
+}
+
+static void check_loaded_image(lvm_p lvm) {
+	lvm_env_p env = lvm->base_env;
+	lvm_atom_p list = lvm_env_get(lvm, env, "list");
+	st_check(lvm_gc_space_contains(lvm, &lvm->gc.tenured_space, list));
+	size_t length = 0;
+	for(lvm_atom_p pair = list; lvm_atom_type(pair) == LVM_T_PAIR; pair = lvm_pair_rest(pair)) {
+		if (lvm_pair_first(pair)->num != (int64_t)(999 - length))
+			break;
+		length++;
+		if (lvm_pair_rest(pair) == lvm->nil_atom)
+			break;
+	}
+	st_check_int(length, 1000);
+	st_check_str(lvm_env_get(lvm, env, "greeting")->str, "hello image");
+	st_check(lvm_env_get(lvm, env, "nothing") == lvm->nil_atom);
+	st_check(lvm_env_get(lvm, env, "test-builtin")->builtin == image_test_builtin);
+	
+	// The lambda got its captured env back and symbols are still unique
+	lvm_atom_p lambda = lvm_env_get(lvm, env, "f");
+	st_check(lambda->env != env);
+	st_check(lambda->env->parent == env);
+	st_check_int(lvm_env_get(lvm, lambda->env, "x")->num, 42);
+	st_check(lvm_pair_first(lambda->args) == lvm_dict_get(&lvm->symbol_table, "answer", NULL));
+	st_check(lvm_pair_first(lambda->body) == lvm_pair_first(lambda->args));
+	
+	// Image atoms are tenured, so new atoms they point to survive collections
+	lvm_atom_p num = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	num->num = 7;
+	lvm_pair_set_first(list, num);
+	lvm_gc_collect(lvm, (lvm_atom_p*[]){ NULL }, (lvm_env_p[]){ env, NULL });
+	st_check(lvm_pair_first(list) != num);
+	st_check_int(lvm_pair_first(list)->num, 7);
+	
+	lvm_env_destroy(lvm, lambda->env);
+	lvm_env_destroy(lvm, env);
+	lvm_mem_free(lvm);
+	lvm_gc_cleanup(lvm);
+}
+
+void test_gc_heap_images() {
+	lvm_p lvm = lvm_gc_init(NULL);
+	lvm_dict_new_with_context(&lvm->symbol_table, lvm);
+	
+	lvm_atom_p answer = lvm_gc_alloc_atom(lvm, LVM_T_SYM);
+	answer->str = "answer";
+	lvm_dict_put(&lvm->symbol_table, "answer", answer);
+	lvm_atom_p greeting = lvm_gc_alloc_atom(lvm, LVM_T_STR);
+	greeting->str = lvm_gc_alloc_data(lvm, 12);
+	strcpy(greeting->str, "hello image");
+	lvm_atom_p builtin = lvm_gc_alloc_atom(lvm, LVM_T_BUILTIN);
+	builtin->builtin = image_test_builtin;
+	
+	lvm_env_p env = lvm_env_new(lvm, NULL), lambda_env = lvm_env_new(lvm, env);
+	lvm_atom_p x = lvm_gc_alloc_atom(lvm, LVM_T_NUM);
+	x->num = 42;
+	lvm_env_put(lvm, lambda_env, "x", x);
+	lvm_atom_p lambda = lvm_gc_alloc_atom(lvm, LVM_T_LAMBDA);
+	lambda->args = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(lambda->args, answer);
+	lvm_pair_set_rest(lambda->args, lvm->nil_atom);
+	lambda->body = lvm_gc_alloc_atom(lvm, LVM_T_PAIR);
+	lvm_pair_set_first(lambda->body, answer);
+	lvm_pair_set_rest(lambda->body, lvm->nil_atom);
+	lambda->env = lambda_env;
+	
+	lvm_env_put(lvm, env, "list", build_num_list(lvm, 1000));
+	lvm_env_put(lvm, env, "greeting", greeting);
+	lvm_env_put(lvm, env, "nothing", lvm->nil_atom);
+	lvm_env_put(lvm, env, "test-builtin", builtin);
+	lvm_env_put(lvm, env, "f", lambda);
+	lvm->base_env = env;
+	
+	char path[] = "/tmp/lvm_image_test_XXXXXX";
+	close(mkstemp(path));
+	
+	// Weak references can't be saved
+	lvm_env_p weak_env = lvm_env_new(lvm, NULL);
+	lvm_atom_p weak = lvm_gc_alloc_atom(lvm, LVM_T_WEAK);
+	weak->target = greeting;
+	lvm_env_put(lvm, weak_env, "weak", weak);
+	lvm->base_env = weak_env;
+	st_check(!lvm_image_save(lvm, path));
+	lvm->base_env = env;
+	lvm_env_destroy(lvm, weak_env);
+	
+	st_check(lvm_image_save(lvm, path));
+	void* heap_base = lvm->gc.heap.base;
+	
+	// Our heap is still there so the image has to be relocated
+	lvm_p loaded = lvm_image_load(path, NULL);
+	st_check_not_null(loaded);
+	st_check(loaded->gc.heap.base != heap_base);
+	check_loaded_image(loaded);
+	
+	// Now the image can be loaded at the address it was saved for
+	lvm_env_destroy(lvm, lambda_env);
+	lvm_env_destroy(lvm, env);
+	lvm_dict_destroy(&lvm->symbol_table);
+	lvm_gc_cleanup(lvm);
+	loaded = lvm_image_load(path, NULL);
+	st_check_not_null(loaded);
+	st_check(loaded->gc.heap.base == heap_base);
+	check_loaded_image(loaded);
+	
+	unlink(path);
+	st_check_null(lvm_image_load(path, NULL));
+}
+#endif
 
 int main() {
 	st_run(test_gc_init_and_cleanup);
 	st_run(test_gc_alloc);
 	st_run(test_gc_collect);
+	st_run(test_gc_large_atoms);
+	st_run(test_gc_large_atoms_promoted_on_collect);
+	st_run(test_gc_region_pool);
+	st_run(test_gc_region_options);
+	st_run(test_gc_reserved_heap);
+	st_run(test_gc_exact_atom_sizes);
+#	ifdef LVM_BIBOP
+	st_run(test_gc_bibop_pages);
+#	endif
+	st_run(test_gc_stats);
+	st_run(test_gc_heap_dump);
+	st_run(test_gc_handle_scopes);
+	// LVM_BIBOP always uses the copying collector and headerless atoms don't
+	// record their allocation site
+#	ifndef LVM_BIBOP
+	st_run(test_gc_mark_compact);
+#	endif
+	st_run(test_gc_adaptive_heap_sizing);
+	st_run(test_gc_cgroup_limits);
+#	ifndef LVM_BIBOP
+	st_run(test_gc_pretenuring);
+	st_run(test_gc_major_collections);
+#	endif
+	st_run(test_gc_tenure);
+	st_run(test_gc_allocation_profiler);
+	st_run(test_gc_env_slots);
+	st_run(test_gc_immortal_atoms);
+	st_run(test_gc_pinning);
+	st_run(test_gc_weak_refs);
+	st_run(test_gc_finalization);
+	st_run(test_gc_string_dedup);
+	st_run(test_gc_background_sweep);
+#	ifndef LVM_BIBOP
+	st_run(test_gc_heap_images);
+#	endif
 	return st_show_report();
 }
\ No newline at end of file
@@ -0,0 +1,8 @@
+// The slim_hash tests with the scalar group matching loops, the ones used when
+// SSE2 isn't available
+#define SLIM_HASH_NO_SSE2
+#include "slim_hash_test.c"
+
+#ifdef SH_GROUP_SSE2
+#error "slim_hash.h still uses SSE2 with SLIM_HASH_NO_SSE2"
+#endif
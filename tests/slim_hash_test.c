@@ -0,0 +1,233 @@
+#include <stdio.h>
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+
+#define SLIM_HASH_IMPLEMENTATION
+#include "../slim_hash.h"
+
+// Group layout tables with int64_t keys and values. same_hash gives all keys
+// the same hash so they all want the same group and have the same control
+// byte, murmur_hash spreads them.
+static uint32_t constant_hash(int64_t key) {
+	return 42;
+}
+
+SH_GEN_GROUP_DECL(same_hash, int64_t, int64_t);
+SH_GEN_GROUP_DEF(same_hash, int64_t, int64_t, constant_hash(key), (a == b), key, 0);
+SH_GEN_GROUP_DECL(murmur_hash, int64_t, int64_t);
+SH_GEN_GROUP_HASH_DEF(murmur_hash, int64_t, int64_t);
+
+static uint32_t first_group_of(uint32_t hash, uint32_t capacity) {
+	return (hash >> 7) & (capacity - 1) & ~(SH_GROUP_WIDTH - 1);
+}
+
+void test_group_match() {
+	uint8_t group[SH_GROUP_WIDTH];
+	memset(group, SH_CTRL_EMPTY, sizeof(group));
+	group[0] = 0x2A;
+	group[3] = SH_CTRL_DELETED;
+	group[7] = 0x2A;
+	group[15] = 0x00;
+	
+	st_check_int(sh_group_match(group, 0x2A), (1 << 0) | (1 << 7));
+	st_check_int(sh_group_match(group, 0x00), 1 << 15);
+	st_check_int(sh_group_match(group, 0x7F), 0);
+	st_check_int(sh_group_match(group, SH_CTRL_DELETED), 1 << 3);
+	st_check_int(sh_group_match_free(group), 0xFFFF & ~((1 << 0) | (1 << 7) | (1 << 15)));
+}
+
+void test_group_collisions() {
+	same_hash_t hash;
+	same_hash_new(&hash);
+	
+	// More keys than one group has slots, the others spill into the next groups
+	for(int64_t i = 0; i < 40; i++)
+		same_hash_put(&hash, i, i * 10);
+	st_check_int(hash.length, 40);
+	for(int64_t i = 0; i < 40; i++)
+		st_check_int(same_hash_get(&hash, i, -1), i * 10);
+	st_check_int(same_hash_get(&hash, 40, -1), -1);
+	
+	// The first group of the hash is full, all keys have the same control byte
+	uint8_t* ctrl = same_hash_ctrl(&hash);
+	uint32_t first_group = first_group_of(42, hash.capacity);
+	st_check_int(sh_group_match(ctrl + first_group, 42), 0xFFFF);
+	size_t filled = 0;
+	for(uint32_t i = 0; i < hash.capacity; i++)
+		filled += (ctrl[i] == 42);
+	st_check_int(filled, 40);
+	
+	// Deleted slots of the first group don't end the probe sequence
+	for(int64_t i = 0; i < 8; i++)
+		st_check(same_hash_del(&hash, i));
+	for(int64_t i = 8; i < 40; i++)
+		st_check_int(same_hash_get(&hash, i, -1), i * 10);
+	st_check(!same_hash_contains(&hash, 0));
+	
+	same_hash_destroy(&hash);
+}
+
+void test_group_tombstone_reuse() {
+	same_hash_t hash;
+	same_hash_new(&hash);
+	for(int64_t i = 0; i < 20; i++)
+		same_hash_put(&hash, i, i);
+	uint32_t capacity = hash.capacity;
+	
+	// The key is in the full first group, a new key takes its slot
+	int64_t* deleted_slot = same_hash_get_ptr(&hash, 3);
+	st_check(same_hash_del(&hash, 3));
+	st_check_int(hash.deleted, 1);
+	st_check_int(hash.length, 19);
+	
+	same_hash_put(&hash, 100, 100);
+	st_check(same_hash_get_ptr(&hash, 100) == deleted_slot);
+	st_check_int(hash.deleted, 0);
+	st_check_int(hash.length, 20);
+	st_check_int(hash.capacity, capacity);
+	
+	// Putting an existing key neither takes a slot nor counts it twice
+	same_hash_put(&hash, 100, 101);
+	st_check_int(hash.length, 20);
+	st_check_int(same_hash_get(&hash, 100, -1), 101);
+	
+	same_hash_destroy(&hash);
+}
+
+void test_group_rehash_in_place() {
+	murmur_hash_t hash;
+	murmur_hash_new(&hash);
+	for(int64_t i = 0; i < 50; i++)
+		murmur_hash_put(&hash, i, i);
+	st_check_int(hash.capacity, 64);
+	for(int64_t i = 0; i < 20; i++)
+		st_check(murmur_hash_del(&hash, i));
+	st_check_int(hash.length, 30);
+	st_check_int(hash.deleted, 20);
+	
+	// Once filled and deleted slots reach 7/8 of the capacity the table is
+	// rehashed without growing, that drops the deleted slots
+	bool rehashed = false;
+	for(int64_t i = 1000; !rehashed; i++) {
+		bool full = (uint64_t)(hash.length + hash.deleted + 1) * 8 > (uint64_t)hash.capacity * 7;
+		murmur_hash_put(&hash, i, i);
+		if (full) {
+			st_check_int(hash.capacity, 64);
+			st_check_int(hash.deleted, 0);
+			rehashed = true;
+		}
+		st_check(i < 1100);
+	}
+	
+	for(int64_t i = 0; i < 20; i++)
+		st_check(!murmur_hash_contains(&hash, i));
+	for(int64_t i = 20; i < 50; i++)
+		st_check_int(murmur_hash_get(&hash, i, -1), i);
+	size_t iterated = 0;
+	for(murmur_hash_it_p it = murmur_hash_start(&hash); it != NULL; it = murmur_hash_next(&hash, it))
+		iterated++;
+	st_check_int(iterated, hash.length);
+	
+	murmur_hash_destroy(&hash);
+}
+
+void test_group_shrink_on_del() {
+	murmur_hash_t hash;
+	murmur_hash_new(&hash);
+	for(int64_t i = 0; i < 100; i++)
+		murmur_hash_put(&hash, i, i);
+	st_check_int(hash.capacity, 128);
+	
+	uint32_t prev_capacity = hash.capacity;
+	size_t shrinks = 0;
+	for(int64_t i = 0; i < 100; i++) {
+		st_check(murmur_hash_del(&hash, i));
+		if (hash.capacity != prev_capacity) {
+			st_check_int(hash.capacity, prev_capacity / 2);
+			st_check_int(hash.deleted, 0);
+			prev_capacity = hash.capacity;
+			shrinks++;
+		}
+		st_check((uint64_t)hash.length * 8 <= (uint64_t)hash.capacity * 7);
+		for(int64_t j = i + 1; j < 100; j++)
+			st_check_int(murmur_hash_get(&hash, j, -1), j);
+	}
+	
+	// Never smaller than one group
+	st_check(shrinks > 0);
+	st_check_int(hash.capacity, SH_GROUP_WIDTH);
+	st_check_int(hash.length, 0);
+	st_check(!murmur_hash_del(&hash, 0));
+	
+	murmur_hash_destroy(&hash);
+}
+
+void test_group_remove_during_iteration() {
+	murmur_hash_t hash;
+	murmur_hash_new(&hash);
+	for(int64_t i = 0; i < 100; i++)
+		murmur_hash_put(&hash, i, i);
+	
+	size_t visited = 0;
+	for(murmur_hash_it_p it = murmur_hash_start(&hash); it != NULL; it = murmur_hash_next(&hash, it)) {
+		visited++;
+		if (it->key % 2 == 0)
+			murmur_hash_remove(&hash, it);
+	}
+	
+	st_check_int(visited, 100);
+	st_check_int(hash.length, 50);
+	for(int64_t i = 0; i < 100; i++)
+		st_check_int(murmur_hash_contains(&hash, i), (i % 2 == 1));
+	
+	murmur_hash_destroy(&hash);
+}
+
+// Random puts and deletes, compared against a plain array
+void test_group_random_ops() {
+	enum { KEYS = 1000 };
+	int64_t values[KEYS];
+	bool present[KEYS] = { false };
+	murmur_hash_t hash;
+	murmur_hash_new(&hash);
+	
+	uint32_t state = 12345;
+	size_t length = 0;
+	for(size_t op = 0; op < 50000; op++) {
+		state = state * 1103515245 + 12345;
+		int64_t key = (state >> 8) % KEYS;
+		// Mostly puts at first, mostly deletes later so the table grows and shrinks
+		bool put = ((state >> 24) % 100) < ((op < 25000) ? 70 : 30);
+		if (put) {
+			length += !present[key];
+			present[key] = true;
+			values[key] = op;
+			murmur_hash_put(&hash, key, op);
+		} else {
+			st_check_int(murmur_hash_del(&hash, key), present[key]);
+			length -= present[key];
+			present[key] = false;
+		}
+		
+		if (op % 1000 == 0) {
+			st_check_int(hash.length, length);
+			for(int64_t k = 0; k < KEYS; k++)
+				st_check_int(murmur_hash_get(&hash, k, -1), present[k] ? values[k] : -1);
+		}
+	}
+	
+	murmur_hash_destroy(&hash);
+}
+
+
+int main() {
+	st_run(test_group_match);
+	st_run(test_group_collisions);
+	st_run(test_group_tombstone_reuse);
+	st_run(test_group_rehash_in_place);
+	st_run(test_group_shrink_on_del);
+	st_run(test_group_remove_during_iteration);
+	st_run(test_group_random_ops);
+	return st_show_report();
+}
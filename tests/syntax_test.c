@@ -35,7 +35,7 @@ void test_syntax() {
 	
 	char* out_stream_ptr = NULL;
 	size_t out_stream_size = 0;
-	lvm_p lvm = lvm_new();
+	lvm_p lvm = lvm_new(NULL);
 	
 	for(size_t i = 0; i < (sizeof(test_cases) / sizeof(test_cases[0])); i++) {
 		char* in = test_cases[i].in;
@@ -64,7 +64,7 @@ void test_syntax() {
 }
 
 void test_symbol_pooling() {
-	lvm_p lvm = lvm_new();
+	lvm_p lvm = lvm_new(NULL);
 	
 	FILE* in_stream = NULL;
 	char* symbol_str = "some_fancy_symbol_name";
@@ -0,0 +1,234 @@
+/**
+
+Queries an object graph written by lvm_heap_dump(). Usage:
+
+	heap_analyzer graph-file types
+		Count and bytes per atom type.
+	heap_analyzer graph-file referrers address
+		All atoms and roots that point to the atom at address.
+	heap_analyzer graph-file path address
+		Shortest chain of references from a root to the atom at address. Useful
+		to find out why an atom is still alive.
+
+**/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../slim_hash.h"
+
+SH_GEN_DECL(index_hash, uintptr_t, size_t);
+#define SLIM_HASH_IMPLEMENTATION
+#include "../slim_hash.h"
+SH_GEN_HASH_DEF(index_hash, uintptr_t, size_t);
+
+
+typedef struct {
+	uintptr_t address;
+	char* type;
+	size_t size;
+	uintptr_t* children;
+	size_t children_length;
+} atom_t, *atom_p;
+
+typedef struct {
+	char* description;
+	uintptr_t address;
+} root_t, *root_p;
+
+static atom_p atoms = NULL;
+static size_t atoms_length = 0, atoms_capacity = 0;
+static root_p roots = NULL;
+static size_t roots_length = 0, roots_capacity = 0;
+static index_hash_t atom_indices;
+
+
+static uintptr_t parse_address(const char* text) {
+	return (uintptr_t)strtoull(text, NULL, 16);
+}
+
+static void read_graph(FILE* input) {
+	char* line = NULL;
+	size_t line_size = 0;
+	
+	while ( getline(&line, &line_size, input) != -1 ) {
+		line[strcspn(line, "\n")] = '\0';
+		char* saveptr = NULL;
+		char* kind = strtok_r(line, " ", &saveptr);
+		if (kind == NULL)
+			continue;
+		
+		if ( strcmp(kind, "root") == 0 ) {
+			char* root_kind = strtok_r(NULL, " ", &saveptr);
+			char* name = strtok_r(NULL, " ", &saveptr);
+			char* address = strtok_r(NULL, " ", &saveptr);
+			if (root_kind == NULL || name == NULL || address == NULL)
+				continue;
+			
+			if (roots_length >= roots_capacity) {
+				roots_capacity = (roots_capacity + 1) * 2;
+				roots = realloc(roots, roots_capacity * sizeof(roots[0]));
+			}
+			root_p root = &roots[roots_length++];
+			asprintf(&root->description, "%s %s", root_kind, name);
+			root->address = parse_address(address);
+		} else if ( strcmp(kind, "atom") == 0 ) {
+			char* address = strtok_r(NULL, " ", &saveptr);
+			char* type = strtok_r(NULL, " ", &saveptr);
+			char* size = strtok_r(NULL, " ", &saveptr);
+			if (address == NULL || type == NULL || size == NULL)
+				continue;
+			
+			if (atoms_length >= atoms_capacity) {
+				atoms_capacity = (atoms_capacity + 1) * 2;
+				atoms = realloc(atoms, atoms_capacity * sizeof(atoms[0]));
+			}
+			atom_p atom = &atoms[atoms_length];
+			*atom = (atom_t){ .address = parse_address(address), .type = strdup(type), .size = strtoull(size, NULL, 10) };
+			
+			size_t children_capacity = 0;
+			for(char* child = strtok_r(NULL, " ", &saveptr); child != NULL; child = strtok_r(NULL, " ", &saveptr)) {
+				if (atom->children_length >= children_capacity) {
+					children_capacity = (children_capacity + 1) * 2;
+					atom->children = realloc(atom->children, children_capacity * sizeof(atom->children[0]));
+				}
+				atom->children[atom->children_length++] = parse_address(child);
+			}
+			
+			index_hash_put(&atom_indices, atom->address, atoms_length);
+			atoms_length++;
+		}
+	}
+	
+	free(line);
+}
+
+
+static void print_types() {
+	// Only a handful of types, a linear search is good enough
+	char* types[32];
+	size_t counts[32] = { 0 }, bytes[32] = { 0 }, types_length = 0;
+	size_t total_bytes = 0;
+	
+	for(size_t i = 0; i < atoms_length; i++) {
+		size_t t = 0;
+		while (t < types_length && strcmp(types[t], atoms[i].type) != 0)
+			t++;
+		if (t == types_length) {
+			if (types_length >= 32)
+				continue;
+			types[types_length++] = atoms[i].type;
+		}
+		
+		counts[t]++;
+		bytes[t] += atoms[i].size;
+		total_bytes += atoms[i].size;
+	}
+	
+	for(size_t t = 0; t < types_length; t++)
+		printf("%-24s %10zu atoms %10zu bytes\n", types[t], counts[t], bytes[t]);
+	printf("%-24s %10zu atoms %10zu bytes\n", "total", atoms_length, total_bytes);
+}
+
+static void print_referrers(uintptr_t address) {
+	for(size_t i = 0; i < roots_length; i++) {
+		if (roots[i].address == address)
+			printf("%s\n", roots[i].description);
+	}
+	
+	for(size_t i = 0; i < atoms_length; i++) {
+		for(size_t c = 0; c < atoms[i].children_length; c++) {
+			if (atoms[i].children[c] == address) {
+				printf("atom %#" PRIxPTR " %s\n", atoms[i].address, atoms[i].type);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Breadth first search from all roots. For each reached atom we remember the
+ * atom (or root) we reached it from. Those are then followed backwards from the
+ * target to print the path.
+ */
+static int print_path(uintptr_t address) {
+	size_t* queue = malloc(atoms_length * sizeof(queue[0]));
+	// Index of the atom we came from, SIZE_MAX - root index for roots,
+	// SIZE_MAX for unvisited atoms
+	size_t* reached_from = malloc(atoms_length * sizeof(reached_from[0]));
+	for(size_t i = 0; i < atoms_length; i++)
+		reached_from[i] = SIZE_MAX;
+	size_t queue_start = 0, queue_end = 0;
+	
+	for(size_t r = 0; r < roots_length; r++) {
+		size_t index = index_hash_get(&atom_indices, roots[r].address, SIZE_MAX);
+		if (index != SIZE_MAX && reached_from[index] == SIZE_MAX) {
+			reached_from[index] = SIZE_MAX - 1 - r;
+			queue[queue_end++] = index;
+		}
+	}
+	
+	while (queue_start < queue_end) {
+		atom_p atom = &atoms[queue[queue_start++]];
+		for(size_t c = 0; c < atom->children_length; c++) {
+			size_t index = index_hash_get(&atom_indices, atom->children[c], SIZE_MAX);
+			if (index != SIZE_MAX && reached_from[index] == SIZE_MAX) {
+				reached_from[index] = atom - atoms;
+				queue[queue_end++] = index;
+			}
+		}
+	}
+	
+	int result = 0;
+	size_t index = index_hash_get(&atom_indices, address, SIZE_MAX);
+	if (index == SIZE_MAX || reached_from[index] == SIZE_MAX) {
+		fprintf(stderr, "atom %#" PRIxPTR " isn't reachable from any root\n", address);
+		result = 1;
+	} else {
+		// Print from the target up to the root
+		while (index < atoms_length) {
+			printf("atom %#" PRIxPTR " %s\n", atoms[index].address, atoms[index].type);
+			index = reached_from[index];
+			if (index >= SIZE_MAX - roots_length) {
+				printf("%s\n", roots[SIZE_MAX - 1 - index].description);
+				break;
+			}
+		}
+	}
+	
+	free(reached_from);
+	free(queue);
+	return result;
+}
+
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s graph-file types|referrers address|path address\n", argv[0]);
+		return 1;
+	}
+	
+	FILE* input = fopen(argv[1], "r");
+	if (input == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	index_hash_new(&atom_indices);
+	read_graph(input);
+	fclose(input);
+	
+	if ( strcmp(argv[2], "types") == 0 ) {
+		print_types();
+	} else if ( strcmp(argv[2], "referrers") == 0 && argc >= 4 ) {
+		print_referrers(parse_address(argv[3]));
+	} else if ( strcmp(argv[2], "path") == 0 && argc >= 4 ) {
+		return print_path(parse_address(argv[3]));
+	} else {
+		fprintf(stderr, "unknown query: %s\n", argv[2]);
+		return 1;
+	}
+	
+	return 0;
+}